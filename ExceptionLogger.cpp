@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ExceptionLogger"
+#include "ALog-priv.h"
+
+#include "ExceptionLogger.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+// The number of exceptions that can be waiting to be logged. Must be a power
+// of two.
+constexpr size_t kQueueCapacity = 256;
+
+// Tags longer than this are truncated.
+constexpr size_t kMaxTagLength = 32;
+
+// Each distinct exception is logged at most once per window.
+constexpr std::chrono::seconds kRateLimitWindow(10);
+
+// The number of distinct exceptions whose repeats are tracked.
+constexpr size_t kMaxTrackedExceptions = 128;
+
+struct Entry {
+    jthrowable exception;  // Global reference.
+    ExceptionLogger::KeyFunction key;
+    ExceptionLogger::FormatFunction format;
+    int priority;
+    char tag[kMaxTagLength];
+};
+
+// Bounded lock-free queue with any number of producers and a single consumer.
+//
+// Each slot carries a sequence number: a slot at position p is free for the
+// producer claiming position p when its sequence is p, and holds an entry for
+// the consumer when its sequence is p + 1.
+class EntryQueue {
+  public:
+    EntryQueue() {
+        for (size_t i = 0; i < kQueueCapacity; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool TryPush(const Entry& entry) {
+        size_t position = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[position & (kQueueCapacity - 1)];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence - position);
+            if (difference == 0) {
+                if (tail_.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed)) {
+                    slot.entry = entry;
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;  // Full.
+            } else {
+                position = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Must only be called from the consumer thread.
+    bool Empty() const {
+        const Slot& slot = slots_[head_ & (kQueueCapacity - 1)];
+        return slot.sequence.load(std::memory_order_acquire) != head_ + 1;
+    }
+
+    // Must only be called from the consumer thread.
+    bool TryPop(Entry* entry) {
+        Slot& slot = slots_[head_ & (kQueueCapacity - 1)];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != head_ + 1) {
+            return false;  // Empty.
+        }
+        *entry = slot.entry;
+        slot.sequence.store(head_ + kQueueCapacity, std::memory_order_release);
+        ++head_;
+        return true;
+    }
+
+  private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Entry entry;
+    };
+
+    Slot slots_[kQueueCapacity];
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) size_t head_ = 0;
+};
+
+// Repeats of one distinct exception.
+struct RepeatState {
+    std::chrono::steady_clock::time_point lastLogged;
+    size_t suppressed = 0;
+    // The priority and tag of the last repeat suppressed.
+    int priority = 0;
+    char tag[kMaxTagLength] = {};
+};
+
+using RepeatStates = std::unordered_map<std::string, RepeatState>;
+
+// The queue and the objects used to wait on the logging thread. They are never
+// destroyed: the thread is detached, and may still be waiting for exceptions
+// while the process exits.
+struct Shared {
+    EntryQueue queue;
+    // Guards the state below, and is held by the logging thread while it
+    // checks whether to wait.
+    std::mutex mutex;
+    // Notified when an exception is queued or the thread is asked to stop.
+    std::condition_variable wakeup;
+    // Notified when the thread has attached, or failed to, and when it exits.
+    std::condition_variable threadChanged;
+};
+
+Shared& GetShared() {
+    static Shared* shared = new Shared();
+    return *shared;
+}
+
+// The number of exceptions dropped because the queue was full.
+std::atomic<size_t> g_dropped(0);
+
+// Whether the logging thread is running and attached. Exceptions are not
+// queued if it is not, as nothing would release them.
+std::atomic<bool> g_thread_available(false);
+
+// Whether the logging thread is, or is about to be, waiting on Shared::wakeup.
+// Lets Enqueue() skip Shared::mutex while the thread is busy.
+std::atomic<bool> g_thread_waiting(false);
+
+// Whether a thread has been started since the last Stop(), even if it failed
+// to attach. Starting is not retried until the logger is stopped.
+bool g_thread_started = false;
+
+// Whether the logging thread is running, until it has detached and is about
+// to exit.
+bool g_thread_running = false;
+
+// Whether the logging thread has finished trying to attach.
+bool g_thread_attach_done = false;
+
+// Set by Stop() to make the logging thread exit once the queue is empty.
+bool g_stopping = false;
+
+void LogSuppressed(const std::string& key, RepeatState& state) {
+    __android_log_print(state.priority, state.tag, "Suppressed %zu repeats of: %s",
+                        state.suppressed, key.c_str());
+    state.suppressed = 0;
+}
+
+// Logs the repeats suppressed in windows that have ended by |now|. Returns when
+// the next window with suppressed repeats ends, or time_point::max() if none.
+std::chrono::steady_clock::time_point LogExpiredRepeats(
+        RepeatStates& states, std::chrono::steady_clock::time_point now) {
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (auto& state : states) {
+        if (state.second.suppressed == 0) {
+            continue;
+        }
+        auto windowEnd = state.second.lastLogged + kRateLimitWindow;
+        if (windowEnd <= now) {
+            LogSuppressed(state.first, state.second);
+        } else if (windowEnd < next) {
+            next = windowEnd;
+        }
+    }
+    return next;
+}
+
+// Stops tracking exceptions that have not been repeated within their window. If
+// that does not free enough space, all tracking is reset. Repeats suppressed by
+// the exceptions no longer tracked are logged first.
+void TrimRepeatStates(RepeatStates& states, std::chrono::steady_clock::time_point now) {
+    for (auto it = states.begin(); it != states.end();) {
+        if (now - it->second.lastLogged >= kRateLimitWindow) {
+            if (it->second.suppressed != 0) {
+                LogSuppressed(it->first, it->second);
+            }
+            it = states.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (states.size() >= kMaxTrackedExceptions) {
+        for (auto& state : states) {
+            if (state.second.suppressed != 0) {
+                LogSuppressed(state.first, state.second);
+            }
+        }
+        states.clear();
+    }
+}
+
+void LogEntry(JNIEnv* env, const Entry& entry, std::string& key, std::string& trace,
+              RepeatStates& states) {
+    key.clear();
+    entry.key(env, entry.exception, key);
+
+    auto now = std::chrono::steady_clock::now();
+    auto it = states.find(key);
+    if (it != states.end() && now - it->second.lastLogged < kRateLimitWindow) {
+        // A repeat: count it without formatting it.
+        env->DeleteGlobalRef(entry.exception);
+        RepeatState& state = it->second;
+        ++state.suppressed;
+        state.priority = entry.priority;
+        memcpy(state.tag, entry.tag, sizeof(state.tag));
+        return;
+    }
+
+    trace.clear();
+    entry.format(env, entry.exception, trace);
+    env->DeleteGlobalRef(entry.exception);
+
+    if (it == states.end()) {
+        if (states.size() >= kMaxTrackedExceptions) {
+            TrimRepeatStates(states, now);
+        }
+        it = states.emplace(key, RepeatState()).first;
+    } else if (it->second.suppressed != 0) {
+        LogSuppressed(it->first, it->second);
+    }
+    it->second.lastLogged = now;
+    __android_log_write(entry.priority, entry.tag, trace.c_str());
+}
+
+// Logs everything queued and reports any exceptions dropped.
+void DrainQueue(JNIEnv* env, std::string& key, std::string& trace, RepeatStates& states) {
+    Entry entry;
+    while (GetShared().queue.TryPop(&entry)) {
+        LogEntry(env, entry, key, trace, states);
+    }
+    size_t dropped = g_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped != 0) {
+        ALOGW("Dropped %zu exceptions while the logging queue was full", dropped);
+    }
+}
+
+// Tells Stop() that the logging thread no longer uses the VM.
+void FinishLoggingThread() {
+    Shared& shared = GetShared();
+    {
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        g_thread_running = false;
+    }
+    shared.threadChanged.notify_all();
+}
+
+void RunLoggingThread(JavaVM* vm) {
+    Shared& shared = GetShared();
+    JNIEnv* env = nullptr;
+    JavaVMAttachArgs args = { JNI_VERSION_1_6, const_cast<char*>("ExceptionLogger"), nullptr };
+    bool attached = vm->AttachCurrentThreadAsDaemon(&env, &args) == JNI_OK;
+    {
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        g_thread_available.store(attached, std::memory_order_release);
+        g_thread_attach_done = true;
+    }
+    shared.threadChanged.notify_all();
+    if (!attached) {
+        ALOGE("Failed to attach exception logging thread, exceptions will not be logged");
+        FinishLoggingThread();
+        return;
+    }
+
+    std::string key;
+    std::string trace;
+    RepeatStates states;
+    for (;;) {
+        DrainQueue(env, key, trace, states);
+        // Repeats are reported when their window ends, even if the exception
+        // is not seen again.
+        auto nextWindowEnd = LogExpiredRepeats(states, std::chrono::steady_clock::now());
+
+        std::unique_lock<std::mutex> lock(shared.mutex);
+        if (g_stopping && shared.queue.Empty()) {
+            break;
+        }
+        // Pairs with the exchange in Enqueue(): whichever comes second sees
+        // the other, so either the producer sees this thread waiting and
+        // notifies under the mutex, or the predicate sees the entry it queued.
+        g_thread_waiting.exchange(true, std::memory_order_acq_rel);
+        auto wakeUp = [&shared] { return !shared.queue.Empty() || g_stopping; };
+        if (nextWindowEnd == std::chrono::steady_clock::time_point::max()) {
+            shared.wakeup.wait(lock, wakeUp);
+        } else {
+            shared.wakeup.wait_until(lock, nextWindowEnd, wakeUp);
+        }
+        g_thread_waiting.store(false, std::memory_order_relaxed);
+    }
+
+    for (auto& state : states) {
+        if (state.second.suppressed != 0) {
+            LogSuppressed(state.first, state.second);
+        }
+    }
+    vm->DetachCurrentThread();
+    FinishLoggingThread();
+}
+
+// Starts the logging thread for the VM of |env| unless one has already been
+// started, and waits for it to attach. Returns whether it is available.
+bool StartLoggingThread(JNIEnv* env) {
+    Shared& shared = GetShared();
+    std::unique_lock<std::mutex> lock(shared.mutex);
+    if (!g_thread_started && !g_stopping) {
+        g_thread_started = true;
+        JavaVM* vm = nullptr;
+        if (env->GetJavaVM(&vm) != JNI_OK) {
+            ALOGE("Failed to get JavaVM, exceptions will not be logged");
+            return false;
+        }
+        g_thread_attach_done = false;
+        g_thread_running = true;
+        // Detached, so that a process exiting without stopping the logger
+        // does not destroy a joinable thread.
+        std::thread(RunLoggingThread, vm).detach();
+    }
+    shared.threadChanged.wait(lock, [] { return g_thread_attach_done || !g_thread_running; });
+    return g_thread_available.load(std::memory_order_relaxed);
+}
+
+}  // namespace
+
+bool ExceptionLogger::Enqueue(JNIEnv* env, int priority, const char* tag, jthrowable exception,
+                              KeyFunction key, FormatFunction format) {
+    if (!g_thread_available.load(std::memory_order_acquire) && !StartLoggingThread(env)) {
+        return false;
+    }
+
+    Entry entry;
+    if (exception == nullptr) {
+        jthrowable pending = env->ExceptionOccurred();
+        if (pending == nullptr) {
+            return false;
+        }
+        // NewGlobalRef() may not be called with an exception pending.
+        env->ExceptionClear();
+        entry.exception = static_cast<jthrowable>(env->NewGlobalRef(pending));
+        env->Throw(pending);
+        env->DeleteLocalRef(pending);
+    } else {
+        entry.exception = static_cast<jthrowable>(env->NewGlobalRef(exception));
+    }
+    if (entry.exception == nullptr) {
+        return false;
+    }
+    entry.key = key;
+    entry.format = format;
+    entry.priority = priority;
+    strncpy(entry.tag, tag != nullptr ? tag : "", sizeof(entry.tag) - 1);
+    entry.tag[sizeof(entry.tag) - 1] = '\0';
+
+    Shared& shared = GetShared();
+    if (!shared.queue.TryPush(entry)) {
+        env->DeleteGlobalRef(entry.exception);
+        g_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (g_thread_waiting.exchange(false, std::memory_order_acq_rel)) {
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        shared.wakeup.notify_one();
+    }
+    return true;
+}
+
+void ExceptionLogger::Stop(JNIEnv* env) {
+    Shared& shared = GetShared();
+    {
+        std::unique_lock<std::mutex> lock(shared.mutex);
+        g_thread_available.store(false, std::memory_order_relaxed);
+        if (!g_thread_started) {
+            return;
+        }
+        g_stopping = true;
+        shared.wakeup.notify_all();
+        // The thread is detached, so wait for it to say it is done with the VM.
+        shared.threadChanged.wait(lock, [] { return !g_thread_running; });
+    }
+
+    // Release anything queued after the thread's last look at the queue.
+    Entry entry;
+    while (shared.queue.TryPop(&entry)) {
+        if (env != nullptr) {
+            env->DeleteGlobalRef(entry.exception);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    g_stopping = false;
+    g_thread_started = false;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_EXCEPTIONLOGGER_H_
+#define LIBNATIVEHELPER_EXCEPTIONLOGGER_H_
+
+#include <string>
+
+#include "jni.h"
+
+// Logs exceptions from a background thread attached to the VM, so that the
+// thread an exception occurred on does not pay for formatting and logging it.
+//
+// Repeats of an exception, identified by a key such as its class, message and
+// top frame, are logged at most once per rate limiting window and are not
+// formatted. The number of repeats that were not logged is reported when the
+// window ends, or when the logger is stopped.
+//
+// The thread is started for the VM of the first exception queued, and is
+// stopped by Stop() before that VM is destroyed. The next exception queued
+// then starts a new thread for its own VM. The thread is detached, so a process
+// may exit without stopping it.
+struct ExceptionLogger {
+    // Writes the stack trace of |exception| to |trace|.
+    using FormatFunction = void (*)(JNIEnv* env, jthrowable exception, std::string& trace);
+
+    // Writes the key that identifies repeats of |exception| to |key|. It is
+    // computed for every exception logged, so should be much cheaper than
+    // formatting.
+    using KeyFunction = void (*)(JNIEnv* env, jthrowable exception, std::string& key);
+
+    // Queues |exception| to be formatted with |format| and logged with
+    // |priority| and |tag|, unless |key| finds it to be a repeat. If
+    // |exception| is null, the pending exception is queued instead and left
+    // pending.
+    //
+    // Returns false if the exception was dropped because the queue is full or
+    // there was no exception to log. Queueing takes a global reference to the
+    // exception but does not block, except to start the logging thread.
+    static bool Enqueue(JNIEnv* env, int priority, const char* tag, jthrowable exception,
+                        KeyFunction key, FormatFunction format);
+
+    // Logs the exceptions still queued and stops the logging thread. |env|,
+    // which may be null, is used to release exceptions queued after the
+    // thread stopped. Exceptions queued concurrently with Stop() may be lost.
+    static void Stop(JNIEnv* env);
+};
+
+#endif  // LIBNATIVEHELPER_EXCEPTIONLOGGER_H_
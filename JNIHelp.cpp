@@ -19,17 +19,23 @@
 #include <string.h>
 
 #include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 
 #define LOG_TAG "JNIHelp"
 #include "ALog-priv.h"
 
 #include "jni.h"
+#include "ExceptionLogger.h"
 #include "JniConstants.h"
 #include "nativehelper/scoped_local_ref.h"
 
 namespace {
 
+// The number of frames jniLogExceptionAsync() logs for each exception in a cause chain.
+constexpr int kDefaultStackTraceDepth = 64;
+
 /*
  * Returns a human-readable summary of an exception object.  The buffer will
  * be populated with the "binary" class name and, if present, the
@@ -38,11 +44,9 @@ namespace {
 bool getExceptionSummary(JNIEnv* e, jthrowable exception, std::string& result) {
     // Get the name of the exception's class.
     ScopedLocalRef<jclass> exceptionClass(e, e->GetObjectClass(exception)); // can't fail
-    ScopedLocalRef<jclass> classClass(e,      e->GetObjectClass(exceptionClass.get())); // j.l.Class, can't fail
-    jmethodID classGetNameMethod = e->GetMethodID( classClass.get(), "getName",
-                                                   "()Ljava/lang/String;");
     ScopedLocalRef<jstring> classNameStr(e,
-            (jstring) e->CallObjectMethod(exceptionClass.get(), classGetNameMethod));
+            (jstring) e->CallObjectMethod(exceptionClass.get(),
+                                          JniConstants::GetClassGetNameMethod(e)));
     if (classNameStr.get() == nullptr) {
         e->ExceptionClear();
         result = "<error getting class name>";
@@ -58,10 +62,9 @@ bool getExceptionSummary(JNIEnv* e, jthrowable exception, std::string& result) {
     e->ReleaseStringUTFChars(classNameStr.get(), classNameChars);
 
     /* if the exception has a detail message, get that */
-    jmethodID getMessage =
-        e->GetMethodID(exceptionClass.get(), "getMessage", "()Ljava/lang/String;");
     ScopedLocalRef<jstring> messageStr(e,
-            (jstring) e->CallObjectMethod(exception, getMessage));
+            (jstring) e->CallObjectMethod(exception,
+                                          JniConstants::GetThrowableGetMessageMethod(e)));
     if (messageStr.get() == nullptr) {
         return true;
     }
@@ -84,46 +87,30 @@ bool getExceptionSummary(JNIEnv* e, jthrowable exception, std::string& result) {
  * Returns an exception (with stack trace) as a string.
  */
 bool getStackTrace(JNIEnv* e, jthrowable exception, std::string& result) {
-    ScopedLocalRef<jclass> stringWriterClass(e, e->FindClass("java/io/StringWriter"));
-    if (stringWriterClass.get() == nullptr) {
-        return false;
-    }
-
-    jmethodID stringWriterCtor = e->GetMethodID(stringWriterClass.get(), "<init>", "()V");
-    jmethodID stringWriterToStringMethod =
-        e->GetMethodID(stringWriterClass.get(), "toString", "()Ljava/lang/String;");
-
-    ScopedLocalRef<jclass> printWriterClass(e, e->FindClass("java/io/PrintWriter"));
-    if (printWriterClass.get() == nullptr) {
-        return false;
-    }
-
-    jmethodID printWriterCtor =
-            e->GetMethodID(printWriterClass.get(), "<init>", "(Ljava/io/Writer;)V");
-
     ScopedLocalRef<jobject> stringWriter(e,
-            e->NewObject(stringWriterClass.get(), stringWriterCtor));
+            e->NewObject(JniConstants::GetStringWriterClass(e),
+                         JniConstants::GetStringWriterInitMethod(e)));
     if (stringWriter.get() == nullptr) {
         return false;
     }
 
     ScopedLocalRef<jobject> printWriter(e,
-            e->NewObject(printWriterClass.get(), printWriterCtor, stringWriter.get()));
+            e->NewObject(JniConstants::GetPrintWriterClass(e),
+                         JniConstants::GetPrintWriterInitMethod(e), stringWriter.get()));
     if (printWriter.get() == nullptr) {
         return false;
     }
 
-    ScopedLocalRef<jclass> exceptionClass(e, e->GetObjectClass(exception)); // can't fail
-    jmethodID printStackTraceMethod =
-            e->GetMethodID(exceptionClass.get(), "printStackTrace", "(Ljava/io/PrintWriter;)V");
-    e->CallVoidMethod(exception, printStackTraceMethod, printWriter.get());
+    e->CallVoidMethod(exception, JniConstants::GetThrowablePrintStackTraceMethod(e),
+                      printWriter.get());
 
     if (e->ExceptionCheck()) {
         return false;
     }
 
     ScopedLocalRef<jstring> messageStr(e,
-            (jstring) e->CallObjectMethod(stringWriter.get(), stringWriterToStringMethod));
+            (jstring) e->CallObjectMethod(stringWriter.get(),
+                                          JniConstants::GetStringWriterToStringMethod(e)));
     if (messageStr.get() == nullptr) {
         return false;
     }
@@ -139,12 +126,334 @@ bool getStackTrace(JNIEnv* e, jthrowable exception, std::string& result) {
     return true;
 }
 
-std::string jniGetStackTrace(JNIEnv* e, jthrowable exception) {
+/*
+ * Appends the modified UTF-8 contents of |str| to |result|, or "null" if |str|
+ * is null. Copies directly into |result| rather than through GetStringUTFChars.
+ */
+void appendString(JNIEnv* e, jstring str, std::string& result) {
+    if (str == nullptr) {
+        result += "null";
+        return;
+    }
+    size_t offset = result.size();
+    jsize utfLength = e->GetStringUTFLength(str);
+    // GetStringUTFRegion() may write a terminating NUL, so allow room for one.
+    result.resize(offset + utfLength + 1);
+    e->GetStringUTFRegion(str, 0, e->GetStringLength(str), &result[offset]);
+    result.resize(offset + utfLength);
+}
+
+/*
+ * Appends the result of calling |method| (returning a String) on |obj|.
+ */
+bool appendStringMethodResult(JNIEnv* e, jobject obj, jmethodID method, std::string& result) {
+    ScopedLocalRef<jstring> str(e, (jstring) e->CallObjectMethod(obj, method));
+    if (e->ExceptionCheck()) {
+        return false;
+    }
+    appendString(e, str.get(), result);
+    return true;
+}
+
+/*
+ * Appends the exception in the format of Throwable.toString(): its class name
+ * and, if present, its message.
+ */
+bool appendThrowableString(JNIEnv* e, jthrowable exception, std::string& result) {
+    ScopedLocalRef<jclass> exceptionClass(e, e->GetObjectClass(exception));
+    if (!appendStringMethodResult(e, exceptionClass.get(),
+                                  JniConstants::GetClassGetNameMethod(e), result)) {
+        return false;
+    }
+    ScopedLocalRef<jstring> message(e, (jstring) e->CallObjectMethod(
+            exception, JniConstants::GetThrowableGetMessageMethod(e)));
+    if (e->ExceptionCheck()) {
+        return false;
+    }
+    if (message.get() != nullptr) {
+        result += ": ";
+        appendString(e, message.get(), result);
+    }
+    return true;
+}
+
+/*
+ * Appends a line in the format of Throwable.toString().
+ */
+bool appendThrowableLine(JNIEnv* e, jthrowable exception, std::string& result) {
+    if (!appendThrowableString(e, exception, result)) {
+        return false;
+    }
+    result += '\n';
+    return true;
+}
+
+/*
+ * Appends a line in the format used by Throwable.printStackTrace() for a
+ * java.lang.StackTraceElement.
+ */
+bool appendFrameLine(JNIEnv* e, jobject frame, std::string& result) {
+    result += "\tat ";
+    if (!appendStringMethodResult(e, frame,
+                                  JniConstants::GetStackTraceElementGetClassNameMethod(e),
+                                  result)) {
+        return false;
+    }
+    result += '.';
+    if (!appendStringMethodResult(e, frame,
+                                  JniConstants::GetStackTraceElementGetMethodNameMethod(e),
+                                  result)) {
+        return false;
+    }
+
+    jint lineNumber = e->CallIntMethod(frame,
+                                       JniConstants::GetStackTraceElementGetLineNumberMethod(e));
+    ScopedLocalRef<jstring> fileName(e, (jstring) e->CallObjectMethod(
+            frame, JniConstants::GetStackTraceElementGetFileNameMethod(e)));
+    if (e->ExceptionCheck()) {
+        return false;
+    }
+
+    if (lineNumber == -2) {
+        result += "(Native Method)\n";
+    } else if (fileName.get() == nullptr) {
+        result += "(Unknown Source)\n";
+    } else {
+        result += '(';
+        appendString(e, fileName.get(), result);
+        if (lineNumber >= 0) {
+            char lineBuf[16];
+            snprintf(lineBuf, sizeof(lineBuf), ":%d", lineNumber);
+            result += lineBuf;
+        }
+        result += ")\n";
+    }
+    return true;
+}
+
+/*
+ * Returns the number of frames at the end of |frames| that are equal to the
+ * frames at the end of |enclosingFrames|, as Throwable.printStackTrace() does
+ * for causes. Frames are compared without being formatted. Returns -1, with
+ * an exception pending, if a comparison throws.
+ */
+jsize countFramesInCommon(JNIEnv* e, jobjectArray frames, jsize frameCount,
+                          jobjectArray enclosingFrames, jsize enclosingFrameCount) {
+    jmethodID equals = JniConstants::GetStackTraceElementEqualsMethod(e);
+    jsize m = frameCount - 1;
+    jsize n = enclosingFrameCount - 1;
+    while (m >= 0 && n >= 0) {
+        ScopedLocalRef<jobject> frame(e, e->GetObjectArrayElement(frames, m));
+        ScopedLocalRef<jobject> enclosingFrame(e, e->GetObjectArrayElement(enclosingFrames, n));
+        jboolean equal = e->CallBooleanMethod(frame.get(), equals, enclosingFrame.get());
+        if (e->ExceptionCheck()) {
+            return -1;
+        }
+        if (!equal) {
+            break;
+        }
+        --m;
+        --n;
+    }
+    return frameCount - 1 - m;
+}
+
+/*
+ * The throwables formatted so far by formatStackTrace(), compared by identity
+ * as Throwable.printStackTrace() does to recognize cycles. Each is held by a
+ * local reference of its own.
+ */
+class SeenThrowables {
+  public:
+    explicit SeenThrowables(JNIEnv* e) : mEnv(e) {}
+
+    ~SeenThrowables() {
+        for (jthrowable throwable : mThrowables) {
+            mEnv->DeleteLocalRef(throwable);
+        }
+    }
+
+    bool Contains(jthrowable throwable) const {
+        for (jthrowable seen : mThrowables) {
+            if (mEnv->IsSameObject(seen, throwable)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Add(jthrowable throwable) {
+        mThrowables.push_back(static_cast<jthrowable>(mEnv->NewLocalRef(throwable)));
+    }
+
+    size_t size() const { return mThrowables.size(); }
+
+  private:
+    JNIEnv* const mEnv;
+    std::vector<jthrowable> mThrowables;
+
+    SeenThrowables(const SeenThrowables&) = delete;
+    void operator=(const SeenThrowables&) = delete;
+};
+
+/*
+ * Appends |exception| to a stack trace being formatted by formatStackTrace(),
+ * as Throwable.printEnclosedStackTrace() does: |caption| and the exception
+ * on a line of their own, its frames, then its suppressed exceptions and its
+ * cause. Every line is prefixed by |prefix|. |enclosingFrames| are the frames
+ * of the exception that this one is suppressed by or caused, or null.
+ */
+bool formatEnclosedStackTrace(JNIEnv* e, jthrowable exception, jobjectArray enclosingFrames,
+                              jsize enclosingFrameCount, const char* caption,
+                              const std::string& prefix, int maxDepth, SeenThrowables& seen,
+                              std::string& result) {
+    // Bounds the work and recursion for deeply nested exceptions.
+    static constexpr size_t kMaxThrowables = 32;
+
+    if (seen.size() == kMaxThrowables) {
+        return true;
+    }
+    result += prefix;
+    result += caption;
+    if (seen.Contains(exception)) {
+        result += "[CIRCULAR REFERENCE: ";
+        if (!appendThrowableString(e, exception, result)) {
+            return false;
+        }
+        result += "]\n";
+        return true;
+    }
+    seen.Add(exception);
+    if (!appendThrowableLine(e, exception, result)) {
+        return false;
+    }
+
+    ScopedLocalRef<jobjectArray> frames(e, (jobjectArray) e->CallObjectMethod(
+            exception, JniConstants::GetThrowableGetStackTraceMethod(e)));
+    if (e->ExceptionCheck()) {
+        return false;
+    }
+    jsize frameCount = frames.get() != nullptr ? e->GetArrayLength(frames.get()) : 0;
+    jsize framesInCommon = 0;
+    if (enclosingFrames != nullptr) {
+        framesInCommon = countFramesInCommon(e, frames.get(), frameCount, enclosingFrames,
+                                             enclosingFrameCount);
+        if (framesInCommon < 0) {
+            return false;
+        }
+    }
+    jsize uniqueFrames = frameCount - framesInCommon;
+    jsize framesShown = uniqueFrames;
+    if (maxDepth >= 0 && framesShown > maxDepth) {
+        framesShown = maxDepth;
+    }
+    for (jsize i = 0; i < framesShown; ++i) {
+        ScopedLocalRef<jobject> frame(e, e->GetObjectArrayElement(frames.get(), i));
+        result += prefix;
+        if (!appendFrameLine(e, frame.get(), result)) {
+            return false;
+        }
+    }
+    char countBuf[32];
+    if (framesShown < uniqueFrames) {
+        snprintf(countBuf, sizeof(countBuf), "\t... %d truncated\n", uniqueFrames - framesShown);
+        result += prefix;
+        result += countBuf;
+    }
+    if (framesInCommon > 0) {
+        snprintf(countBuf, sizeof(countBuf), "\t... %d more\n", framesInCommon);
+        result += prefix;
+        result += countBuf;
+    }
+
+    ScopedLocalRef<jobjectArray> suppressed(e, (jobjectArray) e->CallObjectMethod(
+            exception, JniConstants::GetThrowableGetSuppressedMethod(e)));
+    if (e->ExceptionCheck()) {
+        return false;
+    }
+    jsize suppressedCount = suppressed.get() != nullptr ? e->GetArrayLength(suppressed.get()) : 0;
+    std::string suppressedPrefix = prefix + '\t';
+    for (jsize i = 0; i < suppressedCount; ++i) {
+        ScopedLocalRef<jthrowable> suppressedException(
+                e, (jthrowable) e->GetObjectArrayElement(suppressed.get(), i));
+        if (!formatEnclosedStackTrace(e, suppressedException.get(), frames.get(), frameCount,
+                                      "Suppressed: ", suppressedPrefix, maxDepth, seen, result)) {
+            return false;
+        }
+    }
+
+    ScopedLocalRef<jthrowable> cause(e, (jthrowable) e->CallObjectMethod(
+            exception, JniConstants::GetThrowableGetCauseMethod(e)));
+    if (e->ExceptionCheck()) {
+        return false;
+    }
+    if (cause.get() != nullptr) {
+        return formatEnclosedStackTrace(e, cause.get(), frames.get(), frameCount, "Caused by: ",
+                                        prefix, maxDepth, seen, result);
+    }
+    return true;
+}
+
+/*
+ * Formats an exception with its suppressed exceptions and causes in the style
+ * of Throwable.printStackTrace(), entirely in native code. At most |maxDepth|
+ * frames are formatted for each exception, or all of them if |maxDepth| is
+ * negative. Frames that an exception shares with the one it is suppressed by
+ * or caused are elided as "... n more", as Throwable.printStackTrace() does,
+ * and frames cut off by |maxDepth| are counted separately as "... n truncated".
+ * An exception that appears again is shown as a circular reference.
+ */
+bool formatStackTrace(JNIEnv* e, jthrowable exception, int maxDepth, std::string& result) {
+    SeenThrowables seen(e);
+    if (!formatEnclosedStackTrace(e, exception, nullptr, 0, "", "", maxDepth, seen, result)) {
+        return false;
+    }
+    // Drop the trailing newline to match the Java rendering.
+    if (!result.empty() && result.back() == '\n') {
+        result.pop_back();
+    }
+    return true;
+}
+
+/*
+ * Writes the key ExceptionLogger uses to recognize repeats of |exception|: its
+ * class name, message and top frame, as on the first two lines of its stack
+ * trace. Only the top frame is looked at, so this is much cheaper than
+ * formatting the trace. Exceptions thrown on the way are cleared.
+ */
+void getRepeatKey(JNIEnv* e, jthrowable exception, std::string& key) {
+    if (!appendThrowableLine(e, exception, key)) {
+        e->ExceptionClear();
+        return;
+    }
+    ScopedLocalRef<jobjectArray> frames(e, (jobjectArray) e->CallObjectMethod(
+            exception, JniConstants::GetThrowableGetStackTraceMethod(e)));
+    if (e->ExceptionCheck()) {
+        e->ExceptionClear();
+        return;
+    }
+    if (frames.get() != nullptr && e->GetArrayLength(frames.get()) > 0) {
+        ScopedLocalRef<jobject> frame(e, e->GetObjectArrayElement(frames.get(), 0));
+        if (!appendFrameLine(e, frame.get(), key)) {
+            e->ExceptionClear();
+        }
+    }
+    if (!key.empty() && key.back() == '\n') {
+        key.pop_back();
+    }
+}
+
+/*
+ * Writes the stack trace of |exception|, or of the pending exception if
+ * |exception| is null, to |result|. A pending exception is preserved.
+ */
+void jniGetStackTrace(JNIEnv* e, jthrowable exception, int maxDepth, std::string& result) {
     ScopedLocalRef<jthrowable> currentException(e, e->ExceptionOccurred());
     if (exception == nullptr) {
         exception = currentException.get();
         if (exception == nullptr) {
-          return "<no pending exception>";
+          result = "<no pending exception>";
+          return;
         }
     }
 
@@ -152,17 +461,20 @@ std::string jniGetStackTrace(JNIEnv* e, jthrowable exception) {
         e->ExceptionClear();
     }
 
-    std::string trace;
-    if (!getStackTrace(e, exception, trace)) {
+    result.clear();
+    if (!formatStackTrace(e, exception, maxDepth, result)) {
         e->ExceptionClear();
-        getExceptionSummary(e, exception, trace);
+        result.clear();
+        if (!getStackTrace(e, exception, result)) {
+            e->ExceptionClear();
+            result.clear();
+            getExceptionSummary(e, exception, result);
+        }
     }
 
     if (currentException.get() != nullptr) {
         e->Throw(currentException.get()); // re-throw
     }
-
-    return trace;
 }
 
 // Note: glibc has a nonstandard strerror_r that returns char* rather than POSIX's int.
@@ -199,6 +511,220 @@ static const char* platformStrError(int errnum, char* buf, size_t buflen) {
 #endif
 }
 
+constexpr int kErrnoMessageCount = 160;
+constexpr size_t kErrnoMessageLength = 80;
+
+struct ErrnoMessageTable {
+    char messages[kErrnoMessageCount][kErrnoMessageLength];
+
+    ErrnoMessageTable() {
+        for (int i = 0; i < kErrnoMessageCount; ++i) {
+            const char* message = platformStrError(i, messages[i], kErrnoMessageLength);
+            if (message != messages[i]) {
+                snprintf(messages[i], kErrnoMessageLength, "%s", message);
+            }
+        }
+    }
+};
+
+/*
+ * Returns the message for |errnum|, formatting values outside the table into
+ * |buf|. The messages for the common range of errno values are generated on the
+ * first call, so that frequently thrown errors such as EAGAIN do not pay for
+ * strerror_r on each throw, and processes that never throw pay nothing.
+ */
+const char* errnoMessage(int errnum, char* buf, size_t buflen) {
+    if (errnum >= 0 && errnum < kErrnoMessageCount) {
+        static const ErrnoMessageTable errnoMessages;
+        return errnoMessages.messages[errnum];
+    }
+    return platformStrError(errnum, buf, buflen);
+}
+
+/*
+ * Clears any pending exception so that a new one can be thrown, logging a
+ * summary of the exception being discarded. The |className| of the exception
+ * about to be thrown is only used for logging and may be null.
+ */
+void discardPendingException(JNIEnv* e, const char* className) {
+    if (!e->ExceptionCheck()) {
+        return;
+    }
+
+    ScopedLocalRef<jthrowable> exception(e, e->ExceptionOccurred());
+    e->ExceptionClear();
+
+    if (exception.get() != nullptr) {
+        std::string text;
+        getExceptionSummary(e, exception.get(), text);
+        if (className != nullptr) {
+            ALOGW("Discarding pending exception (%s) to throw %s", text.c_str(), className);
+        } else {
+            ALOGW("Discarding pending exception (%s) to throw new exception", text.c_str());
+        }
+    }
+}
+
+/*
+ * Throws a new instance of |exceptionClass|. The |className| is only used for
+ * logging and may be null.
+ */
+int throwNew(JNIEnv* e, jclass exceptionClass, const char* className, const char* msg) {
+    if (e->ThrowNew(exceptionClass, msg) != JNI_OK) {
+        ALOGE("Failed throwing '%s' '%s'", className != nullptr ? className : "<class>", msg);
+        /* an exception, most likely OOM, will now be pending */
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Throws a new instance of |exceptionClass| constructed with |init|, a
+ * constructor taking a single String argument.
+ */
+int throwWithMessage(JNIEnv* e, jclass exceptionClass, jmethodID init, const char* className,
+                     const char* msg) {
+    ScopedLocalRef<jstring> message(e, e->NewStringUTF(msg));
+    if (message.get() == nullptr) {
+        ALOGE("Failed allocating message for '%s' '%s'", className, msg);
+        /* OutOfMemoryError now pending */
+        return -1;
+    }
+    ScopedLocalRef<jthrowable> exception(
+            e, static_cast<jthrowable>(e->NewObject(exceptionClass, init, message.get())));
+    if (exception.get() == nullptr || e->Throw(exception.get()) != JNI_OK) {
+        ALOGE("Failed throwing '%s' '%s'", className, msg);
+        /* an exception, most likely OOM, will now be pending */
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the constructor of |exceptionClass| used to chain a cause: the one
+ * taking a message and a cause, setting |*takesCause|, or if the class does not
+ * declare one, the one taking only a message. Returns nullptr with an
+ * exception pending if it has neither.
+ */
+jmethodID findChainingInit(JNIEnv* e, jclass exceptionClass, bool* takesCause) {
+    jmethodID init = e->GetMethodID(exceptionClass, "<init>",
+                                    "(Ljava/lang/String;Ljava/lang/Throwable;)V");
+    *takesCause = init != nullptr;
+    if (init == nullptr) {
+        /* NoSuchMethodError now pending */
+        e->ExceptionClear();
+        init = e->GetMethodID(exceptionClass, "<init>", "(Ljava/lang/String;)V");
+    }
+    return init;
+}
+
+/*
+ * Called when the exception chaining |cause| could not be created. The
+ * failure is replaced by |cause| again, if there is one, so that the original
+ * exception is not lost.
+ */
+int rethrowCause(JNIEnv* e, jthrowable cause, const char* msg) {
+    ALOGE("Failed creating chained exception '%s'", msg != nullptr ? msg : "");
+    if (cause != nullptr) {
+        e->ExceptionClear();
+        e->Throw(cause);
+    }
+    return -1;
+}
+
+/*
+ * Throws a new instance of |exceptionClass| with |cause|, which may be null.
+ * The instance is created with |init|, a constructor of the class taking a
+ * message and, if |initTakesCause|, a cause; otherwise the cause is set with
+ * Throwable.initCause. |init| may be null, in which case it is looked up.
+ *
+ * JNI does not allow the instance to be created while |cause| is pending, so
+ * the caller clears it first; it is thrown again if creation fails.
+ */
+int throwWithCause(JNIEnv* e, jclass exceptionClass, jmethodID init, bool initTakesCause,
+                   const char* msg, jthrowable cause) {
+    if (init == nullptr) {
+        init = findChainingInit(e, exceptionClass, &initTakesCause);
+        if (init == nullptr) {
+            return rethrowCause(e, cause, msg);
+        }
+    }
+
+    ScopedLocalRef<jstring> message(e, nullptr);
+    if (msg != nullptr) {
+        message.reset(e->NewStringUTF(msg));
+        if (message.get() == nullptr) {
+            return rethrowCause(e, cause, msg);
+        }
+    }
+
+    ScopedLocalRef<jthrowable> exception(e, nullptr);
+    if (initTakesCause) {
+        exception.reset(static_cast<jthrowable>(
+                e->NewObject(exceptionClass, init, message.get(), cause)));
+    } else {
+        exception.reset(static_cast<jthrowable>(
+                e->NewObject(exceptionClass, init, message.get())));
+        if (exception.get() != nullptr && cause != nullptr) {
+            ScopedLocalRef<jobject> self(
+                    e, e->CallObjectMethod(exception.get(),
+                                           JniConstants::GetThrowableInitCauseMethod(e), cause));
+        }
+    }
+    if (exception.get() == nullptr || e->ExceptionCheck()) {
+        return rethrowCause(e, cause, msg);
+    }
+    if (e->Throw(exception.get()) != JNI_OK) {
+        ALOGE("Failed throwing chained exception '%s'", msg != nullptr ? msg : "");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Throws one of the exception classes cached by JniConstants. Any pending
+ * exception is discarded before |getClass| is called as it may need to look
+ * up classes.
+ */
+int throwCachedException(C_JNIEnv* env, jclass (*getClass)(JNIEnv*), const char* className,
+                         const char* msg) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    discardPendingException(e, className);
+    return throwNew(e, getClass(e), className, msg);
+}
+
+/*
+ * A printf-style formatted exception message. Messages that fit in the inline
+ * buffer are formatted without allocating; longer ones are formatted a second
+ * time into a heap buffer of the exact size so that they are never truncated.
+ */
+class FormattedMessage {
+  public:
+    FormattedMessage(const char* fmt, va_list args) {
+        va_list argsCopy;
+        va_copy(argsCopy, args);
+        int length = vsnprintf(mInlineBuf, sizeof(mInlineBuf), fmt, argsCopy);
+        va_end(argsCopy);
+        if (length < 0) {
+            mInlineBuf[0] = '\0';
+        } else if (static_cast<size_t>(length) >= sizeof(mInlineBuf)) {
+            mHeapBuf.reset(new char[length + 1]);
+            vsnprintf(mHeapBuf.get(), length + 1, fmt, args);
+        }
+    }
+
+    const char* c_str() const {
+        return mHeapBuf != nullptr ? mHeapBuf.get() : mInlineBuf;
+    }
+
+  private:
+    char mInlineBuf[512];
+    std::unique_ptr<char[]> mHeapBuf;
+
+    FormattedMessage(const FormattedMessage&) = delete;
+    void operator=(const FormattedMessage&) = delete;
+};
+
 }  // namespace
 
 int jniRegisterNativeMethods(C_JNIEnv* env, const char* className,
@@ -222,17 +748,11 @@ int jniRegisterNativeMethods(C_JNIEnv* env, const char* className,
 
 int jniThrowException(C_JNIEnv* env, const char* className, const char* msg) {
     JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    discardPendingException(e, className);
 
-    if (e->ExceptionCheck()) {
-        /* TODO: consider creating the new exception with this as "cause" */
-        ScopedLocalRef<jthrowable> exception(e, e->ExceptionOccurred());
-        e->ExceptionClear();
-
-        if (exception.get() != nullptr) {
-            std::string text;
-            getExceptionSummary(e, exception.get(), text);
-            ALOGW("Discarding pending exception (%s) to throw %s", text.c_str(), className);
-        }
+    jclass cachedClass = JniConstants::GetCachedExceptionClass(e, className);
+    if (cachedClass != nullptr) {
+        return throwNew(e, cachedClass, className, msg);
     }
 
     ScopedLocalRef<jclass> exceptionClass(e, e->FindClass(className));
@@ -242,39 +762,197 @@ int jniThrowException(C_JNIEnv* env, const char* className, const char* msg) {
         return -1;
     }
 
-    if (e->ThrowNew(exceptionClass.get(), msg) != JNI_OK) {
-        ALOGE("Failed throwing '%s' '%s'", className, msg);
-        /* an exception, most likely OOM, will now be pending */
-        return -1;
-    }
+    return throwNew(e, exceptionClass.get(), className, msg);
+}
 
-    return 0;
+int jniThrowExceptionWithClass(C_JNIEnv* env, jclass exceptionClass, const char* msg) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    discardPendingException(e, nullptr);
+    return throwNew(e, exceptionClass, nullptr, msg);
 }
 
 int jniThrowExceptionFmt(C_JNIEnv* env, const char* className, const char* fmt, va_list args) {
-    char msgBuf[512];
-    vsnprintf(msgBuf, sizeof(msgBuf), fmt, args);
-    return jniThrowException(env, className, msgBuf);
+    FormattedMessage msg(fmt, args);
+    return jniThrowException(env, className, msg.c_str());
+}
+
+int jniThrowExceptionWithClassFmt(C_JNIEnv* env, jclass exceptionClass, const char* fmt,
+                                  va_list args) {
+    FormattedMessage msg(fmt, args);
+    return jniThrowExceptionWithClass(env, exceptionClass, msg.c_str());
 }
 
 int jniThrowNullPointerException(C_JNIEnv* env, const char* msg) {
-    return jniThrowException(env, "java/lang/NullPointerException", msg);
+    return throwCachedException(env, JniConstants::GetNullPointerExceptionClass,
+                                "java/lang/NullPointerException", msg);
 }
 
 int jniThrowRuntimeException(C_JNIEnv* env, const char* msg) {
-    return jniThrowException(env, "java/lang/RuntimeException", msg);
+    return throwCachedException(env, JniConstants::GetRuntimeExceptionClass,
+                                "java/lang/RuntimeException", msg);
 }
 
 int jniThrowIOException(C_JNIEnv* env, int errnum) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    discardPendingException(e, "java/io/IOException");
+
     char buffer[80];
-    const char* message = platformStrError(errnum, buffer, sizeof(buffer));
-    return jniThrowException(env, "java/io/IOException", message);
+    const char* message = errnoMessage(errnum, buffer, sizeof(buffer));
+    return throwWithMessage(e, JniConstants::GetIOExceptionClass(e),
+                            JniConstants::GetIOExceptionInitMethod(e), "java/io/IOException",
+                            message);
+}
+
+int jniThrowErrnoException(C_JNIEnv* env, const char* functionName, int errnum) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    discardPendingException(e, "android/system/ErrnoException");
+
+    jclass errnoExceptionClass = JniConstants::GetErrnoExceptionClass(e);
+    if (errnoExceptionClass == nullptr) {
+        // Not running on an Android runtime, fall back to an IOException.
+        char buffer[80];
+        char message[256];
+        snprintf(message, sizeof(message), "%s failed: %s",
+                 functionName != nullptr ? functionName : "(null)",
+                 errnoMessage(errnum, buffer, sizeof(buffer)));
+        return throwWithMessage(e, JniConstants::GetIOExceptionClass(e),
+                                JniConstants::GetIOExceptionInitMethod(e), "java/io/IOException",
+                                message);
+    }
+
+    ScopedLocalRef<jstring> name(e, functionName != nullptr ? e->NewStringUTF(functionName)
+                                                            : nullptr);
+    if (name.get() == nullptr && functionName != nullptr) {
+        ALOGE("Failed allocating function name for ErrnoException '%s'", functionName);
+        /* OutOfMemoryError now pending */
+        return -1;
+    }
+    ScopedLocalRef<jthrowable> exception(
+            e, static_cast<jthrowable>(e->NewObject(errnoExceptionClass,
+                                                    JniConstants::GetErrnoExceptionInitMethod(e),
+                                                    name.get(), static_cast<jint>(errnum))));
+    if (exception.get() == nullptr || e->Throw(exception.get()) != JNI_OK) {
+        ALOGE("Failed throwing ErrnoException '%s' %d",
+              functionName != nullptr ? functionName : "(null)", errnum);
+        /* an exception, most likely OOM, will now be pending */
+        return -1;
+    }
+    return 0;
+}
+
+int jniThrowChainedException(C_JNIEnv* env, const char* className, const char* msg) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    ScopedLocalRef<jthrowable> cause(e, e->ExceptionOccurred());
+    if (cause.get() != nullptr) {
+        e->ExceptionClear();
+    }
+
+    jclass cachedClass = JniConstants::GetCachedExceptionClass(e, className);
+    if (cachedClass != nullptr) {
+        bool initTakesCause;
+        jmethodID init = JniConstants::GetCachedExceptionChainingInit(e, className,
+                                                                      &initTakesCause);
+        return throwWithCause(e, cachedClass, init, initTakesCause, msg, cause.get());
+    }
+
+    ScopedLocalRef<jclass> exceptionClass(e, e->FindClass(className));
+    if (exceptionClass.get() == nullptr) {
+        ALOGE("Unable to find exception class %s", className);
+        return rethrowCause(e, cause.get(), msg);
+    }
+    return throwWithCause(e, exceptionClass.get(), nullptr, false, msg, cause.get());
+}
+
+int jniThrowChainedExceptionWithClass(C_JNIEnv* env, jclass exceptionClass, const char* msg) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    ScopedLocalRef<jthrowable> cause(e, e->ExceptionOccurred());
+    if (cause.get() != nullptr) {
+        e->ExceptionClear();
+    }
+    return throwWithCause(e, exceptionClass, nullptr, false, msg, cause.get());
+}
+
+jthrowable jniCreatePreallocatedException(C_JNIEnv* env, jclass exceptionClass, const char* msg) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    ScopedLocalRef<jstring> message(e, nullptr);
+    if (msg != nullptr) {
+        message.reset(e->NewStringUTF(msg));
+        if (message.get() == nullptr) {
+            /* OutOfMemoryError now pending */
+            return nullptr;
+        }
+    }
+
+    // The instance is created with suppression and a writable stack trace both
+    // disabled, so no stack trace is captured now or when it is thrown. That is
+    // done by the class's own (String, Throwable, boolean, boolean) constructor
+    // if it has one.
+    ScopedLocalRef<jthrowable> exception(e, nullptr);
+    jmethodID init = e->GetMethodID(exceptionClass, "<init>",
+                                    "(Ljava/lang/String;Ljava/lang/Throwable;ZZ)V");
+    if (init != nullptr) {
+        exception.reset(static_cast<jthrowable>(
+                e->NewObject(exceptionClass, init, message.get(), nullptr, JNI_FALSE, JNI_FALSE)));
+    } else {
+        // Otherwise the Throwable constructor runs on an uninitialized instance,
+        // so that no constructor of the class fills in a stack trace first.
+        /* NoSuchMethodError now pending */
+        e->ExceptionClear();
+        exception.reset(static_cast<jthrowable>(e->AllocObject(exceptionClass)));
+        if (exception.get() != nullptr) {
+            e->CallNonvirtualVoidMethod(exception.get(), JniConstants::GetThrowableClass(e),
+                                        JniConstants::GetThrowableInitWithoutStackTraceMethod(e),
+                                        message.get(), nullptr, JNI_FALSE, JNI_FALSE);
+            if (e->ExceptionCheck()) {
+                return nullptr;
+            }
+        }
+    }
+    if (exception.get() == nullptr) {
+        /* an exception, most likely OOM, will now be pending */
+        return nullptr;
+    }
+    return static_cast<jthrowable>(e->NewGlobalRef(exception.get()));
+}
+
+int jniThrowPreallocatedException(C_JNIEnv* env, jthrowable exception) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    if (e->ExceptionCheck()) {
+        e->ExceptionClear();
+    }
+    if (e->Throw(exception) != JNI_OK) {
+        ALOGE("Failed throwing preallocated exception");
+        return -1;
+    }
+    return 0;
 }
 
 void jniLogException(C_JNIEnv* env, int priority, const char* tag, jthrowable exception) {
+    jniLogExceptionWithDepth(env, priority, tag, exception, -1);
+}
+
+void jniLogExceptionAsync(C_JNIEnv* env, int priority, const char* tag, jthrowable exception) {
+    JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
+    ExceptionLogger::Enqueue(e, priority, tag, exception, getRepeatKey,
+                             [](JNIEnv* loggerEnv, jthrowable queued, std::string& trace) {
+                                 jniGetStackTrace(loggerEnv, queued, kDefaultStackTraceDepth,
+                                                  trace);
+                             });
+}
+
+void jniLogExceptionWithDepth(C_JNIEnv* env, int priority, const char* tag, jthrowable exception,
+                              int maxDepth) {
+    // Stack traces are formatted into a per-thread buffer that is reused
+    // between calls, unless a particularly deep trace made it too large to keep.
+    static constexpr size_t kMaxRetainedTraceCapacity = 64 * 1024;
+    thread_local std::string trace;
+
     JNIEnv* e = reinterpret_cast<JNIEnv*>(env);
-    std::string trace(jniGetStackTrace(e, exception));
+    jniGetStackTrace(e, exception, maxDepth, trace);
     __android_log_write(priority, tag, trace.c_str());
+    if (trace.capacity() > kMaxRetainedTraceCapacity) {
+        std::string().swap(trace);
+    }
 }
 
 jobject jniCreateFileDescriptor(C_JNIEnv* env, int fd) {
@@ -368,3 +1046,23 @@ jobjectArray jniCreateStringArray(C_JNIEnv* env, size_t count) {
 void jniUninitializeConstants() {
   JniConstants::Uninitialize();
 }
+
+uint32_t jniGetConstantsGeneration() {
+    return JniConstants::GetGeneration();
+}
+
+int jniPrewarmConstants(C_JNIEnv* env, uint64_t mask) {
+    return JniConstants::Prewarm(reinterpret_cast<JNIEnv*>(env), mask) ? 0 : -1;
+}
+
+void jniStartRecordingConstants() {
+    JniConstants::StartRecording();
+}
+
+uint64_t jniStopRecordingConstants() {
+    return JniConstants::StopRecording();
+}
+
+int jniRegisterConstantsReleaseHook(void (*hook)(C_JNIEnv* env, void* data), void* data) {
+    return JniConstants::AddReleaseHook(hook, data) ? 0 : -1;
+}
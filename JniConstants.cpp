@@ -19,269 +19,398 @@
 
 #include "JniConstants.h"
 
+#include <string.h>
+
 #include <atomic>
 #include <mutex>
-#include <string>
 
-#include "nativehelper/ScopedLocalRef.h"
+#include "nativehelper/jni_constants_table.h"
+#include "nativehelper/libnativehelper_api.h"
 
 namespace {
 
-// Mutex protecting the initialization of cached class references.
-std::mutex g_class_refs_mutex;
-
-// Atomic boolean flag for double locked checking that class references are
-// initialized before use.
-std::atomic<bool> g_class_refs_initialized(false);
-
-// Cached global references to class instances.
-//
-// These are GC heap references that are initialized under the protection of
-// |g_class_refs_mutex| as they should only be initialized once to avoid losing a
-// global reference. Initialization happens lazily when an accessor tries to
-// retrieve one of these classes.
-
-jclass g_file_descriptor_class = nullptr;  // java.io.FileDescriptor
-jclass g_nio_access_class = nullptr;       // java.nio.Access
-jclass g_nio_buffer_class = nullptr;       // java.nio.Buffer
-jclass g_reference_class = nullptr;        // java.lang.ref.Reference
-jclass g_string_class = nullptr;           // java.lang.String
-
-// Cached field and method ids.
-//
-// These are non-GC heap values. They are initialized lazily and racily. We
-// avoid holding a mutex here because the JNI API supports concurrent calls to
-// Get{Field,Method}ID and also because finding an id may recursively call into
-// Get{Field,Method}ID.
+// The classes, fields and methods held by JniConstants.
 //
-// The recursion issue occurs here for the fields in the FileDescriptor class
-// since retrieving a field id requires the class to be initialized. Class
-// initialization leads to the initialization of static fields. The
-// FileDescriptor class has static fields that are FileDescriptor instances. The
-// initialization of these static FileDescriptor fields follows a convoluted
-// path that that leads to a call to jniGetFDFromFileDescriptor() which then
-// needs to call GetFieldID() which is in the call stack. If thread-safety were
-// desirable here, a recursive mutex would be required.
-//
-// These field and method ids have default values of nullptr. They are reset
-// back to nullptr in JniConstants::Uninitialize(), along with the class
-// references, when a new runtime instance is created via JNI_CreateJavaVM(). The
-// reset happens before the new runtime instance is returned to the caller and
-// under the protection of the |g_class_refs_mutex|.
-
-jfieldID g_file_descriptor_descriptor_field = nullptr;  // java.io.FileDescriptor.descriptor
-jfieldID g_file_descriptor_owner_id_field = nullptr;    // java.io.FileDescriptor.ownerId
-jmethodID g_file_descriptor_init_method = nullptr;      // void java.io.FileDescriptor.<init>()
-jmethodID g_nio_access_get_base_array_method = nullptr;        // Object java.nio.NIOAccess.getBaseArray()
-jmethodID g_nio_access_get_base_array_offset_method = nullptr; // Object java.nio.NIOAccess.getBaseArray()
-jfieldID g_nio_buffer_address_field = nullptr;          // long java.nio.Buffer.address
-jfieldID g_nio_buffer_element_size_shift_field = nullptr; // int java.nio.Buffer._elementSizeShift
-jfieldID g_nio_buffer_limit_field = nullptr;            // int java.nio.Buffer.limit
-jfieldID g_nio_buffer_position_field = nullptr;         // int java.nio.Buffer.position
-jmethodID g_nio_buffer_array_method = nullptr;          // Object java.nio.Buffer.array()
-jmethodID g_nio_buffer_array_offset_method = nullptr;   // int java.nio.Buffer.arrayOffset()
-jmethodID g_reference_get_method = nullptr;             // Object java.lang.ref.Reference.get()
-
-jclass FindClass(JNIEnv* env, const char* name) {
-    ScopedLocalRef<jclass> klass(env, env->FindClass(name));
-    ALOG_ALWAYS_FATAL_IF(klass.get() == nullptr, "failed to find class '%s'", name);
-    return reinterpret_cast<jclass>(env->NewGlobalRef(klass.get()));
-}
-
-jfieldID FindField(JNIEnv* env, jclass klass, const char* name, const char* desc) {
-    jfieldID result = env->GetFieldID(klass, name, desc);
-    ALOG_ALWAYS_FATAL_IF(result == nullptr, "failed to find field '%s:%s'", name, desc);
-    return result;
+// Each entry is resolved on its own the first time it is used, so callers only
+// pay for the lookups they need. Resolution does not take a lock: the JNI API
+// supports concurrent calls to FindClass and Get{Field,Method}ID, and finding
+// an id may recursively need the same id. The recursion occurs for the fields
+// in the FileDescriptor class since retrieving a field id requires the class to
+// be initialized, and FileDescriptor has static FileDescriptor fields whose
+// initialization leads to a call to jniGetFDFromFileDescriptor().
+#define LIBNATIVEHELPER_JNI_CONSTANTS(CLASS, FIELD, STATIC_FIELD, METHOD, STATIC_METHOD)         \
+    CLASS(Class, "java/lang/Class")                                                              \
+    METHOD(Class, ClassGetName, "getName", "()Ljava/lang/String;")                               \
+    CLASS(FileDescriptor, "java/io/FileDescriptor")                                              \
+    FIELD(FileDescriptor, FileDescriptorDescriptor, "descriptor", "I")                           \
+    FIELD(FileDescriptor, FileDescriptorOwnerId, "ownerId", "J")                                 \
+    METHOD(FileDescriptor, FileDescriptorInit, "<init>", "()V")                                  \
+    CLASS(NioAccess, "java/nio/NIOAccess")                                                       \
+    STATIC_METHOD(NioAccess, NioAccessGetBaseArray, "getBaseArray",                              \
+                  "(Ljava/nio/Buffer;)Ljava/lang/Object;")                                       \
+    STATIC_METHOD(NioAccess, NioAccessGetBaseArrayOffset, "getBaseArrayOffset",                  \
+                  "(Ljava/nio/Buffer;)I")                                                        \
+    CLASS(NioBuffer, "java/nio/Buffer")                                                          \
+    FIELD(NioBuffer, NioBufferAddress, "address", "J")                                           \
+    FIELD(NioBuffer, NioBufferElementSizeShift, "_elementSizeShift", "I")                        \
+    FIELD(NioBuffer, NioBufferLimit, "limit", "I")                                               \
+    FIELD(NioBuffer, NioBufferPosition, "position", "I")                                         \
+    METHOD(NioBuffer, NioBufferArray, "array", "()Ljava/lang/Object;")                           \
+    METHOD(NioBuffer, NioBufferArrayOffset, "arrayOffset", "()I")                                \
+    CLASS(PrintWriter, "java/io/PrintWriter")                                                    \
+    METHOD(PrintWriter, PrintWriterInit, "<init>", "(Ljava/io/Writer;)V")                        \
+    CLASS(Reference, "java/lang/ref/Reference")                                                  \
+    METHOD(Reference, ReferenceGet, "get", "()Ljava/lang/Object;")                               \
+    CLASS(StackTraceElement, "java/lang/StackTraceElement")                                      \
+    METHOD(StackTraceElement, StackTraceElementEquals, "equals", "(Ljava/lang/Object;)Z")        \
+    METHOD(StackTraceElement, StackTraceElementGetClassName, "getClassName",                     \
+           "()Ljava/lang/String;")                                                               \
+    METHOD(StackTraceElement, StackTraceElementGetFileName, "getFileName",                       \
+           "()Ljava/lang/String;")                                                               \
+    METHOD(StackTraceElement, StackTraceElementGetLineNumber, "getLineNumber", "()I")            \
+    METHOD(StackTraceElement, StackTraceElementGetMethodName, "getMethodName",                   \
+           "()Ljava/lang/String;")                                                               \
+    CLASS(String, "java/lang/String")                                                            \
+    CLASS(StringWriter, "java/io/StringWriter")                                                  \
+    METHOD(StringWriter, StringWriterInit, "<init>", "()V")                                      \
+    METHOD(StringWriter, StringWriterToString, "toString", "()Ljava/lang/String;")               \
+    CLASS(Throwable, "java/lang/Throwable")                                                      \
+    METHOD(Throwable, ThrowableGetCause, "getCause", "()Ljava/lang/Throwable;")                  \
+    METHOD(Throwable, ThrowableGetMessage, "getMessage", "()Ljava/lang/String;")                 \
+    METHOD(Throwable, ThrowableGetStackTrace, "getStackTrace",                                   \
+           "()[Ljava/lang/StackTraceElement;")                                                   \
+    METHOD(Throwable, ThrowableGetSuppressed, "getSuppressed", "()[Ljava/lang/Throwable;")       \
+    METHOD(Throwable, ThrowablePrintStackTrace, "printStackTrace", "(Ljava/io/PrintWriter;)V")   \
+    METHOD(Throwable, ThrowableInitCause, "initCause",                                           \
+           "(Ljava/lang/Throwable;)Ljava/lang/Throwable;")                                       \
+    METHOD(Throwable, ThrowableInitWithoutStackTrace, "<init>",                                  \
+           "(Ljava/lang/String;Ljava/lang/Throwable;ZZ)V")                                       \
+    CLASS(IOException, "java/io/IOException")                                                    \
+    METHOD(IOException, IOExceptionInit, "<init>", "(Ljava/lang/String;)V")                      \
+    METHOD(IOException, IOExceptionInitWithCause, "<init>",                                      \
+           "(Ljava/lang/String;Ljava/lang/Throwable;)V")                                         \
+    CLASS(IllegalArgumentException, "java/lang/IllegalArgumentException")                       \
+    METHOD(IllegalArgumentException, IllegalArgumentExceptionInitWithCause, "<init>",            \
+           "(Ljava/lang/String;Ljava/lang/Throwable;)V")                                         \
+    CLASS(IllegalStateException, "java/lang/IllegalStateException")                             \
+    METHOD(IllegalStateException, IllegalStateExceptionInitWithCause, "<init>",                  \
+           "(Ljava/lang/String;Ljava/lang/Throwable;)V")                                         \
+    CLASS(IndexOutOfBoundsException, "java/lang/IndexOutOfBoundsException")                     \
+    METHOD(IndexOutOfBoundsException, IndexOutOfBoundsExceptionInit, "<init>",                   \
+           "(Ljava/lang/String;)V")                                                              \
+    CLASS(NullPointerException, "java/lang/NullPointerException")                                \
+    METHOD(NullPointerException, NullPointerExceptionInit, "<init>", "(Ljava/lang/String;)V")    \
+    CLASS(OutOfMemoryError, "java/lang/OutOfMemoryError")                                        \
+    METHOD(OutOfMemoryError, OutOfMemoryErrorInit, "<init>", "(Ljava/lang/String;)V")            \
+    CLASS(RuntimeException, "java/lang/RuntimeException")                                       \
+    METHOD(RuntimeException, RuntimeExceptionInitWithCause, "<init>",                            \
+           "(Ljava/lang/String;Ljava/lang/Throwable;)V")
+
+JNI_CONSTANTS_TABLE(Constants, LIBNATIVEHELPER_JNI_CONSTANTS);
+
+// android.system.ErrnoException is only present on Android runtimes so it is
+// held in a table of its own, which is allowed to fail to resolve.
+#define LIBNATIVEHELPER_ERRNO_EXCEPTION_CONSTANTS(CLASS, FIELD, STATIC_FIELD, METHOD,            \
+                                                  STATIC_METHOD)                                 \
+    CLASS(ErrnoException, "android/system/ErrnoException")                                      \
+    METHOD(ErrnoException, ErrnoExceptionInit, "<init>", "(Ljava/lang/String;I)V")
+
+JNI_CONSTANTS_TABLE(ErrnoExceptionConstants, LIBNATIVEHELPER_ERRNO_EXCEPTION_CONSTANTS);
+
+// Whether android.system.ErrnoException failed to resolve. The failure is
+// remembered so that the lookup is not repeated for every throw.
+std::atomic<bool> g_errno_exception_class_unavailable(false);
+
+jclass GetErrnoExceptionClassIfAvailable(JNIEnv* env) {
+    if (g_errno_exception_class_unavailable.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    jclass klass = ErrnoExceptionConstants::GetErrnoExceptionClass(env);
+    if (klass == nullptr) {
+        // ClassNotFoundException is pending.
+        env->ExceptionClear();
+        g_errno_exception_class_unavailable.store(true, std::memory_order_release);
+    }
+    return klass;
 }
 
-jmethodID FindMethod(JNIEnv* env, jclass klass, const char* name, const char* signature) {
-    jmethodID result = env->GetMethodID(klass, name, signature);
-    ALOG_ALWAYS_FATAL_IF(result == nullptr, "failed to find method '%s%s'", name, signature);
-    return result;
+// The exception classes returned by JniConstants::GetCachedExceptionClass(),
+// with the constructor used to chain a cause to each: the one taking a message
+// and a cause if the class has it, or else the one taking only a message.
+struct CachedExceptionClass {
+    Constants::Index classIndex;
+    Constants::Index chainingInitIndex;
+    bool chainingInitTakesCause;
+};
+
+const CachedExceptionClass kCachedExceptionClasses[] = {
+    { Constants::kIOExceptionClass, Constants::kIOExceptionInitWithCauseMethod, true },
+    { Constants::kIllegalArgumentExceptionClass,
+      Constants::kIllegalArgumentExceptionInitWithCauseMethod, true },
+    { Constants::kIllegalStateExceptionClass,
+      Constants::kIllegalStateExceptionInitWithCauseMethod, true },
+    { Constants::kIndexOutOfBoundsExceptionClass,
+      Constants::kIndexOutOfBoundsExceptionInitMethod, false },
+    { Constants::kNullPointerExceptionClass, Constants::kNullPointerExceptionInitMethod, false },
+    { Constants::kOutOfMemoryErrorClass, Constants::kOutOfMemoryErrorInitMethod, false },
+    { Constants::kRuntimeExceptionClass, Constants::kRuntimeExceptionInitWithCauseMethod, true },
+};
+
+// Returns the entry of kCachedExceptionClasses for |className|, or nullptr.
+const CachedExceptionClass* FindCachedExceptionClass(const char* className) {
+    JniConstantTable table = Constants::GetTable();
+    for (const CachedExceptionClass& cached : kCachedExceptionClasses) {
+        if (strcmp(table.descriptor(cached.classIndex).name, className) == 0) {
+            return &cached;
+        }
+    }
+    return nullptr;
 }
 
-jmethodID FindStaticMethod(JNIEnv* env, jclass klass, const char* name, const char* signature) {
-    jmethodID result = env->GetStaticMethodID(klass, name, signature);
-    ALOG_ALWAYS_FATAL_IF(result == nullptr, "failed to find static method '%s%s'", name, signature);
-    return result;
+// The JNI_CONSTANTS_* group of each class in the Constants table.
+struct ConstantsGroup {
+    Constants::Index classIndex;
+    uint64_t mask;
+};
+
+const ConstantsGroup kConstantsGroups[] = {
+    { Constants::kClassClass, JNI_CONSTANTS_CLASS },
+    { Constants::kFileDescriptorClass, JNI_CONSTANTS_FILE_DESCRIPTOR },
+    { Constants::kNioAccessClass, JNI_CONSTANTS_NIO_ACCESS },
+    { Constants::kNioBufferClass, JNI_CONSTANTS_NIO_BUFFER },
+    { Constants::kPrintWriterClass, JNI_CONSTANTS_PRINT_WRITER },
+    { Constants::kReferenceClass, JNI_CONSTANTS_REFERENCE },
+    { Constants::kStackTraceElementClass, JNI_CONSTANTS_STACK_TRACE_ELEMENT },
+    { Constants::kStringClass, JNI_CONSTANTS_STRING },
+    { Constants::kStringWriterClass, JNI_CONSTANTS_STRING_WRITER },
+    { Constants::kThrowableClass, JNI_CONSTANTS_THROWABLE },
+    { Constants::kIOExceptionClass, JNI_CONSTANTS_IO_EXCEPTION },
+    { Constants::kIllegalArgumentExceptionClass, JNI_CONSTANTS_ILLEGAL_ARGUMENT_EXCEPTION },
+    { Constants::kIllegalStateExceptionClass, JNI_CONSTANTS_ILLEGAL_STATE_EXCEPTION },
+    { Constants::kIndexOutOfBoundsExceptionClass, JNI_CONSTANTS_INDEX_OUT_OF_BOUNDS_EXCEPTION },
+    { Constants::kNullPointerExceptionClass, JNI_CONSTANTS_NULL_POINTER_EXCEPTION },
+    { Constants::kOutOfMemoryErrorClass, JNI_CONSTANTS_OUT_OF_MEMORY_ERROR },
+    { Constants::kRuntimeExceptionClass, JNI_CONSTANTS_RUNTIME_EXCEPTION },
+};
+
+uint64_t GetGroupMask(int classIndex) {
+    for (const ConstantsGroup& group : kConstantsGroups) {
+        if (group.classIndex == classIndex) {
+            return group.mask;
+        }
+    }
+    return 0;
 }
 
-}  // namespace
+// Whether uses of constants are being recorded, and the groups recorded.
+std::atomic<bool> g_recording(false);
+std::atomic<uint64_t> g_recorded_groups(0);
 
-jclass JniConstants::GetFileDescriptorClass(JNIEnv* env) {
-    EnsureClassReferencesInitialized(env);
-    return g_file_descriptor_class;
+void RecordGroupUse(uint64_t mask) {
+    if (g_recording.load(std::memory_order_relaxed)) {
+        g_recorded_groups.fetch_or(mask, std::memory_order_relaxed);
+    }
 }
 
-jclass JniConstants::GetNioAccessClass(JNIEnv* env) {
-    EnsureClassReferencesInitialized(env);
-    return g_nio_access_class;
+// Records a use of the class at |classIndex| in the Constants table, or of one
+// of its members.
+void RecordUse(int classIndex) {
+    if (g_recording.load(std::memory_order_relaxed)) {
+        g_recorded_groups.fetch_or(GetGroupMask(classIndex), std::memory_order_relaxed);
+    }
 }
 
-jclass JniConstants::GetNioBufferClass(JNIEnv* env) {
-    EnsureClassReferencesInitialized(env);
-    return g_nio_buffer_class;
-}
+// The VM the constants are resolved for, if known.
+std::atomic<JavaVM*> g_java_vm(nullptr);
 
-jclass JniConstants::GetReferenceClass(JNIEnv* env) {
-    EnsureClassReferencesInitialized(env);
-    return g_reference_class;
-}
+// The hooks registered with jniRegisterConstantsReleaseHook().
+struct ReleaseHook {
+    JniConstants::ReleaseHookFunction function;
+    void* data;
+};
 
-jclass JniConstants::GetStringClass(JNIEnv* env) {
-    EnsureClassReferencesInitialized(env);
-    return g_string_class;
-}
+constexpr size_t kMaxReleaseHooks = 32;
 
-jfieldID JniConstants::GetFileDescriptorDescriptorField(JNIEnv* env) {
-    if (g_file_descriptor_descriptor_field == nullptr) {
-        jclass klass = GetFileDescriptorClass(env);
-        g_file_descriptor_descriptor_field = FindField(env, klass, "descriptor", "I");
-    }
-    return g_file_descriptor_descriptor_field;
-}
+std::mutex g_release_hooks_mutex;
+ReleaseHook g_release_hooks[kMaxReleaseHooks];
+size_t g_release_hook_count = 0;
+
+// Forgets every constant, deleting class references if |env| is not null, and
+// runs the release hooks.
+void ClearConstants(JNIEnv* env) {
+    Constants::GetTable().Clear(env);
+    ErrnoExceptionConstants::GetTable().Clear(env);
+    g_errno_exception_class_unavailable.store(false, std::memory_order_release);
 
-jfieldID JniConstants::GetFileDescriptorOwnerIdField(JNIEnv* env) {
-    if (g_file_descriptor_owner_id_field == nullptr) {
-        jclass klass = GetFileDescriptorClass(env);
-        g_file_descriptor_owner_id_field = FindField(env, klass, "ownerId", "J");
+    std::lock_guard<std::mutex> lock(g_release_hooks_mutex);
+    for (size_t i = 0; i < g_release_hook_count; ++i) {
+        g_release_hooks[i].function(reinterpret_cast<C_JNIEnv*>(env), g_release_hooks[i].data);
     }
-    return g_file_descriptor_owner_id_field;
 }
 
-jmethodID JniConstants::GetFileDescriptorInitMethod(JNIEnv* env) {
-    if (g_file_descriptor_init_method == nullptr) {
-        jclass klass = GetFileDescriptorClass(env);
-        g_file_descriptor_init_method = FindMethod(env, klass, "<init>", "()V");
+// Aborts if entry |index| of |table| failed to resolve to |value|.
+template <typename T>
+T CheckResolved(const JniConstantTable& table, int index, T value) {
+    if (value != nullptr) {
+        return value;
     }
-    return g_file_descriptor_init_method;
+    const JniConstantDescriptor& d = table.descriptor(index);
+    ALOG_ALWAYS_FATAL_IF(d.kind == JniConstantKind::kClass,
+                         "failed to find class '%s'", d.name);
+    ALOG_ALWAYS_FATAL_IF(d.kind == JniConstantKind::kField,
+                         "failed to find field '%s:%s'", d.name, d.signature);
+    ALOG_ALWAYS_FATAL_IF(d.kind == JniConstantKind::kStaticField,
+                         "failed to find static field '%s:%s'", d.name, d.signature);
+    ALOG_ALWAYS_FATAL_IF(d.kind == JniConstantKind::kMethod,
+                         "failed to find method '%s%s'", d.name, d.signature);
+    ALOG_ALWAYS_FATAL_IF(d.kind == JniConstantKind::kStaticMethod,
+                         "failed to find static method '%s%s'", d.name, d.signature);
+    return value;
 }
 
-jmethodID JniConstants::GetNioAccessGetBaseArrayMethod(JNIEnv* env) {
-    if (g_nio_access_get_base_array_method == nullptr) {
-        jclass klass = GetNioAccessClass(env);
-        g_nio_access_get_base_array_method =
-                FindStaticMethod(env, klass, "getBaseArray",
-                                 "(Ljava/nio/Buffer;)Ljava/lang/Object;");
+}  // namespace
+
+#define JNI_CONSTANTS_CLASS_GETTER(name, className)                                   \
+    jclass JniConstants::Get##name##Class(JNIEnv* env) {                              \
+        RecordUse(Constants::k##name##Class);                                         \
+        return CheckResolved(Constants::GetTable(), Constants::k##name##Class,        \
+                             Constants::Get##name##Class(env));                       \
+    }
+#define JNI_CONSTANTS_FIELD_GETTER(cls, name, memberName, signature)                  \
+    jfieldID JniConstants::Get##name##Field(JNIEnv* env) {                            \
+        RecordUse(Constants::k##cls##Class);                                          \
+        return CheckResolved(Constants::GetTable(), Constants::k##name##Field,        \
+                             Constants::Get##name##Field(env));                       \
     }
-    return g_nio_access_get_base_array_method;
+#define JNI_CONSTANTS_METHOD_GETTER(cls, name, memberName, signature)                 \
+    jmethodID JniConstants::Get##name##Method(JNIEnv* env) {                          \
+        RecordUse(Constants::k##cls##Class);                                          \
+        return CheckResolved(Constants::GetTable(), Constants::k##name##Method,       \
+                             Constants::Get##name##Method(env));                      \
+    }
+
+LIBNATIVEHELPER_JNI_CONSTANTS(JNI_CONSTANTS_CLASS_GETTER,
+                              JNI_CONSTANTS_FIELD_GETTER,
+                              JNI_CONSTANTS_FIELD_GETTER,
+                              JNI_CONSTANTS_METHOD_GETTER,
+                              JNI_CONSTANTS_METHOD_GETTER)
+
+#undef JNI_CONSTANTS_CLASS_GETTER
+#undef JNI_CONSTANTS_FIELD_GETTER
+#undef JNI_CONSTANTS_METHOD_GETTER
+
+jclass JniConstants::GetErrnoExceptionClass(JNIEnv* env) {
+    RecordGroupUse(JNI_CONSTANTS_ERRNO_EXCEPTION);
+    return GetErrnoExceptionClassIfAvailable(env);
 }
 
-jmethodID JniConstants::GetNioAccessGetBaseArrayOffsetMethod(JNIEnv* env) {
-    if (g_nio_access_get_base_array_offset_method == nullptr) {
-        jclass klass = GetNioAccessClass(env);
-        g_nio_access_get_base_array_offset_method =
-                FindStaticMethod(env, klass, "getBaseArrayOffset", "(Ljava/nio/Buffer;)I");
-    }
-    return g_nio_access_get_base_array_offset_method;
+jmethodID JniConstants::GetErrnoExceptionInitMethod(JNIEnv* env) {
+    RecordGroupUse(JNI_CONSTANTS_ERRNO_EXCEPTION);
+    return CheckResolved(ErrnoExceptionConstants::GetTable(),
+                         ErrnoExceptionConstants::kErrnoExceptionInitMethod,
+                         ErrnoExceptionConstants::GetErrnoExceptionInitMethod(env));
 }
 
-jfieldID JniConstants::GetNioBufferAddressField(JNIEnv* env) {
-    if (g_nio_buffer_address_field == nullptr) {
-        jclass klass = GetNioBufferClass(env);
-        g_nio_buffer_address_field = FindField(env, klass, "address", "J");
+jclass JniConstants::GetCachedExceptionClass(JNIEnv* env, const char* className) {
+    const CachedExceptionClass* cached = FindCachedExceptionClass(className);
+    if (cached == nullptr) {
+        return nullptr;
     }
-    return g_nio_buffer_address_field;
+    JniConstantTable table = Constants::GetTable();
+    RecordUse(cached->classIndex);
+    return CheckResolved(table, cached->classIndex, table.GetClass(env, cached->classIndex));
 }
 
-jfieldID JniConstants::GetNioBufferElementSizeShiftField(JNIEnv* env) {
-    if (g_nio_buffer_element_size_shift_field == nullptr) {
-        jclass klass = GetNioBufferClass(env);
-        g_nio_buffer_element_size_shift_field = FindField(env, klass, "_elementSizeShift", "I");
+jmethodID JniConstants::GetCachedExceptionChainingInit(JNIEnv* env, const char* className,
+                                                       bool* takesCause) {
+    const CachedExceptionClass* cached = FindCachedExceptionClass(className);
+    if (cached == nullptr) {
+        return nullptr;
     }
-    return g_nio_buffer_element_size_shift_field;
+    JniConstantTable table = Constants::GetTable();
+    RecordUse(cached->classIndex);
+    *takesCause = cached->chainingInitTakesCause;
+    return CheckResolved(table, cached->chainingInitIndex,
+                         table.GetMethod(env, cached->chainingInitIndex));
 }
 
-jfieldID JniConstants::GetNioBufferLimitField(JNIEnv* env) {
-    if (g_nio_buffer_limit_field == nullptr) {
-        jclass klass = GetNioBufferClass(env);
-        g_nio_buffer_limit_field = FindField(env, klass, "limit", "I");
+bool JniConstants::Prewarm(JNIEnv* env, uint64_t mask) {
+    bool resolved = true;
+    JniConstantTable table = Constants::GetTable();
+    for (int i = 0; i < table.size(); ++i) {
+        const JniConstantDescriptor& d = table.descriptor(i);
+        int classIndex = d.kind == JniConstantKind::kClass ? i : d.classIndex;
+        if ((GetGroupMask(classIndex) & mask) != 0 && !table.Resolve(env, i)) {
+            ALOGW("failed to prewarm '%s'", d.name);
+            env->ExceptionClear();
+            resolved = false;
+        }
     }
-    return g_nio_buffer_limit_field;
+    if ((mask & JNI_CONSTANTS_ERRNO_EXCEPTION) != 0 &&
+        GetErrnoExceptionClassIfAvailable(env) != nullptr) {
+        JniConstantTable errnoTable = ErrnoExceptionConstants::GetTable();
+        if (!errnoTable.Resolve(env, ErrnoExceptionConstants::kErrnoExceptionInitMethod)) {
+            ALOGW("failed to prewarm 'android/system/ErrnoException.<init>'");
+            env->ExceptionClear();
+            resolved = false;
+        }
+    }
+    return resolved;
 }
 
-jfieldID JniConstants::GetNioBufferPositionField(JNIEnv* env) {
-    if (g_nio_buffer_position_field == nullptr) {
-        jclass klass = GetNioBufferClass(env);
-        g_nio_buffer_position_field = FindField(env, klass, "position", "I");
-    }
-    return g_nio_buffer_position_field;
+void JniConstants::StartRecording() {
+    g_recorded_groups.store(0, std::memory_order_relaxed);
+    g_recording.store(true, std::memory_order_relaxed);
 }
 
-jmethodID JniConstants::GetNioBufferArrayMethod(JNIEnv* env) {
-    if (g_nio_buffer_array_method == nullptr) {
-        jclass klass = GetNioBufferClass(env);
-        g_nio_buffer_array_method = FindMethod(env, klass, "array", "()Ljava/lang/Object;");
-    }
-    return g_nio_buffer_array_method;
+uint64_t JniConstants::StopRecording() {
+    g_recording.store(false, std::memory_order_relaxed);
+    return g_recorded_groups.exchange(0, std::memory_order_relaxed);
 }
 
-jmethodID JniConstants::GetNioBufferArrayOffsetMethod(JNIEnv* env) {
-    if (g_nio_buffer_array_offset_method == nullptr) {
-        jclass klass = GetNioBufferClass(env);
-        g_nio_buffer_array_offset_method = FindMethod(env, klass, "arrayOffset", "()I");
-    }
-    return g_nio_buffer_array_offset_method;
+void JniConstants::SetJavaVM(JavaVM* vm) {
+    g_java_vm.store(vm, std::memory_order_release);
 }
 
-jmethodID JniConstants::GetReferenceGetMethod(JNIEnv* env) {
-    if (g_reference_get_method == nullptr) {
-        jclass klass = GetReferenceClass(env);
-        g_reference_get_method = FindMethod(env, klass, "get", "()Ljava/lang/Object;");
-    }
-    return g_reference_get_method;
+uint32_t JniConstants::GetGeneration() {
+    return Constants::GetTable().generation();
 }
 
-void JniConstants::EnsureClassReferencesInitialized(JNIEnv* env) {
-    // Fast check if class references are initialized.
-    if (g_class_refs_initialized.load(std::memory_order_acquire)) {
+void JniConstants::Release(JNIEnv* env) {
+    JavaVM* vm = nullptr;
+    if (env->GetJavaVM(&vm) != JNI_OK) {
         return;
     }
-
-    // Slower check with initialization if necessary.
-    std::lock_guard<std::mutex> guard(g_class_refs_mutex);
-    if (g_class_refs_initialized.load(std::memory_order_relaxed)) {
+    // The constants are only released by the VM they were resolved for. If no
+    // VM was recorded, the VM of |env| is the only one they could belong to.
+    JavaVM* owner = g_java_vm.load(std::memory_order_acquire);
+    if (owner != nullptr && owner != vm) {
         return;
     }
+    ClearConstants(env);
+    g_java_vm.store(nullptr, std::memory_order_release);
+}
 
-    // Class constants should be initialized only once because they global
-    // references. Field ids and Method ids can be initialized later since they
-    // are not references and races only have trivial performance
-    // consequences.
-    g_file_descriptor_class = FindClass(env, "java/io/FileDescriptor");
-    g_nio_access_class = FindClass(env, "java/nio/NIOAccess");
-    g_nio_buffer_class = FindClass(env, "java/nio/Buffer");
-    g_reference_class = FindClass(env, "java/lang/ref/Reference");
-    g_string_class = FindClass(env, "java/lang/String");
-    g_class_refs_initialized.store(true, std::memory_order_release);
+bool JniConstants::AddReleaseHook(ReleaseHookFunction function, void* data) {
+    std::lock_guard<std::mutex> lock(g_release_hooks_mutex);
+    for (size_t i = 0; i < g_release_hook_count; ++i) {
+        if (g_release_hooks[i].function == function && g_release_hooks[i].data == data) {
+            return true;
+        }
+    }
+    if (g_release_hook_count == kMaxReleaseHooks) {
+        ALOGE("Too many constants release hooks registered");
+        return false;
+    }
+    g_release_hooks[g_release_hook_count++] = { function, data };
+    return true;
 }
 
 void JniConstants::Uninitialize() {
-    // This method is called when a new runtime instance is created. There is no
-    // notification of a runtime instance being destroyed in the JNI interface
-    // so we piggyback on creation. Since only one runtime is supported at a
-    // time, we know the constants are invalid when JNI_CreateJavaVM() is
-    // called.
-    //
-    // Clean shutdown would require calling DeleteGlobalRef() for each of the
-    // class references.
-    std::lock_guard<std::mutex> guard(g_class_refs_mutex);
-    g_file_descriptor_class = nullptr;
-    g_file_descriptor_descriptor_field = nullptr;
-    g_file_descriptor_owner_id_field = nullptr;
-    g_file_descriptor_init_method = nullptr;
-    g_nio_access_class = nullptr;
-    g_nio_access_get_base_array_method = nullptr;
-    g_nio_access_get_base_array_offset_method = nullptr;
-    g_nio_buffer_class = nullptr;
-    g_nio_buffer_address_field = nullptr;
-    g_nio_buffer_element_size_shift_field = nullptr;
-    g_nio_buffer_limit_field = nullptr;
-    g_nio_buffer_position_field = nullptr;
-    g_nio_buffer_array_method = nullptr;
-    g_nio_buffer_array_offset_method = nullptr;
-    g_reference_class = nullptr;
-    g_reference_get_method = nullptr;
-    g_string_class = nullptr;
-    g_class_refs_initialized.store(false, std::memory_order_release);
+    // This method is called when a new runtime instance is created, by which
+    // time the runtime the constants were resolved for may no longer exist.
+    // Runtimes destroyed through JniInvocationDestroyJavaVM() have already
+    // released their constants.
+    ClearConstants(nullptr);
+    g_java_vm.store(nullptr, std::memory_order_release);
 }
@@ -17,9 +17,20 @@
 #ifndef LIBNATIVEHELPER_JNICONSTANTS_H_
 #define LIBNATIVEHELPER_JNICONSTANTS_H_
 
+#include <stdint.h>
+
 #include "jni.h"
 
+// Classes, fields and methods used by libnativehelper. Each is looked up
+// independently the first time its getter is called, and the process is
+// aborted if it cannot be found.
 struct JniConstants {
+    // Global reference to java.lang.Class.
+    static jclass GetClassClass(JNIEnv* env);
+
+    // String java.lang.Class.getName()
+    static jmethodID GetClassGetNameMethod(JNIEnv* env);
+
     // Global reference to java.io.FileDescriptor.
     static jclass GetFileDescriptorClass(JNIEnv* env);
 
@@ -62,24 +73,177 @@ struct JniConstants {
     // int java.nio.Buffer.arrayOffset()
     static jmethodID GetNioBufferArrayOffsetMethod(JNIEnv* env);
 
+    // Global reference to java.io.PrintWriter.
+    static jclass GetPrintWriterClass(JNIEnv* env);
+
+    // void java.io.PrintWriter.<init>(Writer)
+    static jmethodID GetPrintWriterInitMethod(JNIEnv* env);
+
     // Global reference to java.lang.ref.Reference.
     static jclass GetReferenceClass(JNIEnv* env);
 
     // Object java.lang.ref.Reference.get()
     static jmethodID GetReferenceGetMethod(JNIEnv* env);
 
+    // Global reference to java.lang.StackTraceElement.
+    static jclass GetStackTraceElementClass(JNIEnv* env);
+
+    // boolean java.lang.StackTraceElement.equals(Object)
+    static jmethodID GetStackTraceElementEqualsMethod(JNIEnv* env);
+
+    // String java.lang.StackTraceElement.getClassName()
+    static jmethodID GetStackTraceElementGetClassNameMethod(JNIEnv* env);
+
+    // String java.lang.StackTraceElement.getFileName()
+    static jmethodID GetStackTraceElementGetFileNameMethod(JNIEnv* env);
+
+    // int java.lang.StackTraceElement.getLineNumber()
+    static jmethodID GetStackTraceElementGetLineNumberMethod(JNIEnv* env);
+
+    // String java.lang.StackTraceElement.getMethodName()
+    static jmethodID GetStackTraceElementGetMethodNameMethod(JNIEnv* env);
+
     // Global reference to java.lang.String.
     static jclass GetStringClass(JNIEnv* env);
 
-    // Ensure class constants are initialized before use. Field and method
-    // constants are lazily initialized via getters.
-    static void EnsureClassReferencesInitialized(JNIEnv* env);
+    // Global reference to java.io.StringWriter.
+    static jclass GetStringWriterClass(JNIEnv* env);
+
+    // void java.io.StringWriter.<init>()
+    static jmethodID GetStringWriterInitMethod(JNIEnv* env);
+
+    // String java.io.StringWriter.toString()
+    static jmethodID GetStringWriterToStringMethod(JNIEnv* env);
+
+    // Global reference to java.lang.Throwable.
+    static jclass GetThrowableClass(JNIEnv* env);
+
+    // Throwable java.lang.Throwable.getCause()
+    static jmethodID GetThrowableGetCauseMethod(JNIEnv* env);
+
+    // String java.lang.Throwable.getMessage()
+    static jmethodID GetThrowableGetMessageMethod(JNIEnv* env);
+
+    // StackTraceElement[] java.lang.Throwable.getStackTrace()
+    static jmethodID GetThrowableGetStackTraceMethod(JNIEnv* env);
+
+    // Throwable[] java.lang.Throwable.getSuppressed()
+    static jmethodID GetThrowableGetSuppressedMethod(JNIEnv* env);
+
+    // void java.lang.Throwable.printStackTrace(PrintWriter)
+    static jmethodID GetThrowablePrintStackTraceMethod(JNIEnv* env);
+
+    // Throwable java.lang.Throwable.initCause(Throwable)
+    static jmethodID GetThrowableInitCauseMethod(JNIEnv* env);
+
+    // void java.lang.Throwable.<init>(String, Throwable, boolean, boolean)
+    static jmethodID GetThrowableInitWithoutStackTraceMethod(JNIEnv* env);
+
+    // Global reference to java.io.IOException.
+    static jclass GetIOExceptionClass(JNIEnv* env);
+
+    // void java.io.IOException.<init>(String)
+    static jmethodID GetIOExceptionInitMethod(JNIEnv* env);
+
+    // void java.io.IOException.<init>(String, Throwable)
+    static jmethodID GetIOExceptionInitWithCauseMethod(JNIEnv* env);
+
+    // Global reference to java.lang.IllegalArgumentException.
+    static jclass GetIllegalArgumentExceptionClass(JNIEnv* env);
+
+    // void java.lang.IllegalArgumentException.<init>(String, Throwable)
+    static jmethodID GetIllegalArgumentExceptionInitWithCauseMethod(JNIEnv* env);
+
+    // Global reference to java.lang.IllegalStateException.
+    static jclass GetIllegalStateExceptionClass(JNIEnv* env);
+
+    // void java.lang.IllegalStateException.<init>(String, Throwable)
+    static jmethodID GetIllegalStateExceptionInitWithCauseMethod(JNIEnv* env);
+
+    // Global reference to java.lang.IndexOutOfBoundsException.
+    static jclass GetIndexOutOfBoundsExceptionClass(JNIEnv* env);
+
+    // void java.lang.IndexOutOfBoundsException.<init>(String)
+    static jmethodID GetIndexOutOfBoundsExceptionInitMethod(JNIEnv* env);
+
+    // Global reference to java.lang.NullPointerException.
+    static jclass GetNullPointerExceptionClass(JNIEnv* env);
+
+    // void java.lang.NullPointerException.<init>(String)
+    static jmethodID GetNullPointerExceptionInitMethod(JNIEnv* env);
+
+    // Global reference to java.lang.OutOfMemoryError.
+    static jclass GetOutOfMemoryErrorClass(JNIEnv* env);
+
+    // void java.lang.OutOfMemoryError.<init>(String)
+    static jmethodID GetOutOfMemoryErrorInitMethod(JNIEnv* env);
+
+    // Global reference to java.lang.RuntimeException.
+    static jclass GetRuntimeExceptionClass(JNIEnv* env);
+
+    // void java.lang.RuntimeException.<init>(String, Throwable)
+    static jmethodID GetRuntimeExceptionInitWithCauseMethod(JNIEnv* env);
+
+    // Global reference to android.system.ErrnoException, or nullptr if the
+    // class is not available (e.g. when not running on an Android runtime).
+    // Unlike the classes above, a failed lookup is not fatal.
+    static jclass GetErrnoExceptionClass(JNIEnv* env);
+
+    // void android.system.ErrnoException.<init>(String, int). Only valid if
+    // GetErrnoExceptionClass() returns a class.
+    static jmethodID GetErrnoExceptionInitMethod(JNIEnv* env);
+
+    // Returns the global reference held for the exception class named |className|
+    // (e.g. "java/lang/NullPointerException"), or nullptr if that class is not
+    // one of the exception classes above.
+    static jclass GetCachedExceptionClass(JNIEnv* env, const char* className);
+
+    // Returns the constructor used to chain a cause to an instance of the
+    // cached exception class named |className|: its (String, Throwable)
+    // constructor, setting |*takesCause| to true, or if it has none its
+    // (String) constructor, setting it to false. Returns nullptr if that class
+    // is not one of the exception classes above.
+    static jmethodID GetCachedExceptionChainingInit(JNIEnv* env, const char* className,
+                                                    bool* takesCause);
+
+    // Resolves the constants in the groups selected by |mask|, a combination
+    // of the JNI_CONSTANTS_* flags. Constants that cannot be resolved are
+    // skipped, and false is returned.
+    static bool Prewarm(JNIEnv* env, uint64_t mask);
+
+    // Starts recording the groups of the constants returned by the getters
+    // above, forgetting any earlier recording.
+    static void StartRecording();
+
+    // Stops recording and returns the groups recorded.
+    static uint64_t StopRecording();
+
+    // Records |vm| as the VM the constants are resolved for. Called when a VM
+    // is created.
+    static void SetJavaVM(JavaVM* vm);
+
+    // Returns the number of times the constants have been released or
+    // uninitialized. Values derived from the constants should be discarded
+    // when it changes.
+    static uint32_t GetGeneration();
+
+    // Releases the constants if they were resolved for the VM of |env|,
+    // deleting the global references held. Called before that VM is
+    // destroyed, on a thread attached to it.
+    static void Release(JNIEnv* env);
+
+    typedef void (*ReleaseHookFunction)(C_JNIEnv* env, void* data);
+
+    // Adds a hook that Release() and Uninitialize() call after clearing the
+    // constants, with the env passed to Release() or null. Adding a hook that
+    // was already added does nothing. Returns false if there are too many.
+    static bool AddReleaseHook(ReleaseHookFunction function, void* data);
 
     // Ensure any cached heap objects from previous VM instances are
-    // invalidated. There is no notification here that a VM is destroyed so this
-    // method must be called when a new VM is created (and calls from any
-    // earlier VM's are completed). The caching of heap objects in this class is
-    // one reason why there is a limit of VM instance per process.
+    // invalidated. Unlike Release(), the global references held are abandoned
+    // rather than deleted, as they may belong to a VM that no longer exists.
+    // This method is called when a new VM is created (and calls from any
+    // earlier VM's are completed).
     static void Uninitialize();
 };
 
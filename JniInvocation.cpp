@@ -33,6 +33,7 @@
 #include <android-base/errors.h>
 #endif
 
+#include "ExceptionLogger.h"
 #include "JniConstants.h"
 
 namespace {
@@ -284,10 +285,14 @@ jint JNI_GetDefaultJavaVMInitArgs(void* vm_args) {
 
 jint JNI_CreateJavaVM(JavaVM** p_vm, JNIEnv** p_env, void* vm_args) {
   // Ensure any cached heap objects from previous VM instances are
-  // invalidated. There is no notification here that a VM is destroyed. These
-  // cached objects limit us to one VM instance per process.
+  // invalidated. Constants of VMs destroyed with JniInvocationDestroyJavaVM()
+  // have already been released.
   JniConstants::Uninitialize();
-  return JniInvocationImpl::GetJniInvocation().JNI_CreateJavaVM(p_vm, p_env, vm_args);
+  jint result = JniInvocationImpl::GetJniInvocation().JNI_CreateJavaVM(p_vm, p_env, vm_args);
+  if (result == JNI_OK) {
+    JniConstants::SetJavaVM(*p_vm);
+  }
+  return result;
 }
 
 jint JNI_GetCreatedJavaVMs(JavaVM** vms, jsize size, jsize* vm_count) {
@@ -316,3 +321,17 @@ int JniInvocationInit(JniInvocationImpl* instance, const char* library) {
 const char* JniInvocationGetLibrary(const char* library, char* buffer) {
   return JniInvocationImpl::GetLibrary(library, buffer);
 }
+
+jint JniInvocationDestroyJavaVM(JavaVM* vm) {
+  // Global references can only be deleted from a thread attached to the VM.
+  JNIEnv* env = nullptr;
+  if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK) {
+    ExceptionLogger::Stop(env);
+    JniConstants::Release(env);
+  } else {
+    ALOGW("JniInvocationDestroyJavaVM() called from a detached thread, cached constants leaked");
+    ExceptionLogger::Stop(nullptr);
+    JniConstants::Uninitialize();
+  }
+  return vm->DestroyJavaVM();
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_ARRAY_ACCESS_POLICY_H_
+#define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_ARRAY_ACCESS_POLICY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "jni.h"
+#include "thread_buffer_pool.h"
+
+namespace nativehelper {
+
+// The ways of reading the elements of a Java array.
+enum class ArrayAccess {
+    kRegion,    // Copy into a native buffer with GetXxxArrayRegion.
+    kElements,  // GetXxxArrayElements.
+    kCritical,  // GetPrimitiveArrayCritical.
+};
+
+// A snapshot of what ArrayAccessPolicy has learnt about the runtime.
+struct ArrayAccessStats {
+    // GetXxxArrayElements calls seen, and how many of them returned a copy.
+    uint64_t elementsCalls;
+    uint64_t elementsCopies;
+    // GetPrimitiveArrayCritical calls seen, and how many of them returned a copy.
+    uint64_t criticalCalls;
+    uint64_t criticalCopies;
+    // The average cost of a GetXxxArrayElements call that did not copy, in
+    // nanoseconds, or 0 if none has been timed.
+    uint64_t pinNanos;
+    // The average cost of GetXxxArrayRegion per byte copied, in picoseconds,
+    // or 0 if none has been timed.
+    uint64_t copyPicosPerByte;
+    // Arrays of up to this many bytes are best copied with GetXxxArrayRegion.
+    size_t regionCutoffBytes;
+};
+
+// ArrayAccessPolicy decides, for arrays of element type T, whether copying a
+// range with GetXxxArrayRegion or pinning the array is cheaper, from what the
+// scoped array helpers observe at runtime:
+//
+//  - whether GetXxxArrayElements and GetPrimitiveArrayCritical return copies,
+//    recorded on every call;
+//  - how long GetXxxArrayElements takes when it does not copy, and how long
+//    GetXxxArrayRegion takes per byte, timed on the first calls of each thread
+//    and then on one call in 64.
+//
+// So that recording does not make every thread write the same cache line,
+// each thread counts calls on its own and adds its counts to the shared ones
+// for its first calls, then every 64 calls and when it exits. The shared
+// counts may therefore lag by up to 63 calls per thread.
+//
+// Until the runtime has been seen to pin arrays, and both costs have been
+// timed, arrays of up to ThreadBufferPool::kMaxPooledBytes are copied, as
+// before. Once they have, arrays are copied only up to the size at which
+// copying costs as much as pinning, which is at least 1 KiB. Each element type
+// is tracked separately, as runtimes may treat them differently.
+//
+// ScopedXxxArrayRO uses the policy to choose between its buffers and
+// GetXxxArrayElements. Code that makes its own calls can use Choose() and the
+// Record functions, and GetStats() shows what has been learnt.
+//
+// The state lives in function-local statics of this header, so each shared
+// library that uses the policy has its own copy of it, and learns and reports
+// only from the calls made by its own code.
+template <typename T>
+class ArrayAccessPolicy {
+public:
+    // Returns the cheapest way of reading |length| elements. kCritical is only
+    // returned if |criticalAllowed|, when the runtime copies for
+    // GetXxxArrayElements but not for GetPrimitiveArrayCritical and the array
+    // is too large to copy.
+    static ArrayAccess Choose(size_t length, bool criticalAllowed) {
+        if (length <= regionCutoff()) {
+            return ArrayAccess::kRegion;
+        }
+        const State& state = GetState();
+        if (criticalAllowed && Copies(state.elementsCalls, state.elementsCopies) &&
+                Pins(state.criticalCalls, state.criticalCopies)) {
+            return ArrayAccess::kCritical;
+        }
+        return ArrayAccess::kElements;
+    }
+
+    // Returns the number of elements up to which arrays are best copied.
+    static size_t regionCutoff() {
+        return regionCutoffBytes() / sizeof(T);
+    }
+
+    // Returns a start time to pass to the Record functions if this call should
+    // be timed, or 0.
+    static uint64_t StartSample() {
+        uint64_t n = GetThreadCounts().samples++;
+        if (n >= kWarmUpSamples && n % kSampleInterval != 0) {
+            return 0;
+        }
+        return Now();
+    }
+
+    // Records a GetXxxArrayElements call, timed from |start| if it is not 0.
+    static void RecordElements(jboolean isCopy, uint64_t start) {
+        if (start != 0) {
+            RecordTimedElements(isCopy, Now() - start);
+        } else {
+            CountElements(isCopy);
+        }
+    }
+
+    // Records a GetXxxArrayElements call that took |nanos| nanoseconds.
+    static void RecordTimedElements(jboolean isCopy, uint64_t nanos) {
+        CountElements(isCopy);
+        if (!isCopy) {
+            UpdateAverage(&GetState().pinNanos, nanos);
+        }
+    }
+
+    // Records a GetPrimitiveArrayCritical call.
+    static void RecordCritical(jboolean isCopy) {
+        ThreadCounts& counts = GetThreadCounts();
+        counts.criticalCalls++;
+        if (isCopy) {
+            counts.criticalCopies++;
+        }
+        counts.Counted();
+    }
+
+    // Records a GetXxxArrayRegion call copying |length| elements, timed from
+    // |start| if it is not 0.
+    static void RecordRegion(size_t length, uint64_t start) {
+        if (start != 0) {
+            RecordTimedRegion(length, Now() - start);
+        }
+    }
+
+    // Records a GetXxxArrayRegion call that copied |length| elements in
+    // |nanos| nanoseconds. Copies too small to measure the cost per byte are
+    // ignored.
+    static void RecordTimedRegion(size_t length, uint64_t nanos) {
+        size_t bytes = length * sizeof(T);
+        if (bytes < kMinTimedCopyBytes) {
+            return;
+        }
+        UpdateAverage(&GetState().copyPicosPerByte, nanos * 1000 / bytes);
+    }
+
+    // Returns what has been learnt, including every call recorded by the
+    // calling thread.
+    static ArrayAccessStats GetStats() {
+        GetThreadCounts().Flush();
+        const State& state = GetState();
+        ArrayAccessStats stats;
+        stats.elementsCalls = state.elementsCalls.load(std::memory_order_relaxed);
+        stats.elementsCopies = state.elementsCopies.load(std::memory_order_relaxed);
+        stats.criticalCalls = state.criticalCalls.load(std::memory_order_relaxed);
+        stats.criticalCopies = state.criticalCopies.load(std::memory_order_relaxed);
+        stats.pinNanos = state.pinNanos.load(std::memory_order_relaxed);
+        stats.copyPicosPerByte = state.copyPicosPerByte.load(std::memory_order_relaxed);
+        stats.regionCutoffBytes = regionCutoffBytes();
+        return stats;
+    }
+
+    // Forgets everything recorded, for example after switching runtime modes.
+    // Calls other threads have counted but not yet added are kept.
+    static void Reset() {
+        ThreadCounts& counts = GetThreadCounts();
+        counts = ThreadCounts();
+        State& state = GetState();
+        state.elementsCalls.store(0, std::memory_order_relaxed);
+        state.elementsCopies.store(0, std::memory_order_relaxed);
+        state.criticalCalls.store(0, std::memory_order_relaxed);
+        state.criticalCopies.store(0, std::memory_order_relaxed);
+        state.pinNanos.store(0, std::memory_order_relaxed);
+        state.copyPicosPerByte.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static const uint64_t kWarmUpSamples = 8;
+    static const uint64_t kSampleInterval = 64;
+    static const uint64_t kFlushInterval = 64;
+    static const size_t kMinTimedCopyBytes = 512;
+    static const size_t kMinCutoffBytes = 1024;
+    static const size_t kMaxCutoffBytes = ThreadBufferPool::kMaxPooledBytes;
+
+    struct State {
+        std::atomic<uint64_t> elementsCalls;
+        std::atomic<uint64_t> elementsCopies;
+        std::atomic<uint64_t> criticalCalls;
+        std::atomic<uint64_t> criticalCopies;
+        std::atomic<uint64_t> pinNanos;
+        std::atomic<uint64_t> copyPicosPerByte;
+    };
+
+    // The calls a thread has counted but not yet added to the shared State.
+    struct ThreadCounts {
+        uint64_t samples = 0;
+        uint64_t calls = 0;
+        uint64_t elementsCalls = 0;
+        uint64_t elementsCopies = 0;
+        uint64_t criticalCalls = 0;
+        uint64_t criticalCopies = 0;
+
+        ~ThreadCounts() {
+            Flush();
+        }
+
+        // Adds the counts to the shared State on the first calls, and then
+        // every kFlushInterval calls.
+        void Counted() {
+            ++calls;
+            if (calls <= kWarmUpSamples || calls % kFlushInterval == 0) {
+                Flush();
+            }
+        }
+
+        void Flush() {
+            State& state = GetState();
+            Add(&state.elementsCalls, &elementsCalls);
+            Add(&state.elementsCopies, &elementsCopies);
+            Add(&state.criticalCalls, &criticalCalls);
+            Add(&state.criticalCopies, &criticalCopies);
+        }
+
+        static void Add(std::atomic<uint64_t>* total, uint64_t* count) {
+            if (*count != 0) {
+                total->fetch_add(*count, std::memory_order_relaxed);
+                *count = 0;
+            }
+        }
+    };
+
+    static State& GetState() {
+        // Zero-initialized before any dynamic initialization.
+        static State state;
+        return state;
+    }
+
+    static ThreadCounts& GetThreadCounts() {
+        static thread_local ThreadCounts counts;
+        return counts;
+    }
+
+    static void CountElements(jboolean isCopy) {
+        ThreadCounts& counts = GetThreadCounts();
+        counts.elementsCalls++;
+        if (isCopy) {
+            counts.elementsCopies++;
+        }
+        counts.Counted();
+    }
+
+    static uint64_t Now() {
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        return now != 0 ? now : 1;
+    }
+
+    // Keeps a moving average of the samples, weighting each new one by 1/8.
+    // Concurrent updates may lose a sample, which is harmless.
+    static void UpdateAverage(std::atomic<uint64_t>* average, uint64_t sample) {
+        uint64_t old = average->load(std::memory_order_relaxed);
+        uint64_t updated = old == 0 ? sample : old - old / 8 + sample / 8;
+        average->store(updated != 0 ? updated : 1, std::memory_order_relaxed);
+    }
+
+    static bool Copies(uint64_t calls, uint64_t copies) {
+        return calls != 0 && copies * 2 > calls;
+    }
+
+    static bool Pins(uint64_t calls, uint64_t copies) {
+        return calls != 0 && copies * 2 <= calls;
+    }
+
+    static size_t regionCutoffBytes() {
+        const State& state = GetState();
+        uint64_t pinNanos = state.pinNanos.load(std::memory_order_relaxed);
+        uint64_t copyPicosPerByte = state.copyPicosPerByte.load(std::memory_order_relaxed);
+        if (!Pins(state.elementsCalls.load(std::memory_order_relaxed),
+                  state.elementsCopies.load(std::memory_order_relaxed)) ||
+                pinNanos == 0 || copyPicosPerByte == 0) {
+            return kMaxCutoffBytes;
+        }
+        uint64_t bytes = pinNanos * 1000 / copyPicosPerByte;
+        if (bytes < kMinCutoffBytes) {
+            return kMinCutoffBytes;
+        }
+        return bytes < kMaxCutoffBytes ? static_cast<size_t>(bytes) : kMaxCutoffBytes;
+    }
+};
+
+}  // namespace nativehelper
+
+#endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_ARRAY_ACCESS_POLICY_H_
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_JNI_CONSTANTS_TABLE_H_
+#define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_JNI_CONSTANTS_TABLE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "jni.h"
+#include "scoped_local_ref.h"
+
+/*
+ * Tables of lazily resolved JNI classes, field ids and method ids.
+ *
+ * A table is declared from a list macro that describes its entries:
+ *
+ *   #define MY_JNI_CONSTANTS(CLASS, FIELD, STATIC_FIELD, METHOD, STATIC_METHOD) \
+ *       CLASS(Widget, "com/example/Widget")                                     \
+ *       FIELD(Widget, WidgetSize, "size", "I")                                  \
+ *       METHOD(Widget, WidgetDraw, "draw", "(Landroid/graphics/Canvas;)V")
+ *
+ *   JNI_CONSTANTS_TABLE(MyJniConstants, MY_JNI_CONSTANTS);
+ *
+ * which declares a struct with one static getter per entry, named after the
+ * entry with a Class, Field or Method suffix:
+ *
+ *   jclass MyJniConstants::GetWidgetClass(JNIEnv* env);
+ *   jfieldID MyJniConstants::GetWidgetSizeField(JNIEnv* env);
+ *   jmethodID MyJniConstants::GetWidgetDrawMethod(JNIEnv* env);
+ *
+ * Each entry is resolved independently the first time its getter is called,
+ * together with the class that declares it, and is then held for the life of
+ * the process. Classes are held as global references. Getters do not take
+ * locks; concurrent first calls may each look up an entry, but only one
+ * global reference is kept.
+ *
+ * A getter returns nullptr, with an exception pending, if its entry cannot
+ * be resolved. It will try again on the next call.
+ *
+ * A table can be cleared, for instance when the VM its classes belong to is
+ * destroyed. Each clear starts a new generation of the table; an entry that
+ * was being resolved while the table was cleared is not kept.
+ *
+ * Tables that hold class references are added to the JniConstantTableRegistry
+ * of their shared library, so that all of them can be cleared at once. To have
+ * them cleared when the VM is destroyed with JniInvocationDestroyJavaVM(), a
+ * library that links libnativehelper registers the registry once, for instance
+ * from JNI_OnLoad:
+ *
+ *   jniRegisterConstantsReleaseHook(JniConstantTableRegistry::ReleaseHook, nullptr);
+ */
+
+enum class JniConstantKind {
+    kClass,
+    kField,
+    kStaticField,
+    kMethod,
+    kStaticMethod,
+};
+
+// Describes one entry of a table.
+struct JniConstantDescriptor {
+    JniConstantKind kind;
+    // The index of the declaring class for a field or method, otherwise -1.
+    int classIndex;
+    // The class name in the form passed to FindClass, or the field or method name.
+    const char* name;
+    // The field or method signature, otherwise nullptr.
+    const char* signature;
+};
+
+// The descriptors of a table and the storage for their resolved values.
+class JniConstantTable {
+  public:
+    constexpr JniConstantTable(const JniConstantDescriptor* descriptors,
+                               std::atomic<void*>* values, int size,
+                               std::atomic<uint32_t>* generation)
+        : mDescriptors(descriptors), mValues(values), mSize(size), mGeneration(generation) {}
+
+    int size() const {
+        return mSize;
+    }
+
+    const JniConstantDescriptor& descriptor(int index) const {
+        return mDescriptors[index];
+    }
+
+    // Returns the number of times the table has been cleared.
+    uint32_t generation() const {
+        return mGeneration->load(std::memory_order_acquire);
+    }
+
+    // Returns the value of entry |index| if it has been resolved, otherwise nullptr.
+    void* Peek(int index) const {
+        return mValues[index].load(std::memory_order_acquire);
+    }
+
+    jclass GetClass(JNIEnv* env, int index) const {
+        void* value = Peek(index);
+        return static_cast<jclass>(value != nullptr ? value : ResolveClass(env, index));
+    }
+
+    jfieldID GetField(JNIEnv* env, int index) const {
+        void* value = Peek(index);
+        return static_cast<jfieldID>(value != nullptr ? value : ResolveMember(env, index));
+    }
+
+    jmethodID GetMethod(JNIEnv* env, int index) const {
+        void* value = Peek(index);
+        return static_cast<jmethodID>(value != nullptr ? value : ResolveMember(env, index));
+    }
+
+    // Resolves entry |index| if it has not been already. Returns false, with an
+    // exception pending, if it cannot be resolved.
+    bool Resolve(JNIEnv* env, int index) const {
+        if (Peek(index) != nullptr) {
+            return true;
+        }
+        if (mDescriptors[index].kind == JniConstantKind::kClass) {
+            return ResolveClass(env, index) != nullptr;
+        }
+        return ResolveMember(env, index) != nullptr;
+    }
+
+    // Forgets every resolved value so that entries are looked up again on next
+    // use. Class references are deleted if |env| is not null; otherwise they
+    // are abandoned, as when the VM they belong to no longer exists.
+    void Clear(JNIEnv* env) const {
+        mGeneration->fetch_add(1, std::memory_order_acq_rel);
+        for (int i = 0; i < mSize; ++i) {
+            void* value = mValues[i].exchange(nullptr, std::memory_order_acq_rel);
+            if (env != nullptr && value != nullptr &&
+                mDescriptors[i].kind == JniConstantKind::kClass) {
+                env->DeleteGlobalRef(static_cast<jobject>(value));
+            }
+        }
+    }
+
+    bool operator==(const JniConstantTable& other) const {
+        return mValues == other.mValues;
+    }
+
+  private:
+    void* ResolveClass(JNIEnv* env, int index) const;
+
+    void* ResolveMember(JNIEnv* env, int index) const {
+        const JniConstantDescriptor& d = mDescriptors[index];
+        uint32_t startGeneration = generation();
+        jclass klass = GetClass(env, d.classIndex);
+        if (klass == nullptr) {
+            return nullptr;
+        }
+        void* value = nullptr;
+        switch (d.kind) {
+            case JniConstantKind::kField:
+                value = env->GetFieldID(klass, d.name, d.signature);
+                break;
+            case JniConstantKind::kStaticField:
+                value = env->GetStaticFieldID(klass, d.name, d.signature);
+                break;
+            case JniConstantKind::kMethod:
+                value = env->GetMethodID(klass, d.name, d.signature);
+                break;
+            case JniConstantKind::kStaticMethod:
+                value = env->GetStaticMethodID(klass, d.name, d.signature);
+                break;
+            case JniConstantKind::kClass:
+                break;
+        }
+        // Ids are plain values, so a racing thread storing the same id is harmless.
+        if (value != nullptr) {
+            mValues[index].store(value, std::memory_order_release);
+            Unpublish(index, value, startGeneration);
+        }
+        return value;
+    }
+
+    // Removes |value| from entry |index| again if the table was cleared after
+    // |startGeneration|, since it may have been resolved for the previous
+    // generation. Returns whether it was removed. A removed member id is still
+    // returned to the caller, as it is as valid as any other value in use
+    // while the table was cleared; a removed class reference is deleted.
+    bool Unpublish(int index, void* value, uint32_t startGeneration) const {
+        return generation() != startGeneration &&
+               mValues[index].compare_exchange_strong(value, nullptr, std::memory_order_acq_rel);
+    }
+
+    const JniConstantDescriptor* mDescriptors;
+    std::atomic<void*>* mValues;
+    int mSize;
+    std::atomic<uint32_t>* mGeneration;
+};
+
+// The tables of a shared library that have resolved classes. Each library has
+// its own registry, as each has its own copy of its tables.
+class JniConstantTableRegistry {
+  public:
+    // Adds |table| if it has not been added already.
+    static void Add(const JniConstantTable& table) {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (const JniConstantTable& added : registry.tables) {
+            if (added == table) {
+                return;
+            }
+        }
+        registry.tables.push_back(table);
+    }
+
+    // Clears every table added, as JniConstantTable::Clear(env) does.
+    static void ClearAll(JNIEnv* env) {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (const JniConstantTable& table : registry.tables) {
+            table.Clear(env);
+        }
+    }
+
+    // A hook for jniRegisterConstantsReleaseHook() that calls ClearAll().
+    static void ReleaseHook(C_JNIEnv* env, void* /* data */) {
+        ClearAll(reinterpret_cast<JNIEnv*>(env));
+    }
+
+  private:
+    struct Registry {
+        std::mutex mutex;
+        std::vector<JniConstantTable> tables;
+    };
+
+    static Registry& GetRegistry() {
+        // Never destroyed, so that tables can be cleared during exit.
+        static Registry* registry = new Registry();
+        return *registry;
+    }
+};
+
+inline void* JniConstantTable::ResolveClass(JNIEnv* env, int index) const {
+    for (;;) {
+        uint32_t startGeneration = generation();
+        ScopedLocalRef<jclass> localRef(env, env->FindClass(mDescriptors[index].name));
+        if (localRef.get() == nullptr) {
+            return nullptr;
+        }
+        void* globalRef = env->NewGlobalRef(localRef.get());
+        if (globalRef == nullptr) {
+            return nullptr;
+        }
+        // Publish the reference unless another thread got there first, in which
+        // case theirs is kept.
+        void* expected = nullptr;
+        if (!mValues[index].compare_exchange_strong(expected, globalRef,
+                                                    std::memory_order_acq_rel,
+                                                    std::memory_order_acquire)) {
+            env->DeleteGlobalRef(static_cast<jobject>(globalRef));
+            return expected;
+        }
+        JniConstantTableRegistry::Add(*this);
+        if (!Unpublish(index, globalRef, startGeneration)) {
+            return globalRef;
+        }
+        // The table was cleared while the class was looked up. Nothing else
+        // holds the reference now, so delete it and look the class up again.
+        env->DeleteGlobalRef(static_cast<jobject>(globalRef));
+    }
+}
+
+// Helpers for JNI_CONSTANTS_TABLE.
+
+#define JNI_CONSTANTS_TABLE_CLASS_INDEX_(name, className) k##name##Class,
+#define JNI_CONSTANTS_TABLE_FIELD_INDEX_(cls, name, memberName, signature) k##name##Field,
+#define JNI_CONSTANTS_TABLE_METHOD_INDEX_(cls, name, memberName, signature) k##name##Method,
+
+#define JNI_CONSTANTS_TABLE_CLASS_DESCRIPTOR_(name, className) \
+    { JniConstantKind::kClass, -1, className, nullptr },
+#define JNI_CONSTANTS_TABLE_MEMBER_DESCRIPTOR_(kind, cls, memberName, signature) \
+    { JniConstantKind::kind, k##cls##Class, memberName, signature },
+#define JNI_CONSTANTS_TABLE_FIELD_DESCRIPTOR_(cls, name, memberName, signature) \
+    JNI_CONSTANTS_TABLE_MEMBER_DESCRIPTOR_(kField, cls, memberName, signature)
+#define JNI_CONSTANTS_TABLE_STATIC_FIELD_DESCRIPTOR_(cls, name, memberName, signature) \
+    JNI_CONSTANTS_TABLE_MEMBER_DESCRIPTOR_(kStaticField, cls, memberName, signature)
+#define JNI_CONSTANTS_TABLE_METHOD_DESCRIPTOR_(cls, name, memberName, signature) \
+    JNI_CONSTANTS_TABLE_MEMBER_DESCRIPTOR_(kMethod, cls, memberName, signature)
+#define JNI_CONSTANTS_TABLE_STATIC_METHOD_DESCRIPTOR_(cls, name, memberName, signature) \
+    JNI_CONSTANTS_TABLE_MEMBER_DESCRIPTOR_(kStaticMethod, cls, memberName, signature)
+
+#define JNI_CONSTANTS_TABLE_CLASS_GETTER_(name, className) \
+    static jclass Get##name##Class(JNIEnv* env) { \
+        return GetTable().GetClass(env, k##name##Class); \
+    }
+#define JNI_CONSTANTS_TABLE_FIELD_GETTER_(cls, name, memberName, signature) \
+    static jfieldID Get##name##Field(JNIEnv* env) { \
+        return GetTable().GetField(env, k##name##Field); \
+    }
+#define JNI_CONSTANTS_TABLE_METHOD_GETTER_(cls, name, memberName, signature) \
+    static jmethodID Get##name##Method(JNIEnv* env) { \
+        return GetTable().GetMethod(env, k##name##Method); \
+    }
+
+// Declares the struct |TableName| holding the entries described by |LIST|. See
+// the comment at the top of this file.
+#define JNI_CONSTANTS_TABLE(TableName, LIST) \
+    struct TableName { \
+        enum Index : int { \
+            LIST(JNI_CONSTANTS_TABLE_CLASS_INDEX_, \
+                 JNI_CONSTANTS_TABLE_FIELD_INDEX_, \
+                 JNI_CONSTANTS_TABLE_FIELD_INDEX_, \
+                 JNI_CONSTANTS_TABLE_METHOD_INDEX_, \
+                 JNI_CONSTANTS_TABLE_METHOD_INDEX_) \
+            kCount \
+        }; \
+        \
+        static constexpr JniConstantDescriptor kDescriptors[] = { \
+            LIST(JNI_CONSTANTS_TABLE_CLASS_DESCRIPTOR_, \
+                 JNI_CONSTANTS_TABLE_FIELD_DESCRIPTOR_, \
+                 JNI_CONSTANTS_TABLE_STATIC_FIELD_DESCRIPTOR_, \
+                 JNI_CONSTANTS_TABLE_METHOD_DESCRIPTOR_, \
+                 JNI_CONSTANTS_TABLE_STATIC_METHOD_DESCRIPTOR_) \
+        }; \
+        \
+        static inline std::atomic<void*> sValues[kCount] = {}; \
+        static inline std::atomic<uint32_t> sGeneration{0}; \
+        \
+        static constexpr JniConstantTable GetTable() { \
+            return JniConstantTable(kDescriptors, sValues, kCount, &sGeneration); \
+        } \
+        \
+        LIST(JNI_CONSTANTS_TABLE_CLASS_GETTER_, \
+             JNI_CONSTANTS_TABLE_FIELD_GETTER_, \
+             JNI_CONSTANTS_TABLE_FIELD_GETTER_, \
+             JNI_CONSTANTS_TABLE_METHOD_GETTER_, \
+             JNI_CONSTANTS_TABLE_METHOD_GETTER_) \
+    }
+
+#endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_JNI_CONSTANTS_TABLE_H_
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_JNI_FIELD_COLUMNS_H_
+#define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_JNI_FIELD_COLUMNS_H_
+
+#include <stddef.h>
+
+#include "jni.h"
+#include "nativehelper_utils.h"
+
+/*
+ * Copies primitive fields between the objects of a Java array and native
+ * column arrays, one column per field:
+ *
+ *   jfloat x[count];
+ *   jfloat y[count];
+ *   const JniFieldColumn columns[] = {
+ *       JniFieldColumn(pointXField, x),
+ *       JniFieldColumn(pointYField, y),
+ *   };
+ *   if (!jniGetFieldColumns(env, points, 0, count, columns, 2)) {
+ *       return;  // Exception pending.
+ *   }
+ *
+ * Element i of each column holds the field of object start + i. The objects
+ * are fetched in chunks, each in its own local frame, and every column of a
+ * chunk is filled before moving to the next, so each object reference is
+ * fetched once however many fields are copied. The field ids must belong to
+ * the class of every object in the range.
+ */
+
+// The fields of the objects in a range are copied in chunks of this many
+// objects, each holding this many local references.
+#define JNI_FIELD_COLUMNS_CHUNK_SIZE 64
+
+// The types of field a column can hold: (C type, JNI function name infix).
+#define JNI_FIELD_COLUMN_TYPES(V) \
+    V(jboolean, Boolean) \
+    V(jbyte, Byte) \
+    V(jchar, Char) \
+    V(jshort, Short) \
+    V(jint, Int) \
+    V(jlong, Long) \
+    V(jfloat, Float) \
+    V(jdouble, Double)
+
+// A native array holding one primitive field of each object in a range. The
+// array is not owned by the column.
+class JniFieldColumn {
+public:
+    enum Type {
+#define JNI_FIELD_COLUMN_TYPE_ENUM_(type, name) k ## name,
+        JNI_FIELD_COLUMN_TYPES(JNI_FIELD_COLUMN_TYPE_ENUM_)
+#undef JNI_FIELD_COLUMN_TYPE_ENUM_
+    };
+
+#define JNI_FIELD_COLUMN_CONSTRUCTOR_(type, name) \
+    JniFieldColumn(jfieldID field, type* data) : mField(field), mType(k ## name), mData(data) {}
+    JNI_FIELD_COLUMN_TYPES(JNI_FIELD_COLUMN_CONSTRUCTOR_)
+#undef JNI_FIELD_COLUMN_CONSTRUCTOR_
+
+    jfieldID field() const { return mField; }
+    Type type() const { return mType; }
+    void* data() const { return mData; }
+
+private:
+    jfieldID mField;
+    Type mType;
+    void* mData;
+};
+
+namespace nativehelper {
+namespace detail {
+
+// Fetches objects[start, start + count) into |objects|. Returns false, with an
+// exception pending, if any of them is null.
+static inline bool GetFieldColumnsChunk(JNIEnv* env, jobjectArray array, jsize start, jsize count,
+                                        jobject* objects) {
+    for (jsize i = 0; i < count; ++i) {
+        objects[i] = env->GetObjectArrayElement(array, start + i);
+        if (objects[i] == NULL) {
+            jniThrowNullPointerException(env);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns false, with an exception pending, if [start, start + count) is not a
+// range of |array|.
+static inline bool CheckFieldColumnsRange(JNIEnv* env, jobjectArray array, jsize start,
+                                          jsize count) {
+    if (array == NULL) {
+        jniThrowNullPointerException(env);
+        return false;
+    }
+    jsize length = env->GetArrayLength(array);
+    if (start < 0 || count < 0 || start > length || count > length - start) {
+        jniThrowArrayIndexOutOfBoundsException(env, length, start, count);
+        return false;
+    }
+    return true;
+}
+
+// Copies the objects of |array| to or from |columns|, for jniGetFieldColumns
+// and jniSetFieldColumns.
+template <bool kGet>
+static inline bool CopyFieldColumns(JNIEnv* env, jobjectArray array, jsize start, jsize count,
+                                    const JniFieldColumn* columns, size_t columnCount) {
+    if (!CheckFieldColumnsRange(env, array, start, count)) {
+        return false;
+    }
+    jobject objects[JNI_FIELD_COLUMNS_CHUNK_SIZE];
+    for (jsize done = 0; done < count; done += JNI_FIELD_COLUMNS_CHUNK_SIZE) {
+        jsize chunk = count - done < JNI_FIELD_COLUMNS_CHUNK_SIZE
+                ? count - done : JNI_FIELD_COLUMNS_CHUNK_SIZE;
+        if (env->PushLocalFrame(chunk) != JNI_OK) {
+            return false;
+        }
+        if (!GetFieldColumnsChunk(env, array, start + done, chunk, objects)) {
+            env->PopLocalFrame(NULL);
+            return false;
+        }
+        for (size_t c = 0; c < columnCount; ++c) {
+            jfieldID field = columns[c].field();
+            switch (columns[c].type()) {
+#define JNI_FIELD_COLUMN_COPY_(type, name) \
+                case JniFieldColumn::k ## name: { \
+                    type* data = static_cast<type*>(columns[c].data()) + done; \
+                    for (jsize i = 0; i < chunk; ++i) { \
+                        if (kGet) { \
+                            data[i] = env->Get ## name ## Field(objects[i], field); \
+                        } else { \
+                            env->Set ## name ## Field(objects[i], field, data[i]); \
+                        } \
+                    } \
+                    break; \
+                }
+                JNI_FIELD_COLUMN_TYPES(JNI_FIELD_COLUMN_COPY_)
+#undef JNI_FIELD_COLUMN_COPY_
+            }
+        }
+        env->PopLocalFrame(NULL);
+    }
+    return true;
+}
+
+}  // namespace detail
+}  // namespace nativehelper
+
+// Copies the fields of objects[start, start + count) of |array| to |columns|.
+// Returns false, with an exception pending, if |array| is null, the range is
+// out of bounds, or any object in it is null, in which case the columns may
+// have been partly written.
+static inline bool jniGetFieldColumns(JNIEnv* env, jobjectArray array, jsize start, jsize count,
+                                      const JniFieldColumn* columns, size_t columnCount) {
+    return nativehelper::detail::CopyFieldColumns<true>(env, array, start, count, columns,
+                                                        columnCount);
+}
+
+// Copies |columns| to the fields of objects[start, start + count) of |array|.
+// Fails as jniGetFieldColumns does, in which case some objects may have been
+// written.
+static inline bool jniSetFieldColumns(JNIEnv* env, jobjectArray array, jsize start, jsize count,
+                                      const JniFieldColumn* columns, size_t columnCount) {
+    return nativehelper::detail::CopyFieldColumns<false>(env, array, start, count, columns,
+                                                         columnCount);
+}
+
+#undef JNI_FIELD_COLUMN_TYPES
+
+#endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_JNI_FIELD_COLUMNS_H_
@@ -19,6 +19,8 @@
 
 #if defined(__cplusplus)
 
+#include <stdio.h>
+
 #if !defined(DISALLOW_COPY_AND_ASSIGN)
 // DISALLOW_COPY_AND_ASSIGN disallows the copy and operator= functions. It goes in the private:
 // declarations in a class.
@@ -48,6 +50,27 @@ static inline int jniThrowNullPointerException(JNIEnv* env) {
     return 0;
 }
 
+// Throws ArrayIndexOutOfBoundsException for a region [start, start + count) of
+// an array of |length| elements, with the message the runtime uses.
+static inline int jniThrowArrayIndexOutOfBoundsException(JNIEnv* env, jsize length, jsize start,
+                                                         jsize count) {
+    jclass e_class = env->FindClass("java/lang/ArrayIndexOutOfBoundsException");
+    if (e_class == nullptr) {
+        return -1;
+    }
+
+    char message[96];
+    snprintf(message, sizeof(message), "length=%d; regionStart=%d; regionLength=%d",
+             length, start, count);
+    if (env->ThrowNew(e_class, message) != JNI_OK) {
+        env->DeleteLocalRef(e_class);
+        return -1;
+    }
+
+    env->DeleteLocalRef(e_class);
+    return 0;
+}
+
 #endif  // defined(__cplusplus)
 
 #endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_NATIVEHELPER_UTILS_H_
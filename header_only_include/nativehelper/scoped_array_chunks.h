@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_ARRAY_CHUNKS_H_
+#define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_ARRAY_CHUNKS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "jni.h"
+#include "nativehelper_utils.h"
+#include "scoped_primitive_array.h"
+
+namespace nativehelper {
+namespace detail {
+
+// The default window of the chunk readers and writers: 64 KiB, which is large
+// enough for each GetXxxArrayRegion call to run at copying speed.
+template <typename T>
+struct DefaultChunkCapacity {
+    static const size_t value = 65536 / sizeof(T);
+};
+
+// A heap buffer of |capacity| elements aligned to 64 bytes.
+template <typename T>
+class AlignedBuffer {
+public:
+    explicit AlignedBuffer(size_t capacity)
+    : mStorage(new unsigned char[capacity * sizeof(T) + kAlignment - 1]) {
+        uintptr_t address = reinterpret_cast<uintptr_t>(mStorage.get());
+        mData = reinterpret_cast<T*>((address + kAlignment - 1) & ~(kAlignment - 1));
+    }
+
+    T* get() const { return mData; }
+
+private:
+    static const uintptr_t kAlignment = 64;
+
+    std::unique_ptr<unsigned char[]> mStorage;
+    T* mData;
+};
+
+// The state shared by ScopedArrayChunkReader and ScopedArrayChunkWriter: the
+// array, the current window and the buffer holding it.
+template <typename T, size_t ChunkCapacity>
+class ArrayChunks {
+    static_assert(ChunkCapacity > 0, "chunks must hold at least one element");
+
+public:
+    typedef PrimitiveArrayTraits<T> Traits;
+    typedef typename Traits::ArrayType ArrayType;
+
+    // Offset in the array of the current window.
+    size_t offset() const { return mOffset; }
+    // Number of elements in the current window.
+    size_t size() const { return mSize; }
+    // Length of the whole array.
+    size_t arrayLength() const { return mLength; }
+
+protected:
+    ArrayChunks(JNIEnv* env, ArrayType javaArray)
+    : mEnv(env), mJavaArray(javaArray), mLength(0), mOffset(0), mSize(0), mStarted(false) {
+        if (mJavaArray == NULL) {
+            jniThrowNullPointerException(mEnv);
+            return;
+        }
+        mLength = mEnv->GetArrayLength(mJavaArray);
+        size_t capacity = mLength < ChunkCapacity ? mLength : ChunkCapacity;
+        if (capacity > 0) {
+            mBuffer.reset(new AlignedBuffer<T>(capacity));
+        }
+    }
+
+    // Moves to the next window. Returns false at the end of the array.
+    bool advance() {
+        if (mStarted) {
+            mOffset += mSize;
+        }
+        mStarted = true;
+        size_t remaining = mLength - mOffset;
+        mSize = remaining < ChunkCapacity ? remaining : ChunkCapacity;
+        return mSize > 0;
+    }
+
+    T* buffer() const { return mBuffer.get() != NULL ? mBuffer->get() : NULL; }
+
+    JNIEnv* const mEnv;
+    const ArrayType mJavaArray;
+    size_t mLength;
+    size_t mOffset;
+    size_t mSize;
+    bool mStarted;
+
+private:
+    std::unique_ptr<AlignedBuffer<T> > mBuffer;
+};
+
+}  // namespace detail
+}  // namespace nativehelper
+
+// ScopedArrayChunkReader reads a Java array of any size in windows of up to
+// ChunkCapacity elements, copied with GetXxxArrayRegion into one buffer that is
+// reused for every window. Unlike ScopedXxxArrayRO, it never asks the runtime
+// for the whole array, so the memory used stays bounded however large the
+// array is:
+//
+//   ScopedFloatArrayChunkReader reader(env, samples);
+//   while (reader.next()) {
+//       process(reader.get(), reader.size());
+//   }
+//
+// The buffer is aligned to 64 bytes, and holds min(array length,
+// ChunkCapacity) elements. If the array is null, a NullPointerException is
+// thrown and next() returns false.
+template <typename T,
+          size_t ChunkCapacity = nativehelper::detail::DefaultChunkCapacity<T>::value>
+class ScopedArrayChunkReader : public nativehelper::detail::ArrayChunks<T, ChunkCapacity> {
+    typedef nativehelper::detail::ArrayChunks<T, ChunkCapacity> Base;
+
+public:
+    ScopedArrayChunkReader(JNIEnv* env, typename Base::ArrayType javaArray)
+    : Base(env, javaArray) {}
+
+    // Reads the next window. Returns false at the end of the array.
+    bool next() {
+        if (!this->advance()) {
+            return false;
+        }
+        Base::Traits::GetRegion(this->mEnv, this->mJavaArray, static_cast<jsize>(this->mOffset),
+                                static_cast<jsize>(this->mSize), this->buffer());
+        return true;
+    }
+
+    const T* get() const { return this->buffer(); }
+    const T& operator[](size_t n) const { return this->buffer()[n]; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedArrayChunkReader);
+};
+
+// ScopedArrayChunkWriter writes a Java array of any size in windows of up to
+// ChunkCapacity elements, filled in one reused buffer and copied to the array
+// with SetXxxArrayRegion when the next window is started, on flush(), or when
+// the object is destroyed:
+//
+//   ScopedFloatArrayChunkWriter writer(env, samples);
+//   while (writer.next()) {
+//       generate(writer.get(), writer.offset(), writer.size());
+//   }
+//
+// Every element of each window must be written, as the whole window is copied
+// to the array. A window is not copied if an exception is pending, as JNI
+// functions other than those for handling exceptions may not be called then;
+// an exception thrown while filling a window drops it, and the windows after.
+template <typename T,
+          size_t ChunkCapacity = nativehelper::detail::DefaultChunkCapacity<T>::value>
+class ScopedArrayChunkWriter : public nativehelper::detail::ArrayChunks<T, ChunkCapacity> {
+    typedef nativehelper::detail::ArrayChunks<T, ChunkCapacity> Base;
+
+public:
+    ScopedArrayChunkWriter(JNIEnv* env, typename Base::ArrayType javaArray)
+    : Base(env, javaArray), mPending(false) {}
+
+    ~ScopedArrayChunkWriter() {
+        flush();
+    }
+
+    // Writes the current window, if any, and starts the next. Returns false at
+    // the end of the array.
+    bool next() {
+        flush();
+        mPending = this->advance();
+        return mPending;
+    }
+
+    // Writes the current window to the array now, unless an exception is
+    // pending.
+    void flush() {
+        if (mPending) {
+            if (!this->mEnv->ExceptionCheck()) {
+                Base::Traits::SetRegion(this->mEnv, this->mJavaArray,
+                                        static_cast<jsize>(this->mOffset),
+                                        static_cast<jsize>(this->mSize), this->buffer());
+            }
+            mPending = false;
+        }
+    }
+
+    T* get() { return this->buffer(); }
+    T& operator[](size_t n) { return this->buffer()[n]; }
+
+private:
+    bool mPending;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedArrayChunkWriter);
+};
+
+// ScopedArrayLazyRO provides read-only random access to a Java array without
+// copying it up front. Elements are fetched with GetXxxArrayRegion in blocks of
+// BlockSize elements the first time an element of the block is read, and up to
+// CachedBlocks blocks are kept, so sparse reads of a large array, such as a
+// binary search, copy only the blocks they touch:
+//
+//   ScopedIntArrayLazyRO table(env, javaTable);
+//   size_t low = 0, high = table.size();
+//   while (low < high) {
+//       size_t mid = low + (high - low) / 2;
+//       if (table[mid] < key) low = mid + 1; else high = mid;
+//   }
+//
+// Each block is cached in the slot given by its index modulo CachedBlocks, and
+// replaces the block held there. Elements are returned by value, as the block
+// holding them may be replaced by a later read. If the array is null, a
+// NullPointerException is thrown and the object is empty.
+template <typename T, size_t BlockSize = 256, size_t CachedBlocks = 16>
+class ScopedArrayLazyRO {
+    static_assert(BlockSize > 0 && CachedBlocks > 0, "the cache must hold at least one element");
+
+public:
+    typedef nativehelper::detail::PrimitiveArrayTraits<T> Traits;
+    typedef typename Traits::ArrayType ArrayType;
+
+    ScopedArrayLazyRO(JNIEnv* env, ArrayType javaArray)
+    : mEnv(env), mJavaArray(javaArray), mLength(0), mSlotCount(0) {
+        if (mJavaArray == NULL) {
+            jniThrowNullPointerException(mEnv);
+            return;
+        }
+        mLength = mEnv->GetArrayLength(mJavaArray);
+        size_t blockCount = (mLength + BlockSize - 1) / BlockSize;
+        mSlotCount = blockCount < CachedBlocks ? blockCount : CachedBlocks;
+        for (size_t i = 0; i < mSlotCount; ++i) {
+            mBlocks[i] = kNoBlock;
+        }
+    }
+
+    // Returns element |n|, which must be less than size().
+    T operator[](size_t n) const {
+        size_t block = n / BlockSize;
+        size_t slot = block % mSlotCount;
+        if (mBlocks[slot] != block) {
+            load(slot, block);
+        }
+        return mCache->get()[slot * BlockSize + n % BlockSize];
+    }
+
+    ArrayType getJavaArray() const { return mJavaArray; }
+    size_t size() const { return mLength; }
+
+private:
+    static const size_t kNoBlock = static_cast<size_t>(-1);
+
+    void load(size_t slot, size_t block) const {
+        if (mCache.get() == NULL) {
+            mCache.reset(new nativehelper::detail::AlignedBuffer<T>(mSlotCount * BlockSize));
+        }
+        size_t start = block * BlockSize;
+        size_t length = mLength - start < BlockSize ? mLength - start : BlockSize;
+        Traits::GetRegion(mEnv, mJavaArray, static_cast<jsize>(start),
+                          static_cast<jsize>(length), mCache->get() + slot * BlockSize);
+        mBlocks[slot] = block;
+    }
+
+    JNIEnv* const mEnv;
+    const ArrayType mJavaArray;
+    size_t mLength;
+    size_t mSlotCount;
+    mutable size_t mBlocks[CachedBlocks];
+    mutable std::unique_ptr<nativehelper::detail::AlignedBuffer<T> > mCache;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedArrayLazyRO);
+};
+
+#define INSTANTIATE_SCOPED_ARRAY_CHUNKS(PRIMITIVE_TYPE, NAME) \
+    typedef ScopedArrayChunkReader<PRIMITIVE_TYPE> Scoped ## NAME ## ArrayChunkReader; \
+    typedef ScopedArrayChunkWriter<PRIMITIVE_TYPE> Scoped ## NAME ## ArrayChunkWriter; \
+    typedef ScopedArrayLazyRO<PRIMITIVE_TYPE> Scoped ## NAME ## ArrayLazyRO
+
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jboolean, Boolean);
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jbyte, Byte);
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jchar, Char);
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jdouble, Double);
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jfloat, Float);
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jint, Int);
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jlong, Long);
+INSTANTIATE_SCOPED_ARRAY_CHUNKS(jshort, Short);
+
+#undef INSTANTIATE_SCOPED_ARRAY_CHUNKS
+
+#endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_ARRAY_CHUNKS_H_
@@ -17,6 +17,9 @@
 #ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_BYTES_H_
 #define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_BYTES_H_
 
+#include <stdint.h>
+
+#include "array_access_policy.h"
 #include "jni.h"
 #include "nativehelper_utils.h"
 
@@ -25,6 +28,8 @@
  * ByteBuffers. This in turn helps paper over the differences between non-direct ByteBuffers backed
  * by byte[]s, direct ByteBuffers backed by bytes[]s, and direct ByteBuffers not backed by byte[]s.
  * (On Android, this last group only contains MappedByteBuffers.)
+ *
+ * Whether the runtime copies byte[]s is recorded in nativehelper::ArrayAccessPolicy<jbyte>.
  */
 template<bool readOnly>
 class ScopedBytes {
@@ -38,7 +43,12 @@ public:
             jclass byteArrayClass = env->FindClass("[B");
             if (mEnv->IsInstanceOf(mObject, byteArrayClass)) {
                 mByteArray = reinterpret_cast<jbyteArray>(mObject);
-                mPtr = mEnv->GetByteArrayElements(mByteArray, NULL);
+                jboolean isCopy;
+                uint64_t start = nativehelper::ArrayAccessPolicy<jbyte>::StartSample();
+                mPtr = mEnv->GetByteArrayElements(mByteArray, &isCopy);
+                if (mPtr != NULL) {
+                    nativehelper::ArrayAccessPolicy<jbyte>::RecordElements(isCopy, start);
+                }
             } else {
                 mPtr = reinterpret_cast<jbyte*>(mEnv->GetDirectBufferAddress(mObject));
             }
@@ -17,8 +17,16 @@
 #ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_PRIMITIVE_ARRAY_H_
 #define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_PRIMITIVE_ARRAY_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <type_traits>
+
+#include "array_access_policy.h"
 #include "jni.h"
 #include "nativehelper_utils.h"
+#include "thread_buffer_pool.h"
 
 #ifdef POINTER_TYPE
 #error POINTER_TYPE is defined.
@@ -32,65 +40,173 @@
 #define REFERENCE_TYPE(T) T&  /* NOLINT */
 #endif
 
-// ScopedBooleanArrayRO, ScopedByteArrayRO, ScopedCharArrayRO, ScopedDoubleArrayRO,
-// ScopedFloatArrayRO, ScopedIntArrayRO, ScopedLongArrayRO, and ScopedShortArrayRO provide
-// convenient read-only access to Java arrays from JNI code. This is cheaper than read-write
-// access and should be used by default.
-#define INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(PRIMITIVE_TYPE, NAME) \
-    class Scoped ## NAME ## ArrayRO { \
-    public: \
-        explicit Scoped ## NAME ## ArrayRO(JNIEnv* env) \
-        : mEnv(env), mJavaArray(NULL), mRawArray(NULL), mSize(0) {} \
-        Scoped ## NAME ## ArrayRO(JNIEnv* env, PRIMITIVE_TYPE ## Array javaArray) \
-        : mEnv(env) { \
-            if (javaArray == NULL) { \
-                mJavaArray = NULL; \
-                mSize = 0; \
-                mRawArray = NULL; \
-                jniThrowNullPointerException(mEnv); \
-            } else { \
-                reset(javaArray); \
-            } \
+namespace nativehelper {
+namespace detail {
+
+// The Java array type holding elements of type T, and the JNI functions that
+// access its elements.
+template <typename T>
+struct PrimitiveArrayTraits;
+
+#define DEFINE_PRIMITIVE_ARRAY_TRAITS(PRIMITIVE_TYPE, NAME) \
+    template <> \
+    struct PrimitiveArrayTraits<PRIMITIVE_TYPE> { \
+        typedef PRIMITIVE_TYPE ## Array ArrayType; \
+        static PRIMITIVE_TYPE* GetElements(JNIEnv* env, ArrayType array, jboolean* isCopy) { \
+            return env->Get ## NAME ## ArrayElements(array, isCopy); \
         } \
-        ~Scoped ## NAME ## ArrayRO() { \
-            if (mRawArray != NULL && mRawArray != mBuffer) { \
-                mEnv->Release ## NAME ## ArrayElements(mJavaArray, mRawArray, JNI_ABORT); \
-            } \
+        static void ReleaseElements(JNIEnv* env, ArrayType array, PRIMITIVE_TYPE* elements, \
+                                    jint mode) { \
+            env->Release ## NAME ## ArrayElements(array, elements, mode); \
         } \
-        void reset(PRIMITIVE_TYPE ## Array javaArray) { \
-            mJavaArray = javaArray; \
-            mSize = mEnv->GetArrayLength(mJavaArray); \
-            if (mSize <= buffer_size) { \
-                mEnv->Get ## NAME ## ArrayRegion(mJavaArray, 0, mSize, mBuffer); \
-                mRawArray = mBuffer; \
-            } else { \
-                mRawArray = mEnv->Get ## NAME ## ArrayElements(mJavaArray, NULL); \
-            } \
+        static void GetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, \
+                              PRIMITIVE_TYPE* buffer) { \
+            env->Get ## NAME ## ArrayRegion(array, start, length, buffer); \
         } \
-        const PRIMITIVE_TYPE* get() const { return mRawArray; } \
-        PRIMITIVE_TYPE ## Array getJavaArray() const { return mJavaArray; } \
-        const PRIMITIVE_TYPE& operator[](size_t n) const { return mRawArray[n]; } \
-        size_t size() const { return mSize; } \
-    private: \
-        static const jsize buffer_size = 1024; \
-        JNIEnv* const mEnv; \
-        PRIMITIVE_TYPE ## Array mJavaArray; \
-        POINTER_TYPE(PRIMITIVE_TYPE) mRawArray; \
-        jsize mSize; \
-        PRIMITIVE_TYPE mBuffer[buffer_size]; \
-        DISALLOW_COPY_AND_ASSIGN(Scoped ## NAME ## ArrayRO); \
+        static void SetRegion(JNIEnv* env, ArrayType array, jsize start, jsize length, \
+                              const PRIMITIVE_TYPE* buffer) { \
+            env->Set ## NAME ## ArrayRegion(array, start, length, buffer); \
+        } \
+    }
+
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jboolean, Boolean);
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jbyte, Byte);
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jchar, Char);
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jdouble, Double);
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jfloat, Float);
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jint, Int);
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jlong, Long);
+DEFINE_PRIMITIVE_ARRAY_TRAITS(jshort, Short);
+
+#undef DEFINE_PRIMITIVE_ARRAY_TRAITS
+
+// Calls GetXxxArrayElements and records the call in ArrayAccessPolicy<T>.
+template <typename T>
+T* GetRecordedElements(JNIEnv* env, typename PrimitiveArrayTraits<T>::ArrayType array,
+                       jboolean* isCopy) {
+    uint64_t start = ArrayAccessPolicy<T>::StartSample();
+    T* elements = PrimitiveArrayTraits<T>::GetElements(env, array, isCopy);
+    if (elements != NULL) {
+        ArrayAccessPolicy<T>::RecordElements(*isCopy, start);
+    }
+    return elements;
+}
+
+// Calls GetXxxArrayRegion and records the call in ArrayAccessPolicy<T>.
+template <typename T>
+void GetRecordedRegion(JNIEnv* env, typename PrimitiveArrayTraits<T>::ArrayType array,
+                       jsize length, T* buffer) {
+    uint64_t start = ArrayAccessPolicy<T>::StartSample();
+    PrimitiveArrayTraits<T>::GetRegion(env, array, 0, length, buffer);
+    ArrayAccessPolicy<T>::RecordRegion(length, start);
+}
+
+// The default inline capacity of ScopedArrayRO: 1024 elements, but no more than
+// 4 KiB.
+template <typename T>
+struct DefaultInlineCapacity {
+    static const size_t value = sizeof(T) * 1024 <= 4096 ? 1024 : 4096 / sizeof(T);
+};
+
+}  // namespace detail
+}  // namespace nativehelper
+
+// ScopedArrayRO provides convenient read-only access to Java arrays from JNI
+// code. This is cheaper than read-write access and should be used by default.
+//
+// Arrays that nativehelper::ArrayAccessPolicy finds cheaper to copy than to pin
+// are copied into a buffer held in the object, aligned to 64 bytes for vector
+// loads, if they have up to InlineCapacity elements, or into a buffer from the
+// ThreadBufferPool if the thread has enabled it. Other arrays are accessed
+// through GetXxxArrayElements. The default capacity of 1024 elements, at most
+// 4 KiB, suits most callers; a smaller one saves stack in deeply nested code,
+// and a larger one avoids GetXxxArrayElements for bigger arrays on runtimes
+// where it copies.
+//
+// ScopedBooleanArrayRO, ScopedByteArrayRO, ScopedCharArrayRO,
+// ScopedDoubleArrayRO, ScopedFloatArrayRO, ScopedIntArrayRO, ScopedLongArrayRO
+// and ScopedShortArrayRO use the default capacity.
+template <typename T,
+          size_t InlineCapacity = nativehelper::detail::DefaultInlineCapacity<T>::value>
+class ScopedArrayRO {
+public:
+    typedef nativehelper::detail::PrimitiveArrayTraits<T> Traits;
+    typedef typename Traits::ArrayType ArrayType;
+
+    explicit ScopedArrayRO(JNIEnv* env)
+    : mEnv(env), mJavaArray(NULL), mRawArray(NULL), mSize(0), mPooled(false) {}
+
+    ScopedArrayRO(JNIEnv* env, ArrayType javaArray)
+    : mEnv(env), mRawArray(NULL), mPooled(false) {
+        if (javaArray == NULL) {
+            mJavaArray = NULL;
+            mSize = 0;
+            jniThrowNullPointerException(mEnv);
+        } else {
+            reset(javaArray);
+        }
+    }
+
+    ~ScopedArrayRO() {
+        release();
+    }
+
+    void reset(ArrayType javaArray) {
+        release();
+        mJavaArray = javaArray;
+        mSize = mEnv->GetArrayLength(mJavaArray);
+        if (nativehelper::ArrayAccessPolicy<T>::Choose(mSize, false) ==
+                nativehelper::ArrayAccess::kRegion) {
+            nativehelper::ThreadBufferPool* pool = nativehelper::ThreadBufferPool::Current();
+            if (static_cast<size_t>(mSize) <= InlineCapacity) {
+                mRawArray = mBuffer;
+            } else if (pool != NULL) {
+                mRawArray = static_cast<T*>(pool->Acquire(mSize * sizeof(T)));
+                mPooled = mRawArray != NULL;
+            }
+            if (mRawArray != NULL) {
+                nativehelper::detail::GetRecordedRegion<T>(mEnv, mJavaArray, mSize, mRawArray);
+                return;
+            }
+        }
+        jboolean isCopy;
+        mRawArray = nativehelper::detail::GetRecordedElements<T>(mEnv, mJavaArray, &isCopy);
+    }
+
+    const T* get() const { return mRawArray; }
+    ArrayType getJavaArray() const { return mJavaArray; }
+    const T& operator[](size_t n) const { return mRawArray[n]; }
+    size_t size() const { return mSize; }
+
+private:
+    void release() {
+        if (mPooled) {
+            nativehelper::ThreadBufferPool::Release(mRawArray, mSize * sizeof(T));
+            mPooled = false;
+        } else if (mRawArray != NULL && mRawArray != mBuffer) {
+            Traits::ReleaseElements(mEnv, mJavaArray, mRawArray, JNI_ABORT);
+        }
+        mRawArray = NULL;
     }
 
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jboolean, Boolean);
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jbyte, Byte);
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jchar, Char);
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jdouble, Double);
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jfloat, Float);
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jint, Int);
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jlong, Long);
-INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jshort, Short);
+    JNIEnv* const mEnv;
+    ArrayType mJavaArray;
+    T* mRawArray;
+    jsize mSize;
+    bool mPooled;
+    alignas(64) T mBuffer[InlineCapacity > 0 ? InlineCapacity : 1];
 
-#undef INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO
+    DISALLOW_COPY_AND_ASSIGN(ScopedArrayRO);
+};
+
+typedef ScopedArrayRO<jboolean> ScopedBooleanArrayRO;
+typedef ScopedArrayRO<jbyte> ScopedByteArrayRO;
+typedef ScopedArrayRO<jchar> ScopedCharArrayRO;
+typedef ScopedArrayRO<jdouble> ScopedDoubleArrayRO;
+typedef ScopedArrayRO<jfloat> ScopedFloatArrayRO;
+typedef ScopedArrayRO<jint> ScopedIntArrayRO;
+typedef ScopedArrayRO<jlong> ScopedLongArrayRO;
+typedef ScopedArrayRO<jshort> ScopedShortArrayRO;
 
 // ScopedBooleanArrayRW, ScopedByteArrayRW, ScopedCharArrayRW, ScopedDoubleArrayRW,
 // ScopedFloatArrayRW, ScopedIntArrayRW, ScopedLongArrayRW, and ScopedShortArrayRW provide
@@ -106,7 +222,7 @@ INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jshort, Short);
             if (mJavaArray == NULL) { \
                 jniThrowNullPointerException(mEnv); \
             } else { \
-                mRawArray = mEnv->Get ## NAME ## ArrayElements(mJavaArray, NULL); \
+                reset(mJavaArray); \
             } \
         } \
         ~Scoped ## NAME ## ArrayRW() { \
@@ -115,8 +231,10 @@ INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RO(jshort, Short);
             } \
         } \
         void reset(PRIMITIVE_TYPE ## Array javaArray) { \
+            jboolean isCopy; \
             mJavaArray = javaArray; \
-            mRawArray = mEnv->Get ## NAME ## ArrayElements(mJavaArray, NULL); \
+            mRawArray = nativehelper::detail::GetRecordedElements<PRIMITIVE_TYPE>( \
+                    mEnv, mJavaArray, &isCopy); \
         } \
         const PRIMITIVE_TYPE* get() const { return mRawArray; } \
         PRIMITIVE_TYPE ## Array getJavaArray() const { return mJavaArray; } \
@@ -141,6 +259,378 @@ INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RW(jlong, Long);
 INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RW(jshort, Short);
 
 #undef INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_RW
+
+// ScopedArrayDirtyRW provides read-write access to a Java array like
+// ScopedXxxArrayRW, but writes back only the ranges marked as written with
+// markDirty() (or written through set()), instead of the whole array. Use it
+// when small parts of large arrays are updated.
+//
+// If the runtime handed out a copy of the array, each dirty range is written
+// back with SetXxxArrayRegion when the object is destroyed or commit() is
+// called, and the copy is released with JNI_ABORT. Writes that were not marked
+// dirty may then be lost, so mark every range written. JNI functions other than
+// those for handling exceptions may not be called with an exception pending, so
+// if one is pending the dirty ranges are dropped rather than written back.
+//
+// Up to MaxRanges disjoint ranges are tracked. Overlapping and adjacent ranges
+// are merged, and when there would be more the two closest are merged, which
+// may write back elements between them that did not change.
+template <typename T, size_t MaxRanges = 8>
+class ScopedArrayDirtyRW {
+    static_assert(MaxRanges > 0, "at least one range must be tracked");
+
+public:
+    typedef nativehelper::detail::PrimitiveArrayTraits<T> Traits;
+    typedef typename Traits::ArrayType ArrayType;
+
+    ScopedArrayDirtyRW(JNIEnv* env, ArrayType javaArray)
+    : mEnv(env), mJavaArray(javaArray), mRawArray(NULL), mSize(0), mIsCopy(JNI_FALSE),
+      mRangeCount(0) {
+        if (mJavaArray == NULL) {
+            jniThrowNullPointerException(mEnv);
+        } else {
+            mSize = mEnv->GetArrayLength(mJavaArray);
+            mRawArray = nativehelper::detail::GetRecordedElements<T>(mEnv, mJavaArray, &mIsCopy);
+        }
+    }
+
+    ~ScopedArrayDirtyRW() {
+        if (mRawArray != NULL) {
+            commit();
+            Traits::ReleaseElements(mEnv, mJavaArray, mRawArray, JNI_ABORT);
+        }
+    }
+
+    // Marks elements [start, start + length) as written. The range must be
+    // within the array.
+    void markDirty(size_t start, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        Range range = { start, start + length };
+        // Merge every tracked range that overlaps or touches the new one.
+        size_t kept = 0;
+        for (size_t i = 0; i < mRangeCount; ++i) {
+            if (mRanges[i].end < range.start || range.end < mRanges[i].start) {
+                mRanges[kept++] = mRanges[i];
+            } else {
+                range.start = mRanges[i].start < range.start ? mRanges[i].start : range.start;
+                range.end = mRanges[i].end > range.end ? mRanges[i].end : range.end;
+            }
+        }
+        mRangeCount = kept;
+        if (mRangeCount == MaxRanges) {
+            mergeClosestRanges(&range);
+        }
+        // Keep the ranges ordered by start.
+        size_t i = mRangeCount;
+        while (i > 0 && mRanges[i - 1].start > range.start) {
+            mRanges[i] = mRanges[i - 1];
+            --i;
+        }
+        mRanges[i] = range;
+        ++mRangeCount;
+    }
+
+    void set(size_t n, T value) {
+        mRawArray[n] = value;
+        markDirty(n, 1);
+    }
+
+    // Writes back the dirty ranges now, and forgets them. Nothing is written
+    // back if an exception is pending.
+    void commit() {
+        if (mIsCopy && mRangeCount != 0 && !mEnv->ExceptionCheck()) {
+            for (size_t i = 0; i < mRangeCount; ++i) {
+                Traits::SetRegion(mEnv, mJavaArray, static_cast<jsize>(mRanges[i].start),
+                                  static_cast<jsize>(mRanges[i].end - mRanges[i].start),
+                                  mRawArray + mRanges[i].start);
+            }
+        }
+        mRangeCount = 0;
+    }
+
+    size_t dirtyRangeCount() const { return mRangeCount; }
+    const T* get() const { return mRawArray; }
+    T* get() { return mRawArray; }
+    ArrayType getJavaArray() const { return mJavaArray; }
+    const T& operator[](size_t n) const { return mRawArray[n]; }
+    size_t size() const { return mSize; }
+
+private:
+    struct Range {
+        size_t start;
+        size_t end;
+    };
+
+    // Makes room for |range| by merging the two closest of the tracked ranges
+    // and |range|.
+    void mergeClosestRanges(Range* range) {
+        // Find the tracked range nearest to |range|, and the closest pair of
+        // neighbouring tracked ranges.
+        size_t nearest = 0;
+        size_t nearestGap = static_cast<size_t>(-1);
+        for (size_t i = 0; i < mRangeCount; ++i) {
+            size_t gap = mRanges[i].end < range->start ? range->start - mRanges[i].end
+                                                       : mRanges[i].start - range->end;
+            if (gap < nearestGap) {
+                nearest = i;
+                nearestGap = gap;
+            }
+        }
+        size_t pair = 0;
+        size_t pairGap = static_cast<size_t>(-1);
+        for (size_t i = 0; i + 1 < mRangeCount; ++i) {
+            size_t gap = mRanges[i + 1].start - mRanges[i].end;
+            if (gap < pairGap) {
+                pair = i;
+                pairGap = gap;
+            }
+        }
+        if (nearestGap <= pairGap) {
+            range->start = mRanges[nearest].start < range->start ? mRanges[nearest].start
+                                                                 : range->start;
+            range->end = mRanges[nearest].end > range->end ? mRanges[nearest].end : range->end;
+            removeRange(nearest);
+        } else {
+            mRanges[pair].end = mRanges[pair + 1].end;
+            removeRange(pair + 1);
+        }
+    }
+
+    void removeRange(size_t index) {
+        for (size_t i = index; i + 1 < mRangeCount; ++i) {
+            mRanges[i] = mRanges[i + 1];
+        }
+        --mRangeCount;
+    }
+
+    JNIEnv* const mEnv;
+    const ArrayType mJavaArray;
+    T* mRawArray;
+    size_t mSize;
+    jboolean mIsCopy;
+    Range mRanges[MaxRanges];
+    size_t mRangeCount;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedArrayDirtyRW);
+};
+
+typedef ScopedArrayDirtyRW<jboolean> ScopedBooleanArrayDirtyRW;
+typedef ScopedArrayDirtyRW<jbyte> ScopedByteArrayDirtyRW;
+typedef ScopedArrayDirtyRW<jchar> ScopedCharArrayDirtyRW;
+typedef ScopedArrayDirtyRW<jdouble> ScopedDoubleArrayDirtyRW;
+typedef ScopedArrayDirtyRW<jfloat> ScopedFloatArrayDirtyRW;
+typedef ScopedArrayDirtyRW<jint> ScopedIntArrayDirtyRW;
+typedef ScopedArrayDirtyRW<jlong> ScopedLongArrayDirtyRW;
+typedef ScopedArrayDirtyRW<jshort> ScopedShortArrayDirtyRW;
+
+// ScopedArrayCritical provides access to the elements of a Java array through
+// GetPrimitiveArrayCritical, which lets the runtime hand out a pointer to the
+// array itself rather than a copy. Unlike the classes above, large arrays are
+// then read and written in place. The read-only variant releases the array with
+// JNI_ABORT, so that a copy made by the runtime is not written back.
+//
+// While the object is alive the thread must not make any other JNI call, block,
+// or wait on another thread that may make JNI calls: the runtime may have
+// suspended garbage collection for it. To help with this, the object does not
+// expose its JNIEnv, and the array length is fetched before the critical region
+// is entered. Keep its scope as small as
+// possible and use the ScopedXxxArrayRO/RW classes if the code in it needs JNI.
+//
+// The elements are accessed as for a span: data(), size(), operator[], and
+// begin()/end() for range-based for loops. If the array is null, a
+// NullPointerException is thrown and the object is empty; if the runtime cannot
+// provide the elements, an OutOfMemoryError is pending and the object is empty.
+template <typename T, bool readOnly>
+class ScopedArrayCritical {
+public:
+    typedef typename nativehelper::detail::PrimitiveArrayTraits<T>::ArrayType ArrayType;
+    typedef typename std::conditional<readOnly, const T, T>::type ElementType;
+
+    ScopedArrayCritical(JNIEnv* env, ArrayType javaArray)
+    : mEnv(env), mJavaArray(javaArray), mRawArray(NULL), mSize(0) {
+        if (mJavaArray == NULL) {
+            jniThrowNullPointerException(mEnv);
+            return;
+        }
+        mSize = mEnv->GetArrayLength(mJavaArray);
+        jboolean isCopy;
+        mRawArray = static_cast<T*>(mEnv->GetPrimitiveArrayCritical(mJavaArray, &isCopy));
+        if (mRawArray == NULL) {
+            mSize = 0;
+        } else {
+            nativehelper::ArrayAccessPolicy<T>::RecordCritical(isCopy);
+        }
+    }
+
+    ~ScopedArrayCritical() {
+        if (mRawArray != NULL) {
+            mEnv->ReleasePrimitiveArrayCritical(mJavaArray, mRawArray, readOnly ? JNI_ABORT : 0);
+        }
+    }
+
+    ElementType* data() const { return mRawArray; }
+    ElementType* get() const { return mRawArray; }
+    ArrayType getJavaArray() const { return mJavaArray; }
+    ElementType& operator[](size_t n) const { return mRawArray[n]; }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    ElementType* begin() const { return mRawArray; }
+    ElementType* end() const { return mRawArray + mSize; }
+
+private:
+    JNIEnv* const mEnv;
+    const ArrayType mJavaArray;
+    T* mRawArray;
+    size_t mSize;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedArrayCritical);
+};
+
+// ScopedBooleanArrayCriticalRO, ScopedByteArrayCriticalRO, ... and the matching
+// RW classes.
+#define INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(PRIMITIVE_TYPE, NAME) \
+    typedef ScopedArrayCritical<PRIMITIVE_TYPE, true> Scoped ## NAME ## ArrayCriticalRO; \
+    typedef ScopedArrayCritical<PRIMITIVE_TYPE, false> Scoped ## NAME ## ArrayCriticalRW
+
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jboolean, Boolean);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jbyte, Byte);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jchar, Char);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jdouble, Double);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jfloat, Float);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jint, Int);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jlong, Long);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL(jshort, Short);
+
+#undef INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_CRITICAL
+
+namespace nativehelper {
+namespace detail {
+
+// Returns false, with an ArrayIndexOutOfBoundsException pending, if
+// [offset, offset + length) is not a range of an array of |arrayLength|
+// elements.
+static inline bool CheckArrayRegion(JNIEnv* env, jsize arrayLength, jsize offset, jsize length) {
+    if (offset >= 0 && length >= 0 && offset <= arrayLength && length <= arrayLength - offset) {
+        return true;
+    }
+    jniThrowArrayIndexOutOfBoundsException(env, arrayLength, offset, length);
+    return false;
+}
+
+}  // namespace detail
+}  // namespace nativehelper
+
+// ScopedArrayRegion provides access to the elements [offset, offset + length)
+// of a Java array, for the (array, offset, length) triples common in Java I/O
+// APIs. Only that range is copied out with GetXxxArrayRegion and, for the
+// read-write variant, written back with SetXxxArrayRegion when the object is
+// destroyed, however large the array is:
+//
+//   ScopedByteArrayRegionRO bytes(env, javaBuffer, offset, length);
+//   if (bytes.get() == NULL) {
+//       return;  // Exception pending.
+//   }
+//   write(fd, bytes.get(), bytes.size());
+//
+// Ranges of up to InlineCapacity elements are copied into a buffer held in the
+// object, and larger ones into a buffer from the ThreadBufferPool if the thread
+// has enabled it, or else from the heap. If the array is null a
+// NullPointerException is thrown, and if the range is out of bounds an
+// ArrayIndexOutOfBoundsException is thrown; the object is then empty and get()
+// returns NULL. An empty range in bounds is not an error. The read-write
+// variant does not write the range back if an exception is pending when it is
+// destroyed, as JNI functions other than those for handling exceptions may not
+// be called then.
+template <typename T, bool readOnly,
+          size_t InlineCapacity = nativehelper::detail::DefaultInlineCapacity<T>::value>
+class ScopedArrayRegion {
+public:
+    typedef nativehelper::detail::PrimitiveArrayTraits<T> Traits;
+    typedef typename Traits::ArrayType ArrayType;
+    typedef typename std::conditional<readOnly, const T, T>::type ElementType;
+
+    ScopedArrayRegion(JNIEnv* env, ArrayType javaArray, jsize offset, jsize length)
+    : mEnv(env), mJavaArray(javaArray), mRawArray(NULL), mOffset(offset), mSize(0),
+      mPooled(false) {
+        if (mJavaArray == NULL) {
+            jniThrowNullPointerException(mEnv);
+            return;
+        }
+        if (!nativehelper::detail::CheckArrayRegion(mEnv, mEnv->GetArrayLength(mJavaArray),
+                                                    offset, length)) {
+            return;
+        }
+        mSize = length;
+        if (mSize <= InlineCapacity) {
+            mRawArray = mBuffer;
+        } else {
+            nativehelper::ThreadBufferPool* pool = nativehelper::ThreadBufferPool::Current();
+            if (pool != NULL) {
+                mRawArray = static_cast<T*>(pool->Acquire(mSize * sizeof(T)));
+                mPooled = mRawArray != NULL;
+            }
+            if (mRawArray == NULL) {
+                mHeapBuffer.reset(new T[mSize]);
+                mRawArray = mHeapBuffer.get();
+            }
+        }
+        Traits::GetRegion(mEnv, mJavaArray, mOffset, length, mRawArray);
+    }
+
+    ~ScopedArrayRegion() {
+        if (mRawArray == NULL) {
+            return;
+        }
+        if (!readOnly && !mEnv->ExceptionCheck()) {
+            Traits::SetRegion(mEnv, mJavaArray, mOffset, static_cast<jsize>(mSize), mRawArray);
+        }
+        if (mPooled) {
+            nativehelper::ThreadBufferPool::Release(mRawArray, mSize * sizeof(T));
+        }
+    }
+
+    ElementType* data() const { return mRawArray; }
+    ElementType* get() const { return mRawArray; }
+    ArrayType getJavaArray() const { return mJavaArray; }
+    // Offset in the array of the first element.
+    jsize offset() const { return mOffset; }
+    ElementType& operator[](size_t n) const { return mRawArray[n]; }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    ElementType* begin() const { return mRawArray; }
+    ElementType* end() const { return mRawArray + mSize; }
+
+private:
+    JNIEnv* const mEnv;
+    const ArrayType mJavaArray;
+    T* mRawArray;
+    const jsize mOffset;
+    size_t mSize;
+    bool mPooled;
+    std::unique_ptr<T[]> mHeapBuffer;
+    alignas(64) T mBuffer[InlineCapacity > 0 ? InlineCapacity : 1];
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedArrayRegion);
+};
+
+// ScopedBooleanArrayRegionRO, ScopedByteArrayRegionRO, ... and the matching RW
+// classes.
+#define INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(PRIMITIVE_TYPE, NAME) \
+    typedef ScopedArrayRegion<PRIMITIVE_TYPE, true> Scoped ## NAME ## ArrayRegionRO; \
+    typedef ScopedArrayRegion<PRIMITIVE_TYPE, false> Scoped ## NAME ## ArrayRegionRW
+
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jboolean, Boolean);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jbyte, Byte);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jchar, Char);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jdouble, Double);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jfloat, Float);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jint, Int);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jlong, Long);
+INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION(jshort, Short);
+
+#undef INSTANTIATE_SCOPED_PRIMITIVE_ARRAY_REGION
 #undef POINTER_TYPE
 #undef REFERENCE_TYPE
 
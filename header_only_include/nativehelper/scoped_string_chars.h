@@ -19,10 +19,13 @@
 
 #include "jni.h"
 #include "nativehelper_utils.h"
+#include "thread_buffer_pool.h"
 
 // A smart pointer that provides access to a jchar* given a JNI jstring.
 // Unlike GetStringChars, we throw NullPointerException rather than abort if
-// passed a null jstring, and get will return NULL.
+// passed a null jstring, and get will return NULL. If the thread has enabled the
+// nativehelper::ThreadBufferPool, the chars are copied into a pooled buffer with
+// GetStringRegion instead.
 // This makes the correct idiom very simple:
 //
 //   ScopedStringChars name(env, java_name);
@@ -31,11 +34,12 @@
 //   }
 class ScopedStringChars {
  public:
-  ScopedStringChars(JNIEnv* env, jstring s) : env_(env), string_(s), size_(0) {
+  ScopedStringChars(JNIEnv* env, jstring s)
+      : env_(env), string_(s), size_(0), pooled_(false) {
     if (s == NULL) {
       chars_ = NULL;
       jniThrowNullPointerException(env);
-    } else {
+    } else if (!GetPooledChars()) {
       chars_ = env->GetStringChars(string_, NULL);
       if (chars_ != NULL) {
         size_ = env->GetStringLength(string_);
@@ -44,7 +48,9 @@ class ScopedStringChars {
   }
 
   ~ScopedStringChars() {
-    if (chars_ != NULL) {
+    if (pooled_) {
+      nativehelper::ThreadBufferPool::Release(const_cast<jchar*>(chars_), size_ * sizeof(jchar));
+    } else if (chars_ != NULL) {
       env_->ReleaseStringChars(string_, chars_);
     }
   }
@@ -62,10 +68,30 @@ class ScopedStringChars {
   }
 
  private:
+  // Copies the chars into a buffer from the thread's pool, if it is enabled and
+  // the string fits.
+  bool GetPooledChars() {
+    nativehelper::ThreadBufferPool* pool = nativehelper::ThreadBufferPool::Current();
+    if (pool == NULL) {
+      return false;
+    }
+    jsize length = env_->GetStringLength(string_);
+    jchar* buffer = static_cast<jchar*>(pool->Acquire(length * sizeof(jchar)));
+    if (buffer == NULL) {
+      return false;
+    }
+    env_->GetStringRegion(string_, 0, length, buffer);
+    chars_ = buffer;
+    size_ = length;
+    pooled_ = true;
+    return true;
+  }
+
   JNIEnv* const env_;
   const jstring string_;
   const jchar* chars_;
   size_t size_;
+  bool pooled_;
 
   DISALLOW_COPY_AND_ASSIGN(ScopedStringChars);
 };
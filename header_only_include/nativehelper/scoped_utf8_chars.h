@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_UTF8_CHARS_H_
+#define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_UTF8_CHARS_H_
+
+#include <stddef.h>
+
+#include <memory>
+
+#include "jni.h"
+#include "nativehelper_utils.h"
+#include "thread_buffer_pool.h"
+#include "utf16_to_utf8.h"
+
+// A smart pointer that provides a NUL-terminated, standard UTF-8 char* given a
+// JNI jstring. It is an alternative to ScopedUtfChars, which returns the
+// modified UTF-8 of GetStringUTFChars: here characters outside the Basic
+// Multilingual Plane are 4-byte sequences, unpaired surrogates become '?', and
+// the string is converted by nativehelper::Utf16ToUtf8 straight from
+// GetStringCritical, without the runtime allocating a copy.
+//
+// Strings of up to 85 chars are converted into a buffer held in the object;
+// longer ones into a buffer from the ThreadBufferPool if the thread has
+// enabled it, or else from the heap. As with ScopedUtfChars, a null jstring
+// throws NullPointerException and c_str returns nullptr:
+//
+//   ScopedUtf8Chars name(env, java_name);
+//   if (name.c_str() == nullptr) {
+//     return nullptr;
+//   }
+//
+// A U+0000 in the string is converted to a 0 byte, so use size() rather than
+// strlen when the string may hold one.
+class ScopedUtf8Chars {
+ public:
+  ScopedUtf8Chars(JNIEnv* env, jstring s)
+      : utf8_chars_(nullptr), size_(0), buffer_(nullptr), pooled_size_(0) {
+    if (s == nullptr) {
+      jniThrowNullPointerException(env);
+      return;
+    }
+    size_t length = env->GetStringLength(s);
+    AllocateBuffer(length * nativehelper::kMaxUtf8BytesPerUtf16Unit + 1);
+    const jchar* chars = env->GetStringCritical(s, nullptr);
+    if (chars == nullptr) {
+      return;
+    }
+    size_ = nativehelper::Utf16ToUtf8(chars, length, buffer_);
+    env->ReleaseStringCritical(s, chars);
+    buffer_[size_] = '\0';
+    utf8_chars_ = buffer_;
+  }
+
+  ~ScopedUtf8Chars() {
+    if (pooled_size_ != 0) {
+      nativehelper::ThreadBufferPool::Release(buffer_, pooled_size_);
+    }
+  }
+
+  const char* c_str() const {
+    return utf8_chars_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  const char& operator[](size_t n) const {
+    return utf8_chars_[n];
+  }
+
+ private:
+  static const size_t kInlineCapacity = 256;
+
+  void AllocateBuffer(size_t capacity) {
+    if (capacity <= kInlineCapacity) {
+      buffer_ = inline_buffer_;
+      return;
+    }
+    nativehelper::ThreadBufferPool* pool = nativehelper::ThreadBufferPool::Current();
+    if (pool != nullptr) {
+      buffer_ = static_cast<char*>(pool->Acquire(capacity));
+      if (buffer_ != nullptr) {
+        pooled_size_ = capacity;
+        return;
+      }
+    }
+    heap_buffer_.reset(new char[capacity]);
+    buffer_ = heap_buffer_.get();
+  }
+
+  const char* utf8_chars_;
+  size_t size_;
+  char* buffer_;
+  // The size of buffer_ if it is from the pool, or 0.
+  size_t pooled_size_;
+  std::unique_ptr<char[]> heap_buffer_;
+  char inline_buffer_[kInlineCapacity];
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedUtf8Chars);
+};
+
+#endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_SCOPED_UTF8_CHARS_H_
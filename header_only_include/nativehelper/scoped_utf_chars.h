@@ -21,10 +21,13 @@
 
 #include "jni.h"
 #include "nativehelper_utils.h"
+#include "thread_buffer_pool.h"
 
 // A smart pointer that provides read-only access to a Java string's UTF chars.
 // Unlike GetStringUTFChars, we throw NullPointerException rather than abort if
-// passed a null jstring, and c_str will return nullptr.
+// passed a null jstring, and c_str will return nullptr. If the thread has
+// enabled the nativehelper::ThreadBufferPool, the chars are copied into a pooled
+// buffer with GetStringUTFRegion instead.
 // This makes the correct idiom very simple:
 //
 //   ScopedUtfChars name(env, java_name);
@@ -33,24 +36,28 @@
 //   }
 class ScopedUtfChars {
  public:
-  ScopedUtfChars(JNIEnv* env, jstring s) : env_(env), string_(s) {
+  ScopedUtfChars(JNIEnv* env, jstring s) : env_(env), string_(s), pooled_size_(0) {
     if (s == nullptr) {
       utf_chars_ = nullptr;
       jniThrowNullPointerException(env);
-    } else {
+    } else if (!GetPooledChars()) {
       utf_chars_ = env->GetStringUTFChars(s, nullptr);
     }
   }
 
   ScopedUtfChars(ScopedUtfChars&& rhs) noexcept :
-      env_(rhs.env_), string_(rhs.string_), utf_chars_(rhs.utf_chars_) {
+      env_(rhs.env_), string_(rhs.string_), utf_chars_(rhs.utf_chars_),
+      pooled_size_(rhs.pooled_size_) {
     rhs.env_ = nullptr;
     rhs.string_ = nullptr;
     rhs.utf_chars_ = nullptr;
+    rhs.pooled_size_ = 0;
   }
 
   ~ScopedUtfChars() {
-    if (utf_chars_) {
+    if (pooled_size_ != 0) {
+      nativehelper::ThreadBufferPool::Release(const_cast<char*>(utf_chars_), pooled_size_);
+    } else if (utf_chars_) {
       env_->ReleaseStringUTFChars(string_, utf_chars_);
     }
   }
@@ -64,9 +71,11 @@ class ScopedUtfChars {
       env_ = rhs.env_;
       string_ = rhs.string_;
       utf_chars_ = rhs.utf_chars_;
+      pooled_size_ = rhs.pooled_size_;
       rhs.env_ = nullptr;
       rhs.string_ = nullptr;
       rhs.utf_chars_ = nullptr;
+      rhs.pooled_size_ = 0;
     }
     return *this;
   }
@@ -84,9 +93,30 @@ class ScopedUtfChars {
   }
 
  private:
+  // Copies the chars into a buffer from the thread's pool, if it is enabled and
+  // the string fits.
+  bool GetPooledChars() {
+    nativehelper::ThreadBufferPool* pool = nativehelper::ThreadBufferPool::Current();
+    if (pool == nullptr) {
+      return false;
+    }
+    size_t utf_length = env_->GetStringUTFLength(string_);
+    char* buffer = static_cast<char*>(pool->Acquire(utf_length + 1));
+    if (buffer == nullptr) {
+      return false;
+    }
+    env_->GetStringUTFRegion(string_, 0, env_->GetStringLength(string_), buffer);
+    buffer[utf_length] = '\0';
+    utf_chars_ = buffer;
+    pooled_size_ = utf_length + 1;
+    return true;
+  }
+
   JNIEnv* env_;
   jstring string_;
   const char* utf_chars_;
+  // The size of the pooled buffer holding utf_chars_, or 0 if it is not pooled.
+  size_t pooled_size_;
 
   DISALLOW_COPY_AND_ASSIGN(ScopedUtfChars);
 };
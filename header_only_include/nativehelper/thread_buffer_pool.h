@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_THREAD_BUFFER_POOL_H_
+#define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_THREAD_BUFFER_POOL_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <new>
+
+#include "jni.h"
+#include "nativehelper_utils.h"
+
+namespace nativehelper {
+
+// A per-thread pool of buffers used by ScopedXxxArrayRO, ScopedUtfChars and
+// ScopedStringChars to hold their copies. It is disabled by default. When a
+// thread enables it with
+//
+//   nativehelper::ThreadBufferPool::SetEnabled(true);
+//
+// those helpers copy arrays that do not fit their inline buffer, and strings,
+// into pooled buffers with GetXxxArrayRegion, GetStringRegion and
+// GetStringUTFRegion, instead of having the runtime allocate a copy with
+// GetXxxArrayElements, GetStringChars or GetStringUTFChars. Repeated calls on
+// the thread then reuse the same memory.
+//
+// Buffers are grouped in power-of-two size classes from 256 bytes to 256 KiB,
+// and up to 4 free buffers are kept per class. Larger requests are not pooled,
+// and the helpers fall back to the runtime for them. The buffers are freed when
+// the pool is disabled or the thread exits.
+class ThreadBufferPool {
+public:
+    static const size_t kMaxPooledBytes = 256 * 1024;
+
+    ~ThreadBufferPool() {
+        for (size_t c = 0; c < kClassCount; ++c) {
+            for (size_t i = 0; i < mFreeCount[c]; ++i) {
+                ::operator delete(mFree[c][i]);
+            }
+        }
+    }
+
+    // Enables or disables the pool of the calling thread. Disabling it frees
+    // its buffers; buffers still in use are freed when they are released.
+    static void SetEnabled(bool enabled) {
+        std::unique_ptr<ThreadBufferPool>& pool = Slot();
+        if (enabled && pool.get() == nullptr) {
+            pool.reset(new ThreadBufferPool());
+        } else if (!enabled) {
+            pool.reset();
+        }
+    }
+
+    // Returns the pool of the calling thread, or nullptr if it is not enabled.
+    static ThreadBufferPool* Current() {
+        return Slot().get();
+    }
+
+    // Returns a buffer of at least |bytes| bytes, or nullptr if |bytes| is too
+    // large to be pooled.
+    void* Acquire(size_t bytes) {
+        if (bytes > kMaxPooledBytes) {
+            return nullptr;
+        }
+        size_t c = SizeClass(bytes);
+        if (mFreeCount[c] > 0) {
+            return mFree[c][--mFreeCount[c]];
+        }
+        return ::operator new(ClassBytes(c));
+    }
+
+    // Returns |buffer|, acquired for |bytes| bytes from the pool of any thread,
+    // to the pool of the calling thread, or frees it if that pool is disabled
+    // or full.
+    static void Release(void* buffer, size_t bytes) {
+        ThreadBufferPool* pool = Current();
+        if (pool != nullptr) {
+            size_t c = SizeClass(bytes);
+            if (pool->mFreeCount[c] < kMaxFreePerClass) {
+                pool->mFree[c][pool->mFreeCount[c]++] = buffer;
+                return;
+            }
+        }
+        ::operator delete(buffer);
+    }
+
+    // Returns the number of bytes held in free buffers.
+    size_t cachedBytes() const {
+        size_t total = 0;
+        for (size_t c = 0; c < kClassCount; ++c) {
+            total += mFreeCount[c] * ClassBytes(c);
+        }
+        return total;
+    }
+
+private:
+    static const size_t kMinClassShift = 8;
+    static const size_t kClassCount = 11;  // 256 bytes to 256 KiB.
+    static const size_t kMaxFreePerClass = 4;
+
+    ThreadBufferPool() {
+        for (size_t c = 0; c < kClassCount; ++c) {
+            mFreeCount[c] = 0;
+        }
+    }
+
+    static std::unique_ptr<ThreadBufferPool>& Slot() {
+        static thread_local std::unique_ptr<ThreadBufferPool> pool;
+        return pool;
+    }
+
+    static size_t ClassBytes(size_t c) {
+        return static_cast<size_t>(1) << (kMinClassShift + c);
+    }
+
+    static size_t SizeClass(size_t bytes) {
+        size_t c = 0;
+        while (ClassBytes(c) < bytes) {
+            ++c;
+        }
+        return c;
+    }
+
+    void* mFree[kClassCount][kMaxFreePerClass];
+    size_t mFreeCount[kClassCount];
+
+    DISALLOW_COPY_AND_ASSIGN(ThreadBufferPool);
+};
+
+}  // namespace nativehelper
+
+#endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_THREAD_BUFFER_POOL_H_
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_UTF16_TO_UTF8_H_
+#define LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_UTF16_TO_UTF8_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "jni.h"
+
+// Converts UTF-16, such as the chars of a Java string from ScopedStringChars
+// or GetStringRegion, to standard UTF-8. Unlike GetStringUTFChars, which
+// returns modified UTF-8, characters outside the Basic Multilingual Plane are
+// encoded in 4 bytes rather than as two 3-byte surrogates, and U+0000 is
+// encoded as a single 0 byte. Unpaired surrogates are replaced with '?', as
+// String.getBytes(StandardCharsets.UTF_8) does.
+//
+// Runs of ASCII characters, the common case, are tested and narrowed to bytes
+// a vector at a time, with AVX2, SSE2 or NEON when the target supports them;
+// other characters are converted one at a time.
+
+namespace nativehelper {
+
+// Each UTF-16 unit converts to at most this many bytes of UTF-8.
+static const size_t kMaxUtf8BytesPerUtf16Unit = 3;
+
+namespace detail {
+
+// The number of UTF-16 units handled at a time by the ASCII fast path.
+#if defined(__AVX2__)
+static const size_t kUtf16AsciiBlockSize = 32;
+#elif defined(__SSE2__) || defined(__ARM_NEON)
+static const size_t kUtf16AsciiBlockSize = 16;
+#else
+static const size_t kUtf16AsciiBlockSize = 8;
+#endif
+
+// Returns whether the kUtf16AsciiBlockSize units at |in| are all ASCII and, if
+// they are and |out| is not null, writes them to |out| as bytes.
+inline bool ConvertUtf16AsciiBlock(const jchar* in, char* out) {
+#if defined(__AVX2__)
+  __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+  __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 16));
+  if (!_mm256_testz_si256(_mm256_or_si256(a, b),
+                          _mm256_set1_epi16(static_cast<short>(0xff80)))) {
+    return false;
+  }
+  if (out != nullptr) {
+    // packus interleaves the 128-bit lanes of a and b; put them back in order.
+    __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), bytes);
+  }
+  return true;
+#elif defined(__SSE2__)
+  __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8));
+  __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16(static_cast<short>(0xff80)));
+  if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff) {
+    return false;
+  }
+  if (out != nullptr) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(a, b));
+  }
+  return true;
+#elif defined(__ARM_NEON)
+  uint16x8_t a = vld1q_u16(in);
+  uint16x8_t b = vld1q_u16(in + 8);
+  uint64x2_t high = vreinterpretq_u64_u16(vshrq_n_u16(vorrq_u16(a, b), 7));
+  if ((vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1)) != 0) {
+    return false;
+  }
+  if (out != nullptr) {
+    vst1q_u8(reinterpret_cast<uint8_t*>(out), vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+  }
+  return true;
+#else
+  uint64_t words[2];
+  memcpy(words, in, sizeof(words));
+  if (((words[0] | words[1]) & 0xff80ff80ff80ff80ULL) != 0) {
+    return false;
+  }
+  if (out != nullptr) {
+    for (size_t i = 0; i < kUtf16AsciiBlockSize; ++i) {
+      out[i] = static_cast<char>(in[i]);
+    }
+  }
+  return true;
+#endif
+}
+
+// Converts the character at in[*i], which may be a surrogate pair, advancing
+// *i past it. Returns the number of bytes it converts to, which are written to
+// |out| if kWrite.
+template <bool kWrite>
+inline size_t ConvertUtf16Char(const jchar* in, size_t length, size_t* i, char* out) {
+  uint32_t c = in[(*i)++];
+  if (c < 0x80) {
+    if (kWrite) {
+      out[0] = static_cast<char>(c);
+    }
+    return 1;
+  }
+  if (c < 0x800) {
+    if (kWrite) {
+      out[0] = static_cast<char>(0xc0 | (c >> 6));
+      out[1] = static_cast<char>(0x80 | (c & 0x3f));
+    }
+    return 2;
+  }
+  if (c >= 0xd800 && c <= 0xdfff) {
+    if (c > 0xdbff || *i == length || in[*i] < 0xdc00 || in[*i] > 0xdfff) {
+      if (kWrite) {
+        out[0] = '?';
+      }
+      return 1;
+    }
+    c = 0x10000 + ((c - 0xd800) << 10) + (in[(*i)++] - 0xdc00);
+    if (kWrite) {
+      out[0] = static_cast<char>(0xf0 | (c >> 18));
+      out[1] = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+      out[2] = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      out[3] = static_cast<char>(0x80 | (c & 0x3f));
+    }
+    return 4;
+  }
+  if (kWrite) {
+    out[0] = static_cast<char>(0xe0 | (c >> 12));
+    out[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+    out[2] = static_cast<char>(0x80 | (c & 0x3f));
+  }
+  return 3;
+}
+
+// Converts, or if not kWrite only measures, in[0, length). Returns the number
+// of bytes of UTF-8.
+template <bool kWrite>
+inline size_t ConvertUtf16ToUtf8(const jchar* in, size_t length, char* out) {
+  size_t i = 0;
+  size_t written = 0;
+  while (length - i >= kUtf16AsciiBlockSize) {
+    if (ConvertUtf16AsciiBlock(in + i, kWrite ? out + written : nullptr)) {
+      i += kUtf16AsciiBlockSize;
+      written += kUtf16AsciiBlockSize;
+      continue;
+    }
+    // Convert the block one character at a time, before trying the fast path
+    // again. A surrogate pair at its end may take the loop one unit past it.
+    size_t end = i + kUtf16AsciiBlockSize;
+    while (i < end) {
+      written += ConvertUtf16Char<kWrite>(in, length, &i, kWrite ? out + written : nullptr);
+    }
+  }
+  while (i < length) {
+    written += ConvertUtf16Char<kWrite>(in, length, &i, kWrite ? out + written : nullptr);
+  }
+  return written;
+}
+
+}  // namespace detail
+
+// Returns the number of bytes of the UTF-8 encoding of in[0, length).
+inline size_t Utf16ToUtf8Length(const jchar* in, size_t length) {
+  return detail::ConvertUtf16ToUtf8<false>(in, length, nullptr);
+}
+
+// Writes the UTF-8 encoding of in[0, length) to |out|, without a terminating
+// NUL, and returns the number of bytes written. |out| must have room for
+// Utf16ToUtf8Length(in, length) bytes; length * kMaxUtf8BytesPerUtf16Unit is
+// always enough.
+inline size_t Utf16ToUtf8(const jchar* in, size_t length, char* out) {
+  return detail::ConvertUtf16ToUtf8<true>(in, length, out);
+}
+
+}  // namespace nativehelper
+
+#endif  // LIBNATIVEHELPER_HEADER_ONLY_INCLUDE_NATIVEHELPER_UTF16_TO_UTF8_H_
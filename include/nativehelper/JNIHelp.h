@@ -46,15 +46,35 @@ inline int jniThrowException(JNIEnv* env, const char* className, const char* msg
     return jniThrowException(&env->functions, className, msg);
 }
 
+inline int jniThrowException(JNIEnv* env, jclass exceptionClass, const char* msg) {
+    return jniThrowExceptionWithClass(&env->functions, exceptionClass, msg);
+}
+
 /*
  * Equivalent to jniThrowException but with a printf-like format string and
- * variable-length argument list. This is only available in C++.
+ * variable-length argument list. The format string is checked against the
+ * arguments at compile time. This is only available in C++.
  */
+inline int jniThrowExceptionFmt(JNIEnv* env, const char* className, const char* fmt, ...)
+        __attribute__((__format__(__printf__, 3, 4)));
+
 inline int jniThrowExceptionFmt(JNIEnv* env, const char* className, const char* fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    return jniThrowExceptionFmt(&env->functions, className, fmt, args);
+    int result = jniThrowExceptionFmt(&env->functions, className, fmt, args);
     va_end(args);
+    return result;
+}
+
+inline int jniThrowExceptionFmt(JNIEnv* env, jclass exceptionClass, const char* fmt, ...)
+        __attribute__((__format__(__printf__, 3, 4)));
+
+inline int jniThrowExceptionFmt(JNIEnv* env, jclass exceptionClass, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int result = jniThrowExceptionWithClassFmt(&env->functions, exceptionClass, fmt, args);
+    va_end(args);
+    return result;
 }
 
 inline int jniThrowNullPointerException(JNIEnv* env, const char* msg) {
@@ -69,6 +89,27 @@ inline int jniThrowIOException(JNIEnv* env, int errnum) {
     return jniThrowIOException(&env->functions, errnum);
 }
 
+inline int jniThrowErrnoException(JNIEnv* env, const char* functionName, int errnum) {
+    return jniThrowErrnoException(&env->functions, functionName, errnum);
+}
+
+inline int jniThrowChainedException(JNIEnv* env, const char* className, const char* msg) {
+    return jniThrowChainedException(&env->functions, className, msg);
+}
+
+inline int jniThrowChainedException(JNIEnv* env, jclass exceptionClass, const char* msg) {
+    return jniThrowChainedExceptionWithClass(&env->functions, exceptionClass, msg);
+}
+
+inline jthrowable jniCreatePreallocatedException(JNIEnv* env, jclass exceptionClass,
+                                                 const char* msg) {
+    return jniCreatePreallocatedException(&env->functions, exceptionClass, msg);
+}
+
+inline int jniThrowPreallocatedException(JNIEnv* env, jthrowable exception) {
+    return jniThrowPreallocatedException(&env->functions, exception);
+}
+
 inline jobject jniCreateFileDescriptor(JNIEnv* env, int fd) {
     return jniCreateFileDescriptor(&env->functions, fd);
 }
@@ -119,6 +160,20 @@ inline void jniLogException(JNIEnv* env, int priority, const char* tag, jthrowab
     jniLogException(&env->functions, priority, tag, exception);
 }
 
+inline void jniLogExceptionWithDepth(JNIEnv* env, int priority, const char* tag,
+                                     jthrowable exception, int maxDepth) {
+    jniLogExceptionWithDepth(&env->functions, priority, tag, exception, maxDepth);
+}
+
+inline void jniLogExceptionAsync(JNIEnv* env, int priority, const char* tag,
+                                 jthrowable exception = NULL) {
+    jniLogExceptionAsync(&env->functions, priority, tag, exception);
+}
+
+inline int jniPrewarmConstants(JNIEnv* env, uint64_t mask) {
+    return jniPrewarmConstants(&env->functions, mask);
+}
+
 #endif  // defined(__cplusplus)
 
 #endif  // LIBNATIVEHELPER_INCLUDE_NATIVEHELPER_JNIHELP_H_
@@ -18,6 +18,7 @@
 #define LIBNATIVEHELPER_INCLUDE_NATIVEHELPER_LIBNATIVEHELPER_API_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "jni.h"
 
@@ -54,6 +55,21 @@ int jniRegisterNativeMethods(C_JNIEnv* env,
  */
 int jniThrowException(C_JNIEnv* env, const char* className, const char* msg);
 
+/*
+ * Throw an exception of the specified class and an optional message.
+ *
+ * Equivalent to jniThrowException but avoids looking up the class by name, which
+ * makes it the cheaper choice for callers that already hold a reference to the
+ * exception class.
+ *
+ * If an exception is currently pending, we log a warning message and
+ * clear it.
+ *
+ * Returns 0 on success, nonzero if something failed (e.g. the exception
+ * could not be allocated, so *an* exception will still be pending).
+ */
+int jniThrowExceptionWithClass(C_JNIEnv* env, jclass exceptionClass, const char* msg);
+
 /*
  * Throw an exception with the specified class and formatted error message.
  *
@@ -70,6 +86,18 @@ int jniThrowException(C_JNIEnv* env, const char* className, const char* msg);
  */
 int jniThrowExceptionFmt(C_JNIEnv* env, const char* className, const char* fmt, va_list args);
 
+/*
+ * Throw an exception of the specified class with a vprintf-like formatted
+ * message. This is the formatted counterpart of jniThrowExceptionWithClass.
+ *
+ * Messages of up to 512 bytes are formatted without allocating; longer
+ * messages are not truncated.
+ *
+ * Returns 0 on success, nonzero if something failed.
+ */
+int jniThrowExceptionWithClassFmt(C_JNIEnv* env, jclass exceptionClass, const char* fmt,
+                                  va_list args);
+
 /*
  * Throw a java.lang.NullPointerException, with an optional message.
  */
@@ -85,6 +113,67 @@ int jniThrowRuntimeException(C_JNIEnv* env, const char* msg);
  */
 int jniThrowIOException(C_JNIEnv* env, int errnum);
 
+/*
+ * Throw an android.system.ErrnoException for the failed call |functionName|
+ * (e.g. "recvfrom") and the errno value |errnum|. The errno value is passed
+ * through to the exception, which produces its message lazily.
+ *
+ * If android.system.ErrnoException is not available, a java.io.IOException
+ * is thrown instead.
+ *
+ * Returns 0 on success, nonzero if something failed.
+ */
+int jniThrowErrnoException(C_JNIEnv* env, const char* functionName, int errnum);
+
+/*
+ * Throw an exception of the specified class with an optional message, using
+ * the currently pending exception (if any) as its cause.
+ *
+ * Unlike jniThrowException, the pending exception is neither summarized nor
+ * logged. The new exception is created with the constructor of the exception
+ * class taking a message and a cause or, if the class does not declare one,
+ * with the constructor taking only a message, after which the cause is set
+ * with Throwable.initCause().
+ *
+ * Returns 0 on success, nonzero if something failed (e.g. the exception
+ * class couldn't be found). On failure *an* exception will still be pending:
+ * the original one if there was one, so that it is not lost.
+ */
+int jniThrowChainedException(C_JNIEnv* env, const char* className, const char* msg);
+
+/*
+ * Equivalent to jniThrowChainedException but takes the exception class rather
+ * than its name.
+ */
+int jniThrowChainedExceptionWithClass(C_JNIEnv* env, jclass exceptionClass, const char* msg);
+
+/*
+ * Returns a new global reference to an instance of |exceptionClass| with the
+ * message |msg| (which may be NULL). The instance is intended to be created
+ * once and thrown repeatedly with jniThrowPreallocatedException.
+ *
+ * The instance has no stack trace and suppression disabled: it is created with
+ * the (String, Throwable, boolean, boolean) constructor of |exceptionClass|,
+ * with a NULL cause and both flags false. If |exceptionClass| does not declare
+ * that constructor, the one of java.lang.Throwable is run on the instance
+ * instead, and no other constructor of |exceptionClass| runs.
+ *
+ * Returns NULL if the instance could not be created, in which case an
+ * exception will be pending. The caller owns the returned global reference.
+ */
+jthrowable jniCreatePreallocatedException(C_JNIEnv* env, jclass exceptionClass, const char* msg);
+
+/*
+ * Throw an exception created by jniCreatePreallocatedException. This does not
+ * allocate and does not fill in a stack trace.
+ *
+ * If an exception is currently pending, it is cleared without being logged,
+ * so that throwing stays cheap.
+ *
+ * Returns 0 on success, nonzero if something failed.
+ */
+int jniThrowPreallocatedException(C_JNIEnv* env, jthrowable exception);
+
 /*
  * Returns a new java.io.FileDescriptor for the given int fd.
  */
@@ -171,14 +260,124 @@ jobjectArray jniCreateStringArray(C_JNIEnv* env, size_t count);
 /*
  * Log a message and an exception.
  * If exception is NULL, logs the current exception in the JNI environment.
+ *
+ * The exception is logged as Throwable.printStackTrace() prints it, with every
+ * frame, its suppressed exceptions and its causes.
  */
 void jniLogException(C_JNIEnv* env, int priority, const char* tag, jthrowable exception);
 
+/*
+ * Equivalent to jniLogException but logs at most |maxDepth| frames for the
+ * exception and for each of its suppressed exceptions and causes. A negative
+ * |maxDepth| logs every frame. As with Throwable.printStackTrace(), frames an
+ * exception shares with the one it is suppressed by or caused are logged as
+ * "... n more", and an exception seen again is logged as a circular reference;
+ * frames left out because of |maxDepth| are logged separately as
+ * "... n truncated".
+ *
+ * The trace is formatted in native code, so logging does not allocate strings
+ * on the Java heap proportional to the depth of the stack.
+ */
+void jniLogExceptionWithDepth(C_JNIEnv* env, int priority, const char* tag, jthrowable exception,
+                              int maxDepth);
+
+/*
+ * Equivalent to jniLogException but the exception is formatted and logged on a
+ * background thread, so the calling thread only pays for queueing it. At most
+ * 64 frames are logged for each exception, as by jniLogExceptionWithDepth.
+ *
+ * Repeats of an exception with the same class, message and top frame are
+ * logged at most once every 10 seconds. The number of repeats suppressed is
+ * logged when the 10 seconds end. Repeats are recognized before the stack
+ * trace is formatted, so suppressing them costs little. If too many exceptions
+ * are waiting to be logged, new ones are dropped and the number dropped is
+ * logged instead.
+ *
+ * The logging thread is attached to the VM of the first exception queued, and
+ * is stopped by JniInvocationDestroyJavaVM().
+ */
+void jniLogExceptionAsync(C_JNIEnv* env, int priority, const char* tag, jthrowable exception);
+
 /*
  * Clear the cache of constants libnativehelper is using.
  */
 void jniUninitializeConstants();
 
+/*
+ * Returns the generation of the cache of constants libnativehelper is using. The generation
+ * changes each time the cache is cleared, for instance when the VM is destroyed with
+ * JniInvocationDestroyJavaVM(), so callers holding values derived from libnativehelper's
+ * constants can tell when to discard them.
+ */
+uint32_t jniGetConstantsGeneration();
+
+/*
+ * Groups of constants cached by libnativehelper, for jniPrewarmConstants() and
+ * jniStopRecordingConstants(). Each group is a class together with the fields
+ * and methods of it that libnativehelper uses.
+ */
+#define JNI_CONSTANTS_CLASS                         (UINT64_C(1) << 0)   /* java.lang.Class */
+#define JNI_CONSTANTS_FILE_DESCRIPTOR               (UINT64_C(1) << 1)   /* java.io.FileDescriptor */
+#define JNI_CONSTANTS_NIO_ACCESS                    (UINT64_C(1) << 2)   /* java.nio.NIOAccess */
+#define JNI_CONSTANTS_NIO_BUFFER                    (UINT64_C(1) << 3)   /* java.nio.Buffer */
+#define JNI_CONSTANTS_PRINT_WRITER                  (UINT64_C(1) << 4)   /* java.io.PrintWriter */
+#define JNI_CONSTANTS_REFERENCE                     (UINT64_C(1) << 5)   /* java.lang.ref.Reference */
+#define JNI_CONSTANTS_STACK_TRACE_ELEMENT           (UINT64_C(1) << 6)   /* java.lang.StackTraceElement */
+#define JNI_CONSTANTS_STRING                        (UINT64_C(1) << 7)   /* java.lang.String */
+#define JNI_CONSTANTS_STRING_WRITER                 (UINT64_C(1) << 8)   /* java.io.StringWriter */
+#define JNI_CONSTANTS_THROWABLE                     (UINT64_C(1) << 9)   /* java.lang.Throwable */
+#define JNI_CONSTANTS_IO_EXCEPTION                  (UINT64_C(1) << 10)  /* java.io.IOException */
+#define JNI_CONSTANTS_ILLEGAL_ARGUMENT_EXCEPTION    (UINT64_C(1) << 11)  /* java.lang.IllegalArgumentException */
+#define JNI_CONSTANTS_ILLEGAL_STATE_EXCEPTION       (UINT64_C(1) << 12)  /* java.lang.IllegalStateException */
+#define JNI_CONSTANTS_INDEX_OUT_OF_BOUNDS_EXCEPTION (UINT64_C(1) << 13)  /* java.lang.IndexOutOfBoundsException */
+#define JNI_CONSTANTS_NULL_POINTER_EXCEPTION        (UINT64_C(1) << 14)  /* java.lang.NullPointerException */
+#define JNI_CONSTANTS_OUT_OF_MEMORY_ERROR           (UINT64_C(1) << 15)  /* java.lang.OutOfMemoryError */
+#define JNI_CONSTANTS_RUNTIME_EXCEPTION             (UINT64_C(1) << 16)  /* java.lang.RuntimeException */
+#define JNI_CONSTANTS_ERRNO_EXCEPTION               (UINT64_C(1) << 17)  /* android.system.ErrnoException */
+#define JNI_CONSTANTS_ALL                           (~UINT64_C(0))
+
+/*
+ * Resolve the constants in the groups selected by "mask" now rather than on
+ * first use, so that the first calls needing them do not pay for the lookups.
+ *
+ * Constants that cannot be resolved are skipped. android.system.ErrnoException
+ * being unavailable is not a failure.
+ *
+ * Returns 0 on success, -1 if any constant could not be resolved.
+ */
+int jniPrewarmConstants(C_JNIEnv* env, uint64_t mask);
+
+/*
+ * Start recording which groups of constants are used, forgetting any earlier
+ * recording. Recording costs an atomic operation per use of a constant.
+ */
+void jniStartRecordingConstants();
+
+/*
+ * Stop recording and return the groups of constants used since
+ * jniStartRecordingConstants() was called. The result can be saved and passed
+ * to jniPrewarmConstants() early in a later run.
+ */
+uint64_t jniStopRecordingConstants();
+
+/*
+ * Registers |hook| to be called whenever libnativehelper clears its cache of constants, so that
+ * libraries caching classes and member ids of their own can clear them too. When the VM is
+ * destroyed with JniInvocationDestroyJavaVM(), |hook| is called with an env of the destroying
+ * thread, and should delete the global references it holds. When the cache is cleared by
+ * jniUninitializeConstants() or when a new VM is created, |env| is NULL and the references
+ * should be forgotten without being deleted, as the VM they belong to may no longer exist.
+ *
+ * Registering the same |hook| and |data| twice has no further effect. Libraries using the
+ * JNI_CONSTANTS_TABLE, JNI_METHOD, JNI_FIELD or JNI_STRUCT helpers register their tables once,
+ * typically from JNI_OnLoad:
+ *
+ *   jniRegisterConstantsReleaseHook(JniConstantTableRegistry::ReleaseHook, nullptr);
+ *
+ * Returns 0 on success, or -1 if too many hooks have been registered.
+ */
+int jniRegisterConstantsReleaseHook(void (*hook)(C_JNIEnv* env, void* data), void* data);
+
 /* ---------------------------------- C API for JniInvocation.h --------------------------------- */
 
 /*
@@ -237,6 +436,17 @@ void JniInvocationDestroy(struct JniInvocationImpl* instance);
  */
 const char* JniInvocationGetLibrary(const char* library, char* buffer);
 
+/*
+ * Destroys |vm| after releasing the classes libnativehelper has cached for it, and after logging
+ * the exceptions queued by jniLogExceptionAsync() and stopping the thread that logs them. Use this
+ * instead of calling DestroyJavaVM() directly so that another VM can safely be created later in
+ * the process.
+ *
+ * Must be called from a thread attached to |vm|, as for DestroyJavaVM(). Returns the result of
+ * DestroyJavaVM().
+ */
+jint JniInvocationDestroyJavaVM(JavaVM* vm);
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Typed handles for Java methods and fields whose descriptors are checked at compile time.
+ *
+ * A handle is declared once, at namespace or class scope, from the class name, member name and
+ * JNI descriptor:
+ *
+ *     JNI_METHOD(ObjectHashCode, "java/lang/Object", "hashCode", "()I");
+ *     JNI_METHOD(ObjectInit, "java/lang/Object", "<init>", "()V");
+ *     JNI_STATIC_METHOD(IntegerValueOf, "java/lang/Integer", "valueOf", "(I)Ljava/lang/Integer;");
+ *     JNI_FIELD(PointX, "android/graphics/Point", "x", "I");
+ *     JNI_STATIC_FIELD(IntegerMaxValue, "java/lang/Integer", "MAX_VALUE", "I");
+ *
+ * and then used without any lookups at the call site:
+ *
+ *     jint hash = ObjectHashCode::Call(env, object);
+ *     jobject boxed = IntegerValueOf::Call(env, 42);
+ *     jobject plain = ObjectInit::NewObject(env);
+ *     PointX::Set(env, point, PointX::Get(env, point) + 1);
+ *
+ * A malformed descriptor, or a call with the wrong number of arguments or with an argument that
+ * does not convert to the descriptor's type without narrowing, is a compile-time error. Return
+ * and field values have the C++ type of their descriptor; objects and arrays are jobject.
+ *
+ * Each handle caches its class, as a global reference, and its member id in static storage the
+ * first time it is used, and holds them until the JniConstantTableRegistry of the library is
+ * cleared, as it is when the VM is destroyed if the library registered it with
+ * jniRegisterConstantsReleaseHook(); see jni_constants_table.h. Calls go through the
+ * Call<Type>MethodA functions with the arguments packed into a jvalue array, rather than through
+ * the variadic functions.
+ *
+ * If the class or member cannot be found, the call returns zero or null with an exception
+ * pending, and the lookup is tried again on the next call.
+ */
+
+#ifndef LIBNATIVEHELPER_PLATFORM_INCLUDE_NATIVEHELPER_JNI_MEMBERS_H_
+#define LIBNATIVEHELPER_PLATFORM_INCLUDE_NATIVEHELPER_JNI_MEMBERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <utility>
+
+#include <jni.h>
+
+#include "nativehelper/detail/signature_checker.h"
+#include "nativehelper/jni_constants_table.h"
+
+namespace nativehelper {
+namespace detail {
+
+// Operations on the JNI values of one type, selected by the first character of the type's
+// descriptor.
+template <char kShorty>
+struct JniValueOps;
+
+#define NATIVEHELPER_JNI_VALUE_OPS(shorty, ctype, name, member)                                 \
+template <>                                                                                   \
+struct JniValueOps<shorty> {                                                                  \
+  using Type = ctype;                                                                         \
+                                                                                              \
+  static Type Default() {                                                                     \
+    return Type();                                                                            \
+  }                                                                                           \
+                                                                                              \
+  /* Braced initialization rejects narrowing conversions. */                                  \
+  template <typename T>                                                                       \
+  static jvalue Pack(T value) {                                                               \
+    jvalue result;                                                                            \
+    result.member = Type{value};                                                              \
+    return result;                                                                            \
+  }                                                                                           \
+                                                                                              \
+  static Type Call(JNIEnv* env, jobject object, jmethodID method, const jvalue* args) {        \
+    return env->Call##name##MethodA(object, method, args);                                    \
+  }                                                                                           \
+                                                                                              \
+  static Type CallNonvirtual(JNIEnv* env, jobject object, jclass klass, jmethodID method,     \
+                             const jvalue* args) {                                            \
+    return env->CallNonvirtual##name##MethodA(object, klass, method, args);                   \
+  }                                                                                           \
+                                                                                              \
+  static Type CallStatic(JNIEnv* env, jclass klass, jmethodID method, const jvalue* args) {   \
+    return env->CallStatic##name##MethodA(klass, method, args);                               \
+  }                                                                                           \
+                                                                                              \
+  static Type Get(JNIEnv* env, jobject object, jfieldID field) {                              \
+    return env->Get##name##Field(object, field);                                              \
+  }                                                                                           \
+                                                                                              \
+  static void Set(JNIEnv* env, jobject object, jfieldID field, Type value) {                  \
+    env->Set##name##Field(object, field, value);                                              \
+  }                                                                                           \
+                                                                                              \
+  static Type GetStatic(JNIEnv* env, jclass klass, jfieldID field) {                          \
+    return env->GetStatic##name##Field(klass, field);                                         \
+  }                                                                                           \
+                                                                                              \
+  static void SetStatic(JNIEnv* env, jclass klass, jfieldID field, Type value) {              \
+    env->SetStatic##name##Field(klass, field, value);                                         \
+  }                                                                                           \
+};
+
+NATIVEHELPER_JNI_VALUE_OPS('Z', jboolean, Boolean, z)
+NATIVEHELPER_JNI_VALUE_OPS('B', jbyte, Byte, b)
+NATIVEHELPER_JNI_VALUE_OPS('C', jchar, Char, c)
+NATIVEHELPER_JNI_VALUE_OPS('S', jshort, Short, s)
+NATIVEHELPER_JNI_VALUE_OPS('I', jint, Int, i)
+NATIVEHELPER_JNI_VALUE_OPS('J', jlong, Long, j)
+NATIVEHELPER_JNI_VALUE_OPS('F', jfloat, Float, f)
+NATIVEHELPER_JNI_VALUE_OPS('D', jdouble, Double, d)
+NATIVEHELPER_JNI_VALUE_OPS('L', jobject, Object, l)
+
+#undef NATIVEHELPER_JNI_VALUE_OPS
+
+// Arrays are objects.
+template <>
+struct JniValueOps<'['> : JniValueOps<'L'> {};
+
+// Void is only a return type.
+template <>
+struct JniValueOps<'V'> {
+  using Type = void;
+
+  static void Default() {}
+
+  static void Call(JNIEnv* env, jobject object, jmethodID method, const jvalue* args) {
+    env->CallVoidMethodA(object, method, args);
+  }
+
+  static void CallNonvirtual(JNIEnv* env, jobject object, jclass klass, jmethodID method,
+                             const jvalue* args) {
+    env->CallNonvirtualVoidMethodA(object, klass, method, args);
+  }
+
+  static void CallStatic(JNIEnv* env, jclass klass, jmethodID method, const jvalue* args) {
+    env->CallStaticVoidMethodA(klass, method, args);
+  }
+};
+
+// Whether |class_name| is in the form accepted by FindClass, e.g. "java/lang/String".
+constexpr bool IsValidJniClassName(ConstexprStringView class_name) {
+  if (class_name.empty()) {
+    return false;
+  }
+  for (char c : class_name) {
+    if (c == '.' || c == ';') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether |field_descriptor| is a single non-void type descriptor, e.g. "I" or "[J".
+constexpr bool IsValidJniFieldDescriptor(ConstexprStringView field_descriptor) {
+  ConstexprOptional<ParseTypeDescriptorResult> result =
+      ParseSingleTypeDescriptor(field_descriptor, /*allow_void*/false);
+  return result.has_value() && result->has_token() && !result->has_remainder();
+}
+
+// The class and member id of a handle, resolved on first use.
+template <typename Descriptor, JniConstantKind kKind>
+class JniMemberIds {
+ public:
+  static jclass GetClass(JNIEnv* env) {
+    return GetTable().GetClass(env, kClassIndex);
+  }
+
+  static void* GetId(JNIEnv* env) {
+    JniConstantTable table = GetTable();
+    return kKind == JniConstantKind::kField || kKind == JniConstantKind::kStaticField
+        ? static_cast<void*>(table.GetField(env, kMemberIndex))
+        : static_cast<void*>(table.GetMethod(env, kMemberIndex));
+  }
+
+ private:
+  static_assert(IsValidJniClassName(Descriptor::kClassName),
+                "class names are given in the form java/lang/String");
+
+  enum : int { kClassIndex, kMemberIndex, kCount };
+
+  static constexpr JniConstantDescriptor kDescriptors[] = {
+    { JniConstantKind::kClass, -1, Descriptor::kClassName, nullptr },
+    { kKind, kClassIndex, Descriptor::kName, Descriptor::kSignature },
+  };
+
+  static inline std::atomic<void*> sValues[kCount] = {};
+  static inline std::atomic<uint32_t> sGeneration{0};
+
+  static constexpr JniConstantTable GetTable() {
+    return JniConstantTable(kDescriptors, sValues, kCount, &sGeneration);
+  }
+};
+
+// Parses the method descriptor of |Descriptor|. Malformed descriptors fail to compile.
+template <typename Descriptor>
+struct JniMethodSignature {
+  static constexpr auto kParsed =
+      ParseSignatureAsList<sizeof(Descriptor::kSignature)>(Descriptor::kSignature);
+
+  static constexpr size_t kArgCount = kParsed->args.size();
+
+  using ReturnOps = JniValueOps<kParsed->ret.longy[0]>;
+
+  template <size_t kIndex>
+  using ArgOps = JniValueOps<kParsed->args[kIndex].longy[0]>;
+
+  // Packs |args| into |values| according to the descriptor.
+  template <size_t... kIndices, typename... Args>
+  static void Pack(jvalue* values, std::index_sequence<kIndices...>, Args... args) {
+    static_assert(sizeof...(Args) == kArgCount,
+                  "the number of arguments does not match the method descriptor");
+    ((values[kIndices] = ArgOps<kIndices>::Pack(args)), ...);
+  }
+};
+
+// Common implementation of JniMethod and JniStaticMethod.
+template <typename Descriptor, JniConstantKind kKind>
+class JniMethodBase {
+ protected:
+  using Ids = JniMemberIds<Descriptor, kKind>;
+  using Signature = JniMethodSignature<Descriptor>;
+  using ReturnOps = typename Signature::ReturnOps;
+
+  // The packed arguments of a call. Holds one more value than needed so that
+  // calls without arguments do not declare an empty array.
+  struct Arguments {
+    template <typename... Args>
+    explicit Arguments(Args... args) {
+      Signature::Pack(values, std::index_sequence_for<Args...>(), args...);
+    }
+
+    jvalue values[Signature::kArgCount + 1];
+  };
+
+ public:
+  using ReturnType = typename ReturnOps::Type;
+
+  static jclass GetClass(JNIEnv* env) {
+    return Ids::GetClass(env);
+  }
+
+  static jmethodID GetMethodID(JNIEnv* env) {
+    return static_cast<jmethodID>(Ids::GetId(env));
+  }
+};
+
+}  // namespace detail
+
+// An instance method or constructor. See the comment at the top of this file.
+template <typename Descriptor>
+class JniMethod : public detail::JniMethodBase<Descriptor, JniConstantKind::kMethod> {
+  using Base = detail::JniMethodBase<Descriptor, JniConstantKind::kMethod>;
+  using typename Base::Arguments;
+  using typename Base::ReturnOps;
+
+ public:
+  using typename Base::ReturnType;
+
+  // Calls the method on |object|, dispatching virtually.
+  template <typename... Args>
+  static ReturnType Call(JNIEnv* env, jobject object, Args... args) {
+    Arguments arguments(args...);
+    jmethodID method = Base::GetMethodID(env);
+    if (method == nullptr) {
+      return ReturnOps::Default();
+    }
+    return ReturnOps::Call(env, object, method, arguments.values);
+  }
+
+  // Calls the method of the declaring class on |object|, as for a super call.
+  template <typename... Args>
+  static ReturnType CallNonvirtual(JNIEnv* env, jobject object, Args... args) {
+    Arguments arguments(args...);
+    jmethodID method = Base::GetMethodID(env);
+    if (method == nullptr) {
+      return ReturnOps::Default();
+    }
+    return ReturnOps::CallNonvirtual(env, object, Base::GetClass(env), method, arguments.values);
+  }
+
+  // Creates an instance of the declaring class with this constructor.
+  template <typename... Args>
+  static jobject NewObject(JNIEnv* env, Args... args) {
+    static_assert(detail::ConstexprStringView(Descriptor::kName) == "<init>",
+                  "NewObject() requires a constructor");
+    Arguments arguments(args...);
+    jmethodID method = Base::GetMethodID(env);
+    if (method == nullptr) {
+      return nullptr;
+    }
+    return env->NewObjectA(Base::GetClass(env), method, arguments.values);
+  }
+};
+
+// A static method. See the comment at the top of this file.
+template <typename Descriptor>
+class JniStaticMethod : public detail::JniMethodBase<Descriptor, JniConstantKind::kStaticMethod> {
+  using Base = detail::JniMethodBase<Descriptor, JniConstantKind::kStaticMethod>;
+  using typename Base::Arguments;
+  using typename Base::ReturnOps;
+
+ public:
+  using typename Base::ReturnType;
+
+  template <typename... Args>
+  static ReturnType Call(JNIEnv* env, Args... args) {
+    Arguments arguments(args...);
+    jmethodID method = Base::GetMethodID(env);
+    if (method == nullptr) {
+      return ReturnOps::Default();
+    }
+    return ReturnOps::CallStatic(env, Base::GetClass(env), method, arguments.values);
+  }
+};
+
+// An instance field. See the comment at the top of this file.
+template <typename Descriptor>
+class JniField {
+  static_assert(detail::IsValidJniFieldDescriptor(Descriptor::kSignature),
+                "field descriptors are a single non-void type, e.g. \"I\"");
+
+  using Ids = detail::JniMemberIds<Descriptor, JniConstantKind::kField>;
+  using Ops = detail::JniValueOps<Descriptor::kSignature[0]>;
+
+ public:
+  using ValueType = typename Ops::Type;
+
+  static jclass GetClass(JNIEnv* env) {
+    return Ids::GetClass(env);
+  }
+
+  static jfieldID GetFieldID(JNIEnv* env) {
+    return static_cast<jfieldID>(Ids::GetId(env));
+  }
+
+  static ValueType Get(JNIEnv* env, jobject object) {
+    jfieldID field = GetFieldID(env);
+    return field != nullptr ? Ops::Get(env, object, field) : Ops::Default();
+  }
+
+  template <typename T>
+  static void Set(JNIEnv* env, jobject object, T value) {
+    jfieldID field = GetFieldID(env);
+    if (field != nullptr) {
+      Ops::Set(env, object, field, ValueType{value});
+    }
+  }
+};
+
+// A static field. See the comment at the top of this file.
+template <typename Descriptor>
+class JniStaticField {
+  static_assert(detail::IsValidJniFieldDescriptor(Descriptor::kSignature),
+                "field descriptors are a single non-void type, e.g. \"I\"");
+
+  using Ids = detail::JniMemberIds<Descriptor, JniConstantKind::kStaticField>;
+  using Ops = detail::JniValueOps<Descriptor::kSignature[0]>;
+
+ public:
+  using ValueType = typename Ops::Type;
+
+  static jclass GetClass(JNIEnv* env) {
+    return Ids::GetClass(env);
+  }
+
+  static jfieldID GetFieldID(JNIEnv* env) {
+    return static_cast<jfieldID>(Ids::GetId(env));
+  }
+
+  static ValueType Get(JNIEnv* env) {
+    jfieldID field = GetFieldID(env);
+    return field != nullptr ? Ops::GetStatic(env, GetClass(env), field) : Ops::Default();
+  }
+
+  template <typename T>
+  static void Set(JNIEnv* env, T value) {
+    jfieldID field = GetFieldID(env);
+    if (field != nullptr) {
+      Ops::SetStatic(env, GetClass(env), field, ValueType{value});
+    }
+  }
+};
+
+}  // namespace nativehelper
+
+// Declares |name| as a handle for a member of |class_name|, e.g.
+//     JNI_METHOD(ObjectHashCode, "java/lang/Object", "hashCode", "()I");
+// declares nativehelper::JniMethod ObjectHashCode. Use at namespace or class scope.
+#define JNI_METHOD(name, class_name, method_name, descriptor) \
+  _NATIVEHELPER_JNI_MEMBER(JniMethod, name, class_name, method_name, descriptor)
+
+#define JNI_STATIC_METHOD(name, class_name, method_name, descriptor) \
+  _NATIVEHELPER_JNI_MEMBER(JniStaticMethod, name, class_name, method_name, descriptor)
+
+#define JNI_FIELD(name, class_name, field_name, descriptor) \
+  _NATIVEHELPER_JNI_MEMBER(JniField, name, class_name, field_name, descriptor)
+
+#define JNI_STATIC_FIELD(name, class_name, field_name, descriptor) \
+  _NATIVEHELPER_JNI_MEMBER(JniStaticField, name, class_name, field_name, descriptor)
+
+////////////////////////////////////////////////////////
+//                IMPLEMENTATION ONLY.
+//                DO NOT USE DIRECTLY.
+////////////////////////////////////////////////////////
+
+#define _NATIVEHELPER_JNI_MEMBER(kind, name, class_name, member_name, descriptor) \
+  struct name##_JniDescriptor {                                                   \
+    static constexpr const char kClassName[] = class_name;                        \
+    static constexpr const char kName[] = member_name;                            \
+    static constexpr const char kSignature[] = descriptor;                        \
+  };                                                                              \
+  using name = ::nativehelper::kind<name##_JniDescriptor>
+
+#endif  // LIBNATIVEHELPER_PLATFORM_INCLUDE_NATIVEHELPER_JNI_MEMBERS_H_
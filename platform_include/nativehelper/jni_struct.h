@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Copies C++ structs to and from the fields of Java objects.
+ *
+ * A struct is mapped to a Java class once, listing the fields to copy:
+ *
+ *     struct Rect {
+ *       jint left;
+ *       jint top;
+ *       jint right;
+ *       jint bottom;
+ *     };
+ *
+ *     JNI_STRUCT(RectMarshaller, Rect, "android/graphics/Rect",
+ *                JNI_STRUCT_FIELD(left, "I"),
+ *                JNI_STRUCT_FIELD(top, "I"),
+ *                JNI_STRUCT_FIELD(right, "I"),
+ *                JNI_STRUCT_FIELD(bottom, "I"));
+ *
+ * after which whole objects are copied with one call:
+ *
+ *     Rect rect;
+ *     if (!RectMarshaller::Read(env, javaRect, &rect)) {
+ *       return;  // Exception pending.
+ *     }
+ *     rect.right += 10;
+ *     RectMarshaller::Write(env, rect, javaRect);
+ *     jobject copy = RectMarshaller::New(env, rect);
+ *
+ * JNI_STRUCT_FIELD_AS(member, "javaName", descriptor) maps a member to a field with a different
+ * name.
+ *
+ * Each descriptor must be the exact JNI type of its member, as for JNI_NATIVE_METHOD: "I" for a
+ * jint, "Ljava/lang/String;" for a jstring, any object type for a jobject, and so on. A mismatch
+ * is a compile-time error. Object fields are read as local references owned by the caller.
+ *
+ * The class, its field ids and its no-argument constructor are looked up the first time they are
+ * needed and cached until the JniConstantTableRegistry of the library is cleared, as for the
+ * handles of jni_members.h. If any of them cannot be found, the call returns
+ * false or null with an exception pending and the object is left unchanged.
+ */
+
+#ifndef LIBNATIVEHELPER_PLATFORM_INCLUDE_NATIVEHELPER_JNI_STRUCT_H_
+#define LIBNATIVEHELPER_PLATFORM_INCLUDE_NATIVEHELPER_JNI_STRUCT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <jni.h>
+
+#include "nativehelper/detail/signature_checker.h"
+#include "nativehelper/jni_constants_table.h"
+#include "nativehelper/jni_members.h"
+
+namespace nativehelper {
+namespace detail {
+
+// One member of a struct and the Java field it is copied to and from.
+template <typename Struct, typename Member>
+struct JniStructField {
+  using MemberType = Member;
+
+  Member Struct::* member;
+  const char* name;
+  const char* descriptor;
+  size_t descriptor_size;
+
+  constexpr ConstexprStringView GetDescriptor() const {
+    return ConstexprStringView(descriptor, descriptor_size);
+  }
+};
+
+template <typename Struct, typename Member, size_t kDescriptorSize>
+constexpr JniStructField<Struct, Member> MakeJniStructField(
+    Member Struct::* member, const char* name, const char (&descriptor)[kDescriptorSize]) {
+  return {member, name, descriptor, kDescriptorSize - 1};
+}
+
+// Whether |field| is a valid field descriptor for the C++ type of its member.
+template <typename Field>
+constexpr bool IsValidJniStructField(const Field& field) {
+  using Member = typename Field::MemberType;
+  return IsValidJniFieldDescriptor(field.GetDescriptor()) &&
+      CompareJniDescriptorNodeErased(JniDescriptorNode(field.GetDescriptor()),
+                                     ReifiedJniTypeTrait::Reify<Member>());
+}
+
+template <typename Descriptor, size_t... kIndices>
+constexpr bool AreValidJniStructFields(std::index_sequence<kIndices...>) {
+  return (IsValidJniStructField(std::get<kIndices>(Descriptor::kFields)) && ...);
+}
+
+// The layout of the constants table of a struct: its class, its constructor, then one entry per
+// field in the order they were listed.
+enum : int {
+  kJniStructClassIndex,
+  kJniStructInitIndex,
+  kJniStructFirstFieldIndex,
+};
+
+template <typename Descriptor, size_t... kIndices>
+constexpr std::array<JniConstantDescriptor, sizeof...(kIndices) + kJniStructFirstFieldIndex>
+MakeJniStructDescriptors(std::index_sequence<kIndices...>) {
+  return {{
+    { JniConstantKind::kClass, -1, Descriptor::kClassName, nullptr },
+    { JniConstantKind::kMethod, kJniStructClassIndex, "<init>", "()V" },
+    { JniConstantKind::kField, kJniStructClassIndex,
+      std::get<kIndices>(Descriptor::kFields).name,
+      std::get<kIndices>(Descriptor::kFields).descriptor }...,
+  }};
+}
+
+}  // namespace detail
+
+// Copies the struct described by |Descriptor| to and from Java objects. See the comment at the
+// top of this file.
+template <typename Descriptor>
+class JniStruct {
+ public:
+  using Type = typename Descriptor::Type;
+
+  static constexpr size_t kFieldCount = std::tuple_size_v<decltype(Descriptor::kFields)>;
+
+  static_assert(kFieldCount > 0, "a struct must map at least one field");
+  static_assert(detail::IsValidJniClassName(Descriptor::kClassName),
+                "class names are given in the form java/lang/String");
+  static_assert(detail::AreValidJniStructFields<Descriptor>(
+                    std::make_index_sequence<kFieldCount>()),
+                "each field descriptor must be the JNI type of its member, e.g. \"I\" for jint");
+
+  static jclass GetClass(JNIEnv* env) {
+    return GetTable().GetClass(env, detail::kJniStructClassIndex);
+  }
+
+  // Copies the fields of |object| to |out|.
+  static bool Read(JNIEnv* env, jobject object, Type* out) {
+    jfieldID ids[kFieldCount];
+    if (!GetFieldIds(env, ids)) {
+      return false;
+    }
+    ReadFields(env, object, out, ids, std::make_index_sequence<kFieldCount>());
+    return true;
+  }
+
+  // Copies |in| to the fields of |object|.
+  static bool Write(JNIEnv* env, const Type& in, jobject object) {
+    jfieldID ids[kFieldCount];
+    if (!GetFieldIds(env, ids)) {
+      return false;
+    }
+    WriteFields(env, in, object, ids, std::make_index_sequence<kFieldCount>());
+    return true;
+  }
+
+  // Creates an object with the class's no-argument constructor and copies |in| to its fields.
+  static jobject New(JNIEnv* env, const Type& in) {
+    jfieldID ids[kFieldCount];
+    if (!GetFieldIds(env, ids)) {
+      return nullptr;
+    }
+    jmethodID init = GetTable().GetMethod(env, detail::kJniStructInitIndex);
+    if (init == nullptr) {
+      return nullptr;
+    }
+    jobject object = env->NewObject(GetClass(env), init);
+    if (object != nullptr) {
+      WriteFields(env, in, object, ids, std::make_index_sequence<kFieldCount>());
+    }
+    return object;
+  }
+
+ private:
+  static constexpr auto kDescriptors =
+      detail::MakeJniStructDescriptors<Descriptor>(std::make_index_sequence<kFieldCount>());
+
+  static inline std::atomic<void*> sValues[kDescriptors.size()] = {};
+  static inline std::atomic<uint32_t> sGeneration{0};
+
+  static constexpr JniConstantTable GetTable() {
+    return JniConstantTable(kDescriptors.data(), sValues, kDescriptors.size(), &sGeneration);
+  }
+
+  // Fetches every field id, stopping at the first that cannot be resolved so that no JNI call
+  // is made with its exception pending.
+  static bool GetFieldIds(JNIEnv* env, jfieldID* ids) {
+    JniConstantTable table = GetTable();
+    for (size_t i = 0; i < kFieldCount; ++i) {
+      ids[i] = table.GetField(env, detail::kJniStructFirstFieldIndex + static_cast<int>(i));
+      if (ids[i] == nullptr) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <size_t kIndex>
+  using MemberType = typename std::tuple_element_t<
+      kIndex, std::remove_cv_t<decltype(Descriptor::kFields)>>::MemberType;
+
+  template <size_t kIndex>
+  using FieldOps = detail::JniValueOps<std::get<kIndex>(Descriptor::kFields).descriptor[0]>;
+
+  template <size_t... kIndices>
+  static void ReadFields(JNIEnv* env, jobject object, Type* out, const jfieldID* ids,
+                         std::index_sequence<kIndices...>) {
+    ((out->*std::get<kIndices>(Descriptor::kFields).member = static_cast<MemberType<kIndices>>(
+          FieldOps<kIndices>::Get(env, object, ids[kIndices]))),
+     ...);
+  }
+
+  template <size_t... kIndices>
+  static void WriteFields(JNIEnv* env, const Type& in, jobject object, const jfieldID* ids,
+                          std::index_sequence<kIndices...>) {
+    (FieldOps<kIndices>::Set(env, object, ids[kIndices],
+                             in.*std::get<kIndices>(Descriptor::kFields).member),
+     ...);
+  }
+};
+
+}  // namespace nativehelper
+
+// Declares |name| as the JniStruct copying |type| to and from objects of |class_name|. The
+// remaining arguments are JNI_STRUCT_FIELD or JNI_STRUCT_FIELD_AS. Use at namespace scope.
+#define JNI_STRUCT(name, type, class_name, ...)                 \
+  struct name##_JniStructDescriptor {                           \
+    using Type = type;                                          \
+    static constexpr const char kClassName[] = class_name;      \
+    static constexpr auto kFields = std::make_tuple(__VA_ARGS__); \
+  };                                                            \
+  using name = ::nativehelper::JniStruct<name##_JniStructDescriptor>
+
+// Maps |member| to the Java field of the same name with type |descriptor|, e.g. "F".
+#define JNI_STRUCT_FIELD(member, descriptor) \
+  JNI_STRUCT_FIELD_AS(member, #member, descriptor)
+
+// Maps |member| to the Java field |field_name| with type |descriptor|.
+#define JNI_STRUCT_FIELD_AS(member, field_name, descriptor) \
+  ::nativehelper::detail::MakeJniStructField(&Type::member, field_name, descriptor)
+
+#endif  // LIBNATIVEHELPER_PLATFORM_INCLUDE_NATIVEHELPER_JNI_STRUCT_H_
@@ -0,0 +1,1037 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nativehelper/JNIHelp.h>
+#include <nativehelper/jni_field_columns.h>
+#include <nativehelper/toStringArray.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android/log.h>
+#include <gtest/gtest.h>
+#include <nativehelper/jni_gtest.h>
+
+namespace android {
+
+namespace {
+
+// Stubs the functions JniConstants needs to resolve its classes, fields and methods.
+void StubJniConstants(JNINativeInterface* functions) {
+    functions->FindClass = [](JNIEnv*, const char*) { return FakeRef<jclass>(0x100); };
+    functions->NewGlobalRef = [](JNIEnv*, jobject obj) { return obj; };
+    functions->DeleteLocalRef = [](JNIEnv*, jobject) {};
+    functions->GetFieldID = [](JNIEnv*, jclass, const char*, const char*) {
+        return FakeRef<jfieldID>(0x200);
+    };
+    functions->GetMethodID = [](JNIEnv*, jclass, const char*, const char*) {
+        return FakeRef<jmethodID>(0x300);
+    };
+    functions->GetStaticMethodID = [](JNIEnv*, jclass, const char*, const char*) {
+        return FakeRef<jmethodID>(0x400);
+    };
+}
+
+}  // namespace
+
+class JNIHelpTest : public InstrumentedJNITestBase {
+protected:
+    void SetUp() override {
+        InstrumentedJNITestBase::SetUp();
+        // Constants may have been cached from the environment of an earlier test.
+        jniUninitializeConstants();
+        StubJniConstants(GetMockFunctions());
+    }
+};
+
+TEST_F(JNIHelpTest, GetNioBufferFieldsCallBudget) {
+    GetMockFunctions()->GetIntField = [](JNIEnv*, jobject, jfieldID) { return 0; };
+    GetMockFunctions()->GetLongField = [](JNIEnv*, jobject, jfieldID) { return jlong(0); };
+
+    jobject buffer = FakeRef<jobject>(0x500);
+    jint position, limit, elementSizeShift;
+    jniGetNioBufferFields(env_, buffer, &position, &limit, &elementSizeShift);
+
+    // Once the field ids are cached, only the four field reads should remain.
+    GetCallStats().Reset();
+    jniGetNioBufferFields(env_, buffer, &position, &limit, &elementSizeShift);
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::GetIntField));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetLongField));
+    EXPECT_EQ(4u, GetCallStats().GetTotalCallCount());
+}
+
+TEST_F(JNIHelpTest, ConstantsAreResolvedIndividually) {
+    GetMockFunctions()->GetIntField = [](JNIEnv*, jobject, jfieldID) { return 0; };
+    GetMockFunctions()->GetLongField = [](JNIEnv*, jobject, jfieldID) { return jlong(0); };
+
+    // Only java.nio.Buffer and the four fields read should be looked up.
+    jint position, limit, elementSizeShift;
+    jniGetNioBufferFields(env_, FakeRef<jobject>(0x500), &position, &limit, &elementSizeShift);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(4u, GetCallStats().GetCallCount(&JNINativeInterface::GetFieldID));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetMethodID));
+}
+
+TEST_F(JNIHelpTest, ConcurrentFirstUseOfConstants) {
+    static std::atomic<size_t> findClassCalls;
+    static std::atomic<size_t> globalRefsDeleted;
+    findClassCalls = 0;
+    globalRefsDeleted = 0;
+
+    // Each thread gets its own JNIEnv, as it would from a VM. The instrumented
+    // environment of the fixture is not thread-safe.
+    JNINativeInterface functions = {};
+    StubJniConstants(&functions);
+    functions.FindClass = [](JNIEnv*, const char*) {
+        findClassCalls++;
+        return FakeRef<jclass>(0x100);
+    };
+    functions.DeleteGlobalRef = [](JNIEnv*, jobject) { globalRefsDeleted++; };
+    functions.GetIntField = [](JNIEnv*, jobject, jfieldID field) {
+        return field == FakeRef<jfieldID>(0x200) ? 3 : -1;
+    };
+    functions.GetLongField = [](JNIEnv*, jobject, jfieldID field) {
+        return field == FakeRef<jfieldID>(0x200) ? jlong(4096) : jlong(-1);
+    };
+
+    constexpr int kThreads = 64;
+    constexpr int kIterations = 1000;
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; ++i) {
+        threads.emplace_back([&functions, &failures]() {
+            JNIEnv threadEnv;
+            threadEnv.functions = &functions;
+            jobject object = FakeRef<jobject>(0x500);
+            for (int j = 0; j < kIterations; ++j) {
+                jint position, limit, elementSizeShift;
+                if (jniGetFDFromFileDescriptor(&threadEnv, object) != 3 ||
+                    jniGetNioBufferFields(&threadEnv, object, &position, &limit,
+                                          &elementSizeShift) != 4096) {
+                    failures++;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(0, failures.load());
+
+    // Racing threads may each look up a class, but only one reference is kept.
+    EXPECT_GE(findClassCalls.load(), 2u);
+    EXPECT_EQ(findClassCalls.load() - 2u, globalRefsDeleted.load());
+}
+
+TEST_F(JNIHelpTest, PrewarmConstantsResolvesSelectedGroups) {
+    GetMockFunctions()->GetIntField = [](JNIEnv*, jobject, jfieldID) { return 0; };
+    GetMockFunctions()->GetLongField = [](JNIEnv*, jobject, jfieldID) { return jlong(0); };
+
+    EXPECT_EQ(0, jniPrewarmConstants(env_, JNI_CONSTANTS_NIO_BUFFER));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+
+    GetCallStats().Reset();
+    jint position, limit, elementSizeShift;
+    jniGetNioBufferFields(env_, FakeRef<jobject>(0x500), &position, &limit, &elementSizeShift);
+    EXPECT_EQ(4u, GetCallStats().GetTotalCallCount());
+}
+
+TEST_F(JNIHelpTest, RecordConstantsReportsGroupsUsed) {
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->ThrowNew = [](JNIEnv*, jclass, const char*) -> jint { return JNI_OK; };
+    GetMockFunctions()->GetIntField = [](JNIEnv*, jobject, jfieldID) { return 0; };
+    GetMockFunctions()->GetLongField = [](JNIEnv*, jobject, jfieldID) { return jlong(0); };
+
+    jniStartRecordingConstants();
+    jniThrowNullPointerException(env_, "null");
+    jint position, limit, elementSizeShift;
+    jniGetNioBufferFields(env_, FakeRef<jobject>(0x500), &position, &limit, &elementSizeShift);
+    EXPECT_EQ(JNI_CONSTANTS_NULL_POINTER_EXCEPTION | JNI_CONSTANTS_NIO_BUFFER,
+              jniStopRecordingConstants());
+
+    jniThrowRuntimeException(env_, "not recorded");
+    jniStartRecordingConstants();
+    EXPECT_EQ(0u, jniStopRecordingConstants());
+}
+
+TEST_F(JNIHelpTest, DestroyJavaVMDeletesCachedClasses) {
+    static JNIEnv* vmEnv;
+    static JNIInvokeInterface invokeFunctions;
+    static JavaVM vm;
+    vmEnv = env_;
+    invokeFunctions.GetEnv = [](JavaVM*, void** env, jint) -> jint {
+        *env = vmEnv;
+        return JNI_OK;
+    };
+    invokeFunctions.DestroyJavaVM = [](JavaVM*) -> jint { return JNI_OK; };
+    vm.functions = &invokeFunctions;
+    GetMockFunctions()->GetJavaVM = [](JNIEnv*, JavaVM** result) -> jint {
+        *result = &vm;
+        return JNI_OK;
+    };
+    GetMockFunctions()->DeleteGlobalRef = [](JNIEnv*, jobject) {};
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->ThrowNew = [](JNIEnv*, jclass, const char*) -> jint { return JNI_OK; };
+
+    // Libraries caching constants of their own are told to release them too.
+    static std::vector<C_JNIEnv*> hookEnvs;
+    static int hookData;
+    auto hook = [](C_JNIEnv* env, void* data) {
+        EXPECT_EQ(&hookData, data);
+        hookEnvs.push_back(env);
+    };
+    EXPECT_EQ(0, jniRegisterConstantsReleaseHook(hook, &hookData));
+    EXPECT_EQ(0, jniRegisterConstantsReleaseHook(hook, &hookData));
+
+    jniThrowNullPointerException(env_, "null");
+    jniThrowRuntimeException(env_, "runtime");
+    uint32_t generation = jniGetConstantsGeneration();
+
+    GetCallStats().Reset();
+    EXPECT_EQ(JNI_OK, JniInvocationDestroyJavaVM(&vm));
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::DeleteGlobalRef));
+    EXPECT_NE(generation, jniGetConstantsGeneration());
+    ASSERT_EQ(1u, hookEnvs.size());
+    EXPECT_EQ(reinterpret_cast<C_JNIEnv*>(env_), hookEnvs[0]);
+
+    // The classes are looked up again for the next VM.
+    jniThrowNullPointerException(env_, "null");
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+
+    // Uninitializing abandons the references, so the hooks get no env.
+    jniUninitializeConstants();
+    ASSERT_EQ(2u, hookEnvs.size());
+    EXPECT_EQ(nullptr, hookEnvs[1]);
+}
+
+TEST_F(JNIHelpTest, ToStringArrayDoesNotLeakLocalRefs) {
+    GetMockFunctions()->NewObjectArray = [](JNIEnv*, jsize, jclass, jobject) {
+        return FakeRef<jobjectArray>(0x600);
+    };
+    GetMockFunctions()->NewStringUTF = [](JNIEnv*, const char*) {
+        return FakeRef<jstring>(0x700);
+    };
+    GetMockFunctions()->SetObjectArrayElement = [](JNIEnv*, jobjectArray, jsize, jobject) {};
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+
+    const char* const strings[] = { "a", "b", "c", nullptr };
+    toStringArray(env_, strings);
+
+    GetCallStats().Reset();
+    jobjectArray result = toStringArray(env_, strings);
+    EXPECT_NE(nullptr, result);
+
+    // Only the returned array should still be live.
+    EXPECT_EQ(4u, GetCallStats().GetLocalRefsCreated());
+    EXPECT_EQ(1, GetCallStats().GetLiveLocalRefs());
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::NewStringUTF));
+}
+
+namespace {
+
+// Objects of the fake array used by the field column tests: object i is 0x1000 + 16 * i, its
+// float field x is i, its float field y is -i and its int field id is 100 + i.
+constexpr jsize kFakeArrayLength = 150;
+jfloat gPointX[kFakeArrayLength];
+jint gPointId[kFakeArrayLength];
+
+jsize FakeObjectIndex(jobject object) {
+    return static_cast<jsize>((reinterpret_cast<uintptr_t>(object) - 0x1000) / 16);
+}
+
+void StubFieldColumns(JNINativeInterface* functions) {
+    for (jsize i = 0; i < kFakeArrayLength; ++i) {
+        gPointX[i] = static_cast<jfloat>(i);
+        gPointId[i] = 100 + i;
+    }
+    functions->PushLocalFrame = [](JNIEnv*, jint) { return JNI_OK; };
+    functions->PopLocalFrame = [](JNIEnv*, jobject) { return static_cast<jobject>(nullptr); };
+    functions->GetArrayLength = [](JNIEnv*, jarray) { return kFakeArrayLength; };
+    functions->GetObjectArrayElement = [](JNIEnv*, jobjectArray, jsize index) {
+        return FakeRef<jobject>(0x1000 + 16 * index);
+    };
+    functions->GetFloatField = [](JNIEnv*, jobject object, jfieldID field) {
+        jsize i = FakeObjectIndex(object);
+        return field == FakeRef<jfieldID>(0x210) ? gPointX[i] : -gPointX[i];
+    };
+    functions->GetIntField = [](JNIEnv*, jobject object, jfieldID) {
+        return gPointId[FakeObjectIndex(object)];
+    };
+    functions->SetFloatField = [](JNIEnv*, jobject object, jfieldID, jfloat value) {
+        gPointX[FakeObjectIndex(object)] = value;
+    };
+    functions->SetIntField = [](JNIEnv*, jobject object, jfieldID, jint value) {
+        gPointId[FakeObjectIndex(object)] = value;
+    };
+}
+
+}  // namespace
+
+TEST_F(JNIHelpTest, GetFieldColumns) {
+    StubFieldColumns(GetMockFunctions());
+    jobjectArray points = FakeRef<jobjectArray>(0x600);
+
+    constexpr jsize kCount = 140;
+    jfloat x[kCount];
+    jfloat y[kCount];
+    jint id[kCount];
+    const JniFieldColumn columns[] = {
+        JniFieldColumn(FakeRef<jfieldID>(0x210), x),
+        JniFieldColumn(FakeRef<jfieldID>(0x220), y),
+        JniFieldColumn(FakeRef<jfieldID>(0x230), id),
+    };
+    ASSERT_TRUE(jniGetFieldColumns(env_, points, 5, kCount, columns, 3));
+    for (jsize i = 0; i < kCount; ++i) {
+        EXPECT_EQ(static_cast<jfloat>(5 + i), x[i]);
+        EXPECT_EQ(-static_cast<jfloat>(5 + i), y[i]);
+        EXPECT_EQ(105 + i, id[i]);
+    }
+
+    // Each object is fetched once, in chunks that do not outlive their frames.
+    EXPECT_EQ(static_cast<size_t>(kCount),
+              GetCallStats().GetCallCount(&JNINativeInterface::GetObjectArrayElement));
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::PushLocalFrame));
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::PopLocalFrame));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::DeleteLocalRef));
+    EXPECT_EQ(0, GetCallStats().GetLiveLocalRefs());
+}
+
+TEST_F(JNIHelpTest, SetFieldColumns) {
+    StubFieldColumns(GetMockFunctions());
+    jobjectArray points = FakeRef<jobjectArray>(0x600);
+
+    jfloat x[] = { 0.5f, 1.5f, 2.5f };
+    jint id[] = { 7, 8, 9 };
+    const JniFieldColumn columns[] = {
+        JniFieldColumn(FakeRef<jfieldID>(0x210), x),
+        JniFieldColumn(FakeRef<jfieldID>(0x230), id),
+    };
+    ASSERT_TRUE(jniSetFieldColumns(env_, points, 147, 3, columns, 2));
+    EXPECT_EQ(146.0f, gPointX[146]);
+    EXPECT_EQ(0.5f, gPointX[147]);
+    EXPECT_EQ(2.5f, gPointX[149]);
+    EXPECT_EQ(8, gPointId[148]);
+    EXPECT_EQ(0, GetCallStats().GetLiveLocalRefs());
+}
+
+TEST_F(JNIHelpTest, FieldColumnsRejectOutOfBoundsRanges) {
+    static std::vector<std::string> messages;
+    messages.clear();
+    StubFieldColumns(GetMockFunctions());
+    GetMockFunctions()->ThrowNew = [](JNIEnv*, jclass, const char* message) {
+        messages.push_back(message);
+        return JNI_OK;
+    };
+    jobjectArray points = FakeRef<jobjectArray>(0x600);
+
+    jfloat x[2];
+    const JniFieldColumn column(FakeRef<jfieldID>(0x210), x);
+    EXPECT_FALSE(jniGetFieldColumns(env_, points, kFakeArrayLength - 1, 2, &column, 1));
+    EXPECT_FALSE(jniGetFieldColumns(env_, points, -1, 1, &column, 1));
+    ASSERT_EQ(2u, messages.size());
+    EXPECT_EQ("length=150; regionStart=149; regionLength=2", messages[0]);
+    EXPECT_EQ("length=150; regionStart=-1; regionLength=1", messages[1]);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetObjectArrayElement));
+}
+
+TEST_F(JNIHelpTest, ThrowCommonExceptionsWithoutClassLookup) {
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->ThrowNew = [](JNIEnv*, jclass, const char*) -> jint { return JNI_OK; };
+
+    jniThrowNullPointerException(env_, "warm up");
+    jniThrowRuntimeException(env_, "warm up");
+    jniThrowException(env_, "java/lang/IllegalStateException", "warm up");
+
+    GetCallStats().Reset();
+    EXPECT_EQ(0, jniThrowNullPointerException(env_, "null"));
+    EXPECT_EQ(0, jniThrowRuntimeException(env_, "runtime"));
+    EXPECT_EQ(0, jniThrowException(env_, "java/lang/IllegalStateException", "state"));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::ThrowNew));
+}
+
+TEST_F(JNIHelpTest, ThrowExceptionFmtDoesNotTruncate) {
+    static std::string thrownMessage;
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->ThrowNew = [](JNIEnv*, jclass, const char* msg) -> jint {
+        thrownMessage = msg;
+        return JNI_OK;
+    };
+
+    std::string path(1000, 'x');
+    EXPECT_EQ(0, jniThrowExceptionFmt(env_, "java/io/IOException", "open %s at %d failed",
+                                      path.c_str(), 4096));
+    EXPECT_EQ("open " + path + " at 4096 failed", thrownMessage);
+
+    EXPECT_EQ(0, jniThrowExceptionFmt(env_, FakeRef<jclass>(0x40), "offset %d", 7));
+    EXPECT_EQ("offset 7", thrownMessage);
+}
+
+TEST_F(JNIHelpTest, ThrowErrnoExceptionPassesErrnoThrough) {
+    static jint constructedErrno;
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->NewStringUTF = [](JNIEnv*, const char*) {
+        return FakeRef<jstring>(0x50);
+    };
+    GetMockFunctions()->NewObjectV = [](JNIEnv*, jclass, jmethodID, va_list args) {
+        va_arg(args, jstring);
+        constructedErrno = va_arg(args, jint);
+        return FakeRef<jobject>(0x60);
+    };
+    GetMockFunctions()->Throw = [](JNIEnv*, jthrowable) -> jint { return JNI_OK; };
+
+    jniThrowErrnoException(env_, "recvfrom", EAGAIN);
+
+    GetCallStats().Reset();
+    EXPECT_EQ(0, jniThrowErrnoException(env_, "recvfrom", ECONNRESET));
+    EXPECT_EQ(ECONNRESET, constructedErrno);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::Throw));
+}
+
+TEST_F(JNIHelpTest, ThrowErrnoExceptionWithoutFunctionName) {
+    static std::string thrownMessage;
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->ExceptionClear = [](JNIEnv*) {};
+    // No android.system.ErrnoException, so an IOException is thrown instead.
+    GetMockFunctions()->FindClass = [](JNIEnv*, const char* name) {
+        return strcmp(name, "android/system/ErrnoException") == 0 ? nullptr
+                                                                  : FakeRef<jclass>(0x100);
+    };
+    GetMockFunctions()->NewStringUTF = [](JNIEnv*, const char* chars) {
+        thrownMessage = chars;
+        return FakeRef<jstring>(0x50);
+    };
+    GetMockFunctions()->NewObjectV = [](JNIEnv*, jclass, jmethodID, va_list) {
+        return FakeRef<jobject>(0x60);
+    };
+    GetMockFunctions()->Throw = [](JNIEnv*, jthrowable) -> jint { return JNI_OK; };
+
+    EXPECT_EQ(0, jniThrowErrnoException(env_, nullptr, EBADF));
+    EXPECT_EQ(std::string("(null) failed: ") + strerror(EBADF), thrownMessage);
+}
+
+namespace {
+
+// The arguments passed to the constructor of a preallocated exception.
+jclass gConstructedClass;
+jmethodID gConstructor;
+jstring gConstructedMessage;
+jthrowable gConstructedCause;
+int gConstructedEnableSuppression;
+int gConstructedWritableStackTrace;
+
+void RecordConstructorArgs(jmethodID constructor, va_list args) {
+    gConstructor = constructor;
+    gConstructedMessage = va_arg(args, jstring);
+    gConstructedCause = va_arg(args, jthrowable);
+    gConstructedEnableSuppression = va_arg(args, int);
+    gConstructedWritableStackTrace = va_arg(args, int);
+}
+
+void StubPreallocatedException(JNINativeInterface* functions) {
+    gConstructedClass = nullptr;
+    gConstructor = nullptr;
+    gConstructedMessage = nullptr;
+    gConstructedCause = FakeRef<jthrowable>(0x1);
+    gConstructedEnableSuppression = -1;
+    gConstructedWritableStackTrace = -1;
+    functions->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    functions->NewStringUTF = [](JNIEnv*, const char*) { return FakeRef<jstring>(0x50); };
+    functions->NewObjectV = [](JNIEnv*, jclass clazz, jmethodID init, va_list args) {
+        gConstructedClass = clazz;
+        RecordConstructorArgs(init, args);
+        return FakeRef<jobject>(0x60);
+    };
+    functions->AllocObject = [](JNIEnv*, jclass) { return FakeRef<jobject>(0x70); };
+    functions->CallNonvirtualVoidMethodV = [](JNIEnv*, jobject, jclass clazz, jmethodID init,
+                                              va_list args) {
+        gConstructedClass = clazz;
+        RecordConstructorArgs(init, args);
+    };
+}
+
+}  // namespace
+
+TEST_F(JNIHelpTest, PreallocatedExceptionUsesOwnConstructor) {
+    StubPreallocatedException(GetMockFunctions());
+    GetMockFunctions()->GetMethodID = [](JNIEnv*, jclass, const char* name, const char* sig) {
+        EXPECT_STREQ("<init>", name);
+        EXPECT_STREQ("(Ljava/lang/String;Ljava/lang/Throwable;ZZ)V", sig);
+        return FakeRef<jmethodID>(0x500);
+    };
+    GetMockFunctions()->Throw = [](JNIEnv*, jthrowable) -> jint { return JNI_OK; };
+
+    jthrowable exception =
+            jniCreatePreallocatedException(env_, FakeRef<jclass>(0x40), "would block");
+    EXPECT_EQ(FakeRef<jthrowable>(0x60), exception);
+    // Created with no cause, and with suppression and the stack trace disabled.
+    EXPECT_EQ(FakeRef<jclass>(0x40), gConstructedClass);
+    EXPECT_EQ(FakeRef<jmethodID>(0x500), gConstructor);
+    EXPECT_EQ(FakeRef<jstring>(0x50), gConstructedMessage);
+    EXPECT_EQ(nullptr, gConstructedCause);
+    EXPECT_EQ(JNI_FALSE, gConstructedEnableSuppression);
+    EXPECT_EQ(JNI_FALSE, gConstructedWritableStackTrace);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::AllocObject));
+
+    // A pending exception is cleared without being looked at.
+    static size_t exceptionsCleared;
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_TRUE; };
+    GetMockFunctions()->ExceptionClear = [](JNIEnv*) { exceptionsCleared++; };
+    exceptionsCleared = 0;
+    GetCallStats().Reset();
+    EXPECT_EQ(0, jniThrowPreallocatedException(env_, exception));
+    EXPECT_EQ(1u, exceptionsCleared);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::Throw));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::ThrowNew));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::ExceptionOccurred));
+}
+
+TEST_F(JNIHelpTest, PreallocatedExceptionFallsBackToThrowableConstructor) {
+    StubPreallocatedException(GetMockFunctions());
+    // The exception class does not declare the constructor, but Throwable does.
+    GetMockFunctions()->GetMethodID = [](JNIEnv*, jclass clazz, const char*, const char*) {
+        return clazz == FakeRef<jclass>(0x40) ? nullptr : FakeRef<jmethodID>(0x300);
+    };
+    GetMockFunctions()->ExceptionClear = [](JNIEnv*) {};
+
+    jthrowable exception =
+            jniCreatePreallocatedException(env_, FakeRef<jclass>(0x40), "would block");
+    EXPECT_EQ(FakeRef<jthrowable>(0x70), exception);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::ExceptionClear));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::NewObjectV));
+    // The Throwable constructor ran on the allocated instance, non-virtually.
+    EXPECT_EQ(FakeRef<jclass>(0x100), gConstructedClass);
+    EXPECT_EQ(FakeRef<jmethodID>(0x300), gConstructor);
+    EXPECT_EQ(FakeRef<jstring>(0x50), gConstructedMessage);
+    EXPECT_EQ(nullptr, gConstructedCause);
+    EXPECT_EQ(JNI_FALSE, gConstructedEnableSuppression);
+    EXPECT_EQ(JNI_FALSE, gConstructedWritableStackTrace);
+}
+
+TEST_F(JNIHelpTest, ChainedExceptionUsesPendingExceptionAsCause) {
+    static jthrowable constructedCause;
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->ExceptionOccurred = [](JNIEnv*) { return FakeRef<jthrowable>(0x70); };
+    GetMockFunctions()->ExceptionClear = [](JNIEnv*) {};
+    GetMockFunctions()->NewStringUTF = [](JNIEnv*, const char*) {
+        return FakeRef<jstring>(0x50);
+    };
+    GetMockFunctions()->NewObjectV = [](JNIEnv*, jclass, jmethodID, va_list args) {
+        va_arg(args, jstring);
+        constructedCause = va_arg(args, jthrowable);
+        return FakeRef<jobject>(0x60);
+    };
+    GetMockFunctions()->Throw = [](JNIEnv*, jthrowable) -> jint { return JNI_OK; };
+
+    jniThrowChainedException(env_, "java/io/IOException", "warm up");
+
+    constructedCause = nullptr;
+    GetCallStats().Reset();
+    EXPECT_EQ(0, jniThrowChainedException(env_, "java/io/IOException", "read failed"));
+    EXPECT_EQ(FakeRef<jthrowable>(0x70), constructedCause);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::AllocObject));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetObjectClass));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetStringUTFChars));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetMethodID));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::Throw));
+}
+
+TEST_F(JNIHelpTest, ChainedExceptionFallsBackToInitCause) {
+    static jthrowable initCauseArgument;
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    GetMockFunctions()->ExceptionOccurred = [](JNIEnv*) { return FakeRef<jthrowable>(0x70); };
+    GetMockFunctions()->ExceptionClear = [](JNIEnv*) {};
+    GetMockFunctions()->NewStringUTF = [](JNIEnv*, const char*) {
+        return FakeRef<jstring>(0x50);
+    };
+    // NullPointerException has no (String, Throwable) constructor.
+    GetMockFunctions()->NewObjectV = [](JNIEnv*, jclass, jmethodID, va_list) {
+        return FakeRef<jobject>(0x60);
+    };
+    GetMockFunctions()->CallObjectMethodV = [](JNIEnv*, jobject, jmethodID, va_list args) {
+        initCauseArgument = va_arg(args, jthrowable);
+        return FakeRef<jobject>(0x60);
+    };
+    GetMockFunctions()->Throw = [](JNIEnv*, jthrowable) -> jint { return JNI_OK; };
+
+    initCauseArgument = nullptr;
+    EXPECT_EQ(0, jniThrowChainedException(env_, "java/lang/NullPointerException", "no peer"));
+    EXPECT_EQ(FakeRef<jthrowable>(0x70), initCauseArgument);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::NewObjectV));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::Throw));
+}
+
+TEST_F(JNIHelpTest, ChainedExceptionKeepsCauseWhenConstructionFails) {
+    static jthrowable thrown;
+    GetMockFunctions()->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_TRUE; };
+    GetMockFunctions()->ExceptionOccurred = [](JNIEnv*) { return FakeRef<jthrowable>(0x70); };
+    GetMockFunctions()->ExceptionClear = [](JNIEnv*) {};
+    GetMockFunctions()->NewStringUTF = [](JNIEnv*, const char*) {
+        return FakeRef<jstring>(0x50);
+    };
+    // The constructor throws.
+    GetMockFunctions()->NewObjectV = [](JNIEnv*, jclass, jmethodID, va_list) -> jobject {
+        return nullptr;
+    };
+    GetMockFunctions()->Throw = [](JNIEnv*, jthrowable exception) -> jint {
+        thrown = exception;
+        return JNI_OK;
+    };
+
+    thrown = nullptr;
+    EXPECT_NE(0, jniThrowChainedException(env_, "java/io/IOException", "read failed"));
+    EXPECT_EQ(FakeRef<jthrowable>(0x70), thrown);
+}
+
+namespace {
+
+// Stubs an IOException (0x80) caused by an IllegalStateException (0x90). The
+// cause's stack trace shares its two outermost frames with the IOException's.
+void StubExceptionWithCause(JNINativeInterface* functions) {
+    struct Frame {
+        uintptr_t ref;
+        const char* className;
+        const char* methodName;
+        const char* fileName;
+        jint lineNumber;
+    };
+    static const Frame kFrames[] = {
+        { 0x1001, "android.Reader", "read", "Reader.java", 10 },
+        { 0x1002, "android.Main", "main", "Main.java", 5 },
+        { 0x1003, "android.Native", "readBytes", nullptr, -2 },
+    };
+
+    // Method ids are the method names so that calls can be told apart.
+    functions->GetMethodID = [](JNIEnv*, jclass, const char* name, const char*) {
+        return reinterpret_cast<jmethodID>(const_cast<char*>(name));
+    };
+    functions->ExceptionCheck = [](JNIEnv*) -> jboolean { return JNI_FALSE; };
+    functions->ExceptionOccurred = [](JNIEnv*) -> jthrowable { return nullptr; };
+    functions->NewLocalRef = [](JNIEnv*, jobject obj) { return obj; };
+    functions->IsSameObject = [](JNIEnv*, jobject a, jobject b) -> jboolean { return a == b; };
+    functions->GetObjectClass = [](JNIEnv*, jobject obj) {
+        return FakeRef<jclass>(reinterpret_cast<uintptr_t>(obj) + 1);
+    };
+    functions->GetArrayLength = [](JNIEnv*, jarray array) -> jsize {
+        return array == FakeRef<jarray>(0x800) ? 2 : 3;
+    };
+    functions->GetObjectArrayElement = [](JNIEnv*, jobjectArray array, jsize index) {
+        static const uintptr_t kOuterFrames[] = { 0x1001, 0x1002 };
+        static const uintptr_t kCauseFrames[] = { 0x1003, 0x1001, 0x1002 };
+        return FakeRef<jobject>(array == FakeRef<jobjectArray>(0x800) ? kOuterFrames[index]
+                                                                      : kCauseFrames[index]);
+    };
+    functions->CallObjectMethodV = [](JNIEnv*, jobject obj, jmethodID method, va_list) {
+        std::string name(reinterpret_cast<const char*>(method));
+        uintptr_t ref = reinterpret_cast<uintptr_t>(obj);
+        const char* result = nullptr;
+        if (name == "getName") {
+            result = ref == 0x81 ? "java.io.IOException" : "java.lang.IllegalStateException";
+        } else if (name == "getMessage") {
+            result = ref == 0x80 ? "read failed" : nullptr;
+        } else if (name == "getStackTrace") {
+            return FakeRef<jobject>(ref == 0x80 ? 0x800 : 0x900);
+        } else if (name == "getCause") {
+            return ref == 0x80 ? FakeRef<jobject>(0x90) : nullptr;
+        } else {
+            for (const Frame& frame : kFrames) {
+                if (frame.ref == ref) {
+                    result = name == "getClassName" ? frame.className
+                           : name == "getMethodName" ? frame.methodName : frame.fileName;
+                }
+            }
+        }
+        return reinterpret_cast<jobject>(const_cast<char*>(result));
+    };
+    functions->CallIntMethodV = [](JNIEnv*, jobject obj, jmethodID, va_list) -> jint {
+        for (const Frame& frame : kFrames) {
+            if (frame.ref == reinterpret_cast<uintptr_t>(obj)) {
+                return frame.lineNumber;
+            }
+        }
+        return -1;
+    };
+    functions->CallBooleanMethodV = [](JNIEnv*, jobject obj, jmethodID,
+                                       va_list args) -> jboolean {
+        return obj == va_arg(args, jobject);
+    };
+    functions->GetStringLength = [](JNIEnv*, jstring str) -> jsize {
+        return strlen(reinterpret_cast<const char*>(str));
+    };
+    functions->GetStringUTFLength = [](JNIEnv*, jstring str) -> jsize {
+        return strlen(reinterpret_cast<const char*>(str));
+    };
+    functions->GetStringUTFRegion = [](JNIEnv*, jstring str, jsize start, jsize length,
+                                       char* buf) {
+        memcpy(buf, reinterpret_cast<const char*>(str) + start, length);
+        buf[length] = '\0';
+    };
+}
+
+// The message captured by CaptureLog.
+std::string gLoggedMessage;
+
+// Returns the last message written to the log while running |log|.
+template <typename Function>
+std::string CaptureLog(Function log) {
+    gLoggedMessage.clear();
+    __android_log_set_logger([](const __android_log_message* message) {
+        gLoggedMessage = message->message;
+    });
+    log();
+#if defined(__ANDROID__)
+    __android_log_set_logger(__android_log_logd_logger);
+#else
+    __android_log_set_logger(__android_log_stderr_logger);
+#endif
+    return gLoggedMessage;
+}
+
+}  // namespace
+
+TEST_F(JNIHelpTest, LogExceptionFormatsStackTraceNatively) {
+    StubExceptionWithCause(GetMockFunctions());
+    jthrowable exception = FakeRef<jthrowable>(0x80);
+    jniLogException(env_, ANDROID_LOG_DEBUG, "JNIHelpTest", exception);
+
+    GetCallStats().Reset();
+    EXPECT_EQ("java.io.IOException: read failed\n"
+              "\tat android.Reader.read(Reader.java:10)\n"
+              "\tat android.Main.main(Main.java:5)\n"
+              "Caused by: java.lang.IllegalStateException\n"
+              "\tat android.Native.readBytes(Native Method)\n"
+              "\t... 2 more",
+              CaptureLog([this, exception] {
+                  jniLogException(env_, ANDROID_LOG_DEBUG, "JNIHelpTest", exception);
+              }));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetMethodID));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::NewObjectV));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetStringUTFChars));
+    // Two frames of the IOException and the one frame unique to its cause.
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::CallIntMethodV));
+    EXPECT_EQ(0, GetCallStats().GetLiveLocalRefs());
+}
+
+TEST_F(JNIHelpTest, LogExceptionWithDepthBoundsFrames) {
+    StubExceptionWithCause(GetMockFunctions());
+    jthrowable exception = FakeRef<jthrowable>(0x80);
+    jniLogExceptionWithDepth(env_, ANDROID_LOG_DEBUG, "JNIHelpTest", exception, 1);
+
+    // Frames cut off by the depth are counted apart from those shared with
+    // the enclosing exception.
+    GetCallStats().Reset();
+    EXPECT_EQ("java.io.IOException: read failed\n"
+              "\tat android.Reader.read(Reader.java:10)\n"
+              "\t... 1 truncated\n"
+              "Caused by: java.lang.IllegalStateException\n"
+              "\tat android.Native.readBytes(Native Method)\n"
+              "\t... 2 more",
+              CaptureLog([this, exception] {
+                  jniLogExceptionWithDepth(env_, ANDROID_LOG_DEBUG, "JNIHelpTest", exception, 1);
+              }));
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::CallIntMethodV));
+
+    EXPECT_EQ("java.io.IOException: read failed\n"
+              "\t... 2 truncated\n"
+              "Caused by: java.lang.IllegalStateException\n"
+              "\t... 1 truncated\n"
+              "\t... 2 more",
+              CaptureLog([this, exception] {
+                  jniLogExceptionWithDepth(env_, ANDROID_LOG_DEBUG, "JNIHelpTest", exception, 0);
+              }));
+}
+
+namespace {
+
+jobject (*gStubbedThrowableMethod)(JNIEnv*, jobject, jmethodID, va_list);
+jsize (*gStubbedGetArrayLength)(JNIEnv*, jarray);
+jobject (*gStubbedGetObjectArrayElement)(JNIEnv*, jobjectArray, jsize);
+
+// Makes the IllegalStateException (0x90) of StubExceptionWithCause both a
+// suppressed exception of the IOException (0x80) and its cause, and makes the
+// IOException the cause of the IllegalStateException, so that both appear
+// twice.
+void StubCircularException(JNINativeInterface* functions) {
+    StubExceptionWithCause(functions);
+    gStubbedThrowableMethod = functions->CallObjectMethodV;
+    functions->CallObjectMethodV = [](JNIEnv* env, jobject obj, jmethodID method,
+                                      va_list args) {
+        std::string name(reinterpret_cast<const char*>(method));
+        if (name == "getSuppressed" && obj == FakeRef<jobject>(0x80)) {
+            return FakeRef<jobject>(0xa00);
+        }
+        if (name == "getCause" && obj == FakeRef<jobject>(0x90)) {
+            return FakeRef<jobject>(0x80);
+        }
+        return gStubbedThrowableMethod(env, obj, method, args);
+    };
+    gStubbedGetArrayLength = functions->GetArrayLength;
+    functions->GetArrayLength = [](JNIEnv* env, jarray array) -> jsize {
+        return array == FakeRef<jarray>(0xa00) ? 1 : gStubbedGetArrayLength(env, array);
+    };
+    gStubbedGetObjectArrayElement = functions->GetObjectArrayElement;
+    functions->GetObjectArrayElement = [](JNIEnv* env, jobjectArray array, jsize index) {
+        return array == FakeRef<jobjectArray>(0xa00)
+                ? FakeRef<jobject>(0x90)
+                : gStubbedGetObjectArrayElement(env, array, index);
+    };
+}
+
+}  // namespace
+
+TEST_F(JNIHelpTest, LogExceptionFormatsSuppressedAndCircularExceptions) {
+    StubCircularException(GetMockFunctions());
+    jthrowable exception = FakeRef<jthrowable>(0x80);
+    EXPECT_EQ("java.io.IOException: read failed\n"
+              "\tat android.Reader.read(Reader.java:10)\n"
+              "\tat android.Main.main(Main.java:5)\n"
+              "\tSuppressed: java.lang.IllegalStateException\n"
+              "\t\tat android.Native.readBytes(Native Method)\n"
+              "\t\t... 2 more\n"
+              "\tCaused by: [CIRCULAR REFERENCE: java.io.IOException: read failed]\n"
+              "Caused by: [CIRCULAR REFERENCE: java.lang.IllegalStateException]",
+              CaptureLog([this, exception] {
+                  jniLogException(env_, ANDROID_LOG_DEBUG, "JNIHelpTest", exception);
+              }));
+    EXPECT_EQ(0, GetCallStats().GetLiveLocalRefs());
+}
+
+TEST_F(JNIHelpTest, LogExceptionLogsEveryFrame) {
+    StubExceptionWithCause(GetMockFunctions());
+    GetMockFunctions()->GetArrayLength = [](JNIEnv*, jarray array) -> jsize {
+        return array == FakeRef<jarray>(0x800) ? 100 : 0;
+    };
+    GetMockFunctions()->GetObjectArrayElement = [](JNIEnv*, jobjectArray, jsize) {
+        return FakeRef<jobject>(0x1001);
+    };
+    jthrowable exception = FakeRef<jthrowable>(0x80);
+
+    // Unlike jniLogExceptionAsync, jniLogException does not truncate the trace.
+    std::string trace = CaptureLog([this, exception] {
+        jniLogException(env_, ANDROID_LOG_DEBUG, "JNIHelpTest", exception);
+    });
+    size_t frames = 0;
+    for (size_t pos = trace.find("\tat "); pos != std::string::npos;
+         pos = trace.find("\tat ", pos + 1)) {
+        ++frames;
+    }
+    EXPECT_EQ(100u, frames);
+    EXPECT_EQ(std::string::npos, trace.find("truncated"));
+}
+
+namespace {
+
+// A VM for the tests of jniLogExceptionAsync(). Its logging thread gets an
+// environment of its own, as the instrumented environment of the fixture is
+// not thread-safe, in which the IOException of StubExceptionWithCause can be
+// formatted.
+JNIEnv* gTestEnv;
+JNINativeInterface gLoggerFunctions;
+JNIEnv gLoggerEnv;
+JNIInvokeInterface gVmFunctions;
+JavaVM gVm;
+
+// Calls made on the logging thread.
+std::atomic<size_t> gLoggerGlobalRefsDeleted;
+std::atomic<size_t> gLoggerGetCauseCalls;
+jobject (*gStubbedCallObjectMethodV)(JNIEnv*, jobject, jmethodID, va_list);
+
+// While gHoldLogger is set the logging thread blocks as it starts on an
+// exception, after setting gLoggerHeld.
+std::mutex gHoldMutex;
+std::condition_variable gHoldChanged;
+bool gHoldLogger;
+bool gLoggerHeld;
+
+// Messages logged by any thread while collecting.
+std::mutex gLogsMutex;
+std::vector<std::string> gLogs;
+
+void StartCollectingLogs() {
+    gLogs.clear();
+    __android_log_set_logger([](const __android_log_message* message) {
+        std::lock_guard<std::mutex> lock(gLogsMutex);
+        gLogs.push_back(message->message);
+    });
+}
+
+std::vector<std::string> StopCollectingLogs() {
+#if defined(__ANDROID__)
+    __android_log_set_logger(__android_log_logd_logger);
+#else
+    __android_log_set_logger(__android_log_stderr_logger);
+#endif
+    std::lock_guard<std::mutex> lock(gLogsMutex);
+    return gLogs;
+}
+
+void SetHoldLogger(bool hold) {
+    std::lock_guard<std::mutex> lock(gHoldMutex);
+    gHoldLogger = hold;
+    gHoldChanged.notify_all();
+}
+
+void WaitForLoggerHeld() {
+    std::unique_lock<std::mutex> lock(gHoldMutex);
+    gHoldChanged.wait(lock, [] { return gLoggerHeld; });
+}
+
+// Makes |env| belong to gVm, which can attach the logging thread.
+void StubJavaVM(JNIEnv* env, JNINativeInterface* functions) {
+    gTestEnv = env;
+    gLoggerGlobalRefsDeleted = 0;
+    gLoggerGetCauseCalls = 0;
+    gHoldLogger = false;
+    gLoggerHeld = false;
+
+    functions->GetJavaVM = [](JNIEnv*, JavaVM** vm) -> jint {
+        *vm = &gVm;
+        return JNI_OK;
+    };
+    functions->DeleteGlobalRef = [](JNIEnv*, jobject) {};
+
+    gLoggerFunctions = {};
+    StubJniConstants(&gLoggerFunctions);
+    StubExceptionWithCause(&gLoggerFunctions);
+    gLoggerFunctions.ExceptionClear = [](JNIEnv*) {};
+    gLoggerFunctions.DeleteGlobalRef = [](JNIEnv*, jobject) { gLoggerGlobalRefsDeleted++; };
+    gLoggerFunctions.GetObjectClass = [](JNIEnv*, jobject obj) {
+        std::unique_lock<std::mutex> lock(gHoldMutex);
+        gLoggerHeld = true;
+        gHoldChanged.notify_all();
+        gHoldChanged.wait(lock, [] { return !gHoldLogger; });
+        return FakeRef<jclass>(reinterpret_cast<uintptr_t>(obj) + 1);
+    };
+    gStubbedCallObjectMethodV = gLoggerFunctions.CallObjectMethodV;
+    gLoggerFunctions.CallObjectMethodV = [](JNIEnv* env, jobject obj, jmethodID method,
+                                            va_list args) {
+        if (strcmp(reinterpret_cast<const char*>(method), "getCause") == 0) {
+            gLoggerGetCauseCalls++;
+        }
+        return gStubbedCallObjectMethodV(env, obj, method, args);
+    };
+    gLoggerEnv.functions = &gLoggerFunctions;
+
+    gVmFunctions = {};
+    gVmFunctions.GetEnv = [](JavaVM*, void** env, jint) -> jint {
+        *env = gTestEnv;
+        return JNI_OK;
+    };
+    gVmFunctions.AttachCurrentThreadAsDaemon = [](JavaVM*, JNIEnv** env, void*) -> jint {
+        *env = &gLoggerEnv;
+        return JNI_OK;
+    };
+    gVmFunctions.DetachCurrentThread = [](JavaVM*) -> jint { return JNI_OK; };
+    gVmFunctions.DestroyJavaVM = [](JavaVM*) -> jint { return JNI_OK; };
+    gVm.functions = &gVmFunctions;
+}
+
+const char kLoggedTrace[] = "java.io.IOException: read failed\n"
+                            "\tat android.Reader.read(Reader.java:10)\n"
+                            "\tat android.Main.main(Main.java:5)\n"
+                            "Caused by: java.lang.IllegalStateException\n"
+                            "\tat android.Native.readBytes(Native Method)\n"
+                            "\t... 2 more";
+
+}  // namespace
+
+TEST_F(JNIHelpTest, LogExceptionAsyncCollapsesRepeats) {
+    StubExceptionWithCause(GetMockFunctions());
+    StubJavaVM(env_, GetMockFunctions());
+    jthrowable exception = FakeRef<jthrowable>(0x80);
+
+    StartCollectingLogs();
+    for (int i = 0; i < 5; ++i) {
+        jniLogExceptionAsync(env_, ANDROID_LOG_WARN, "JNIHelpTest", exception);
+    }
+    // Stopping the logging thread logs what is queued and the repeats counted.
+    EXPECT_EQ(JNI_OK, JniInvocationDestroyJavaVM(&gVm));
+    std::vector<std::string> logs = StopCollectingLogs();
+
+    ASSERT_EQ(2u, logs.size());
+    EXPECT_EQ(kLoggedTrace, logs[0]);
+    EXPECT_EQ("Suppressed 4 repeats of: java.io.IOException: read failed\n"
+              "\tat android.Reader.read(Reader.java:10)",
+              logs[1]);
+    // Only the first was formatted, asking the exception and its cause for
+    // their causes, and every reference was released.
+    EXPECT_EQ(2u, gLoggerGetCauseCalls.load());
+    EXPECT_EQ(5u, gLoggerGlobalRefsDeleted.load());
+}
+
+TEST_F(JNIHelpTest, LogExceptionAsyncDropsWhenQueueIsFull) {
+    StubExceptionWithCause(GetMockFunctions());
+    StubJavaVM(env_, GetMockFunctions());
+    jthrowable exception = FakeRef<jthrowable>(0x80);
+
+    StartCollectingLogs();
+    // Hold the logging thread on the first exception while filling its queue
+    // of 256, so that the last 10 are dropped.
+    SetHoldLogger(true);
+    jniLogExceptionAsync(env_, ANDROID_LOG_WARN, "JNIHelpTest", exception);
+    WaitForLoggerHeld();
+    GetCallStats().Reset();
+    for (int i = 0; i < 266; ++i) {
+        jniLogExceptionAsync(env_, ANDROID_LOG_WARN, "JNIHelpTest", exception);
+    }
+    EXPECT_EQ(266u, GetCallStats().GetCallCount(&JNINativeInterface::NewGlobalRef));
+    EXPECT_EQ(10u, GetCallStats().GetCallCount(&JNINativeInterface::DeleteGlobalRef));
+    SetHoldLogger(false);
+    EXPECT_EQ(JNI_OK, JniInvocationDestroyJavaVM(&gVm));
+    std::vector<std::string> logs = StopCollectingLogs();
+
+    ASSERT_EQ(3u, logs.size());
+    EXPECT_EQ(kLoggedTrace, logs[0]);
+    EXPECT_EQ("Dropped 10 exceptions while the logging queue was full", logs[1]);
+    EXPECT_EQ(0u, logs[2].find("Suppressed 256 repeats of: "));
+    EXPECT_EQ(257u, gLoggerGlobalRefsDeleted.load());
+}
+
+TEST_F(JNIHelpTest, LogExceptionAsyncAllowsExitWithoutStopping) {
+    // Processes that never destroy their VM exit with the logging thread still
+    // running, or with a thread that failed to attach.
+    GTEST_FLAG_SET(death_test_style, "threadsafe");
+    EXPECT_EXIT({
+        StubExceptionWithCause(GetMockFunctions());
+        StubJavaVM(env_, GetMockFunctions());
+        jniLogExceptionAsync(env_, ANDROID_LOG_WARN, "JNIHelpTest", FakeRef<jthrowable>(0x80));
+        while (gLoggerGlobalRefsDeleted.load() == 0) {
+            std::this_thread::yield();
+        }
+        exit(0);
+    }, testing::ExitedWithCode(0), "");
+    EXPECT_EXIT({
+        StubExceptionWithCause(GetMockFunctions());
+        StubJavaVM(env_, GetMockFunctions());
+        gVmFunctions.AttachCurrentThreadAsDaemon = [](JavaVM*, JNIEnv**, void*) -> jint {
+            return JNI_ERR;
+        };
+        jniLogExceptionAsync(env_, ANDROID_LOG_WARN, "JNIHelpTest", FakeRef<jthrowable>(0x80));
+        exit(0);
+    }, testing::ExitedWithCode(0), "");
+}
+
+}  // namespace android
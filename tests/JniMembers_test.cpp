@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nativehelper/jni_members.h>
+#include <nativehelper/jni_struct.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <nativehelper/jni_gtest.h>
+
+namespace android {
+
+namespace {
+
+// Each handle caches its ids for the life of the process, so every test uses its own handles.
+JNI_METHOD(ObjectHashCode, "java/lang/Object", "hashCode", "()I");
+JNI_METHOD(ObjectEquals, "java/lang/Object", "equals", "(Ljava/lang/Object;)Z");
+JNI_METHOD(ObjectInit, "java/lang/Object", "<init>", "()V");
+JNI_METHOD(StringRegionMatches, "java/lang/String", "regionMatches", "(ZILjava/lang/String;II)Z");
+JNI_STATIC_METHOD(IntegerValueOf, "java/lang/Integer", "valueOf", "(I)Ljava/lang/Integer;");
+JNI_STATIC_METHOD(SystemGc, "java/lang/System", "gc", "()V");
+JNI_METHOD(MissingMethod, "java/lang/Object", "missing", "()J");
+JNI_FIELD(PointX, "android/graphics/Point", "x", "I");
+JNI_STATIC_FIELD(IntegerMaxValue, "java/lang/Integer", "MAX_VALUE", "I");
+JNI_METHOD(RegisteredRun, "com/example/Registered", "run", "()V");
+
+#define CLEARED_CONSTANTS(CLASS, FIELD, STATIC_FIELD, METHOD, STATIC_METHOD) \
+    CLASS(Cleared, "com/example/Cleared")
+
+JNI_CONSTANTS_TABLE(ClearedConstants, CLEARED_CONSTANTS);
+
+struct Config {
+    jint width;
+    jfloat scale;
+    jboolean enabled;
+    jlong flags;
+    jstring label;
+};
+
+JNI_STRUCT(ConfigMarshaller, Config, "com/example/Config",
+           JNI_STRUCT_FIELD(width, "I"),
+           JNI_STRUCT_FIELD(scale, "F"),
+           JNI_STRUCT_FIELD_AS(enabled, "mEnabled", "Z"),
+           JNI_STRUCT_FIELD(flags, "J"),
+           JNI_STRUCT_FIELD(label, "Ljava/lang/String;"));
+
+// A descriptor that does not match its member fails to compile, e.g. "J" for a jint.
+static_assert(!nativehelper::detail::IsValidJniStructField(
+                  nativehelper::detail::MakeJniStructField(&Config::width, "width", "J")));
+static_assert(!nativehelper::detail::IsValidJniStructField(
+                  nativehelper::detail::MakeJniStructField(&Config::label, "label", "I")));
+
+static_assert(std::is_same_v<ObjectHashCode::ReturnType, jint>);
+static_assert(std::is_same_v<ObjectEquals::ReturnType, jboolean>);
+static_assert(std::is_same_v<ObjectInit::ReturnType, void>);
+static_assert(std::is_same_v<IntegerValueOf::ReturnType, jobject>);
+static_assert(std::is_same_v<PointX::ValueType, jint>);
+
+// The arguments of the last call made through one of the Call*MethodA functions.
+jvalue gLastArgs[5];
+std::string gLastName;
+
+void RecordArgs(const jvalue* args, size_t count) {
+    memcpy(gLastArgs, args, count * sizeof(jvalue));
+}
+
+// The global references deleted, and whether the stubbed FindClass should
+// clear ClearedConstants while it looks up "com/example/Cleared".
+std::vector<jobject> gDeletedGlobalRefs;
+bool gClearDuringFindClass;
+
+jclass FindClass(JNIEnv*, const char* name) {
+    if (strcmp(name, "com/example/Registered") == 0) {
+        return FakeRef<jclass>(0x110);
+    }
+    if (strcmp(name, "com/example/Cleared") == 0) {
+        if (gClearDuringFindClass) {
+            gClearDuringFindClass = false;
+            ClearedConstants::GetTable().Clear(nullptr);
+        }
+        return FakeRef<jclass>(0x120);
+    }
+    return FakeRef<jclass>(0x100);
+}
+
+}  // namespace
+
+class JniMembersTest : public InstrumentedJNITestBase {
+protected:
+    void SetUp() override {
+        InstrumentedJNITestBase::SetUp();
+        memset(gLastArgs, 0, sizeof(gLastArgs));
+        gLastName.clear();
+        gDeletedGlobalRefs.clear();
+        gClearDuringFindClass = false;
+        JNINativeInterface* functions = GetMockFunctions();
+        functions->FindClass = FindClass;
+        functions->NewGlobalRef = [](JNIEnv*, jobject obj) { return obj; };
+        functions->DeleteGlobalRef = [](JNIEnv*, jobject obj) {
+            gDeletedGlobalRefs.push_back(obj);
+        };
+        functions->DeleteLocalRef = [](JNIEnv*, jobject) {};
+        functions->GetFieldID = [](JNIEnv*, jclass, const char* name, const char*) {
+            gLastName = name;
+            return FakeRef<jfieldID>(0x200);
+        };
+        functions->GetStaticFieldID = [](JNIEnv*, jclass, const char* name, const char*) {
+            gLastName = name;
+            return FakeRef<jfieldID>(0x210);
+        };
+        functions->GetMethodID = [](JNIEnv*, jclass, const char* name, const char*) {
+            gLastName = name;
+            return FakeRef<jmethodID>(0x300);
+        };
+        functions->GetStaticMethodID = [](JNIEnv*, jclass, const char* name, const char*) {
+            gLastName = name;
+            return FakeRef<jmethodID>(0x400);
+        };
+    }
+};
+
+TEST_F(JniMembersTest, MethodIdIsLookedUpOnce) {
+    GetMockFunctions()->CallIntMethodA = [](JNIEnv*, jobject, jmethodID, const jvalue*) {
+        return jint(42);
+    };
+
+    jobject object = FakeRef<jobject>(0x500);
+    EXPECT_EQ(42, ObjectHashCode::Call(env_, object));
+    EXPECT_EQ("hashCode", gLastName);
+    EXPECT_EQ(42, ObjectHashCode::Call(env_, object));
+    EXPECT_EQ(42, ObjectHashCode::Call(env_, object));
+
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetMethodID));
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::CallIntMethodA));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::CallIntMethodV));
+}
+
+TEST_F(JniMembersTest, ArgumentsArePackedAsJvalues) {
+    GetMockFunctions()->CallBooleanMethodA =
+        [](JNIEnv*, jobject, jmethodID method, const jvalue* args) {
+            EXPECT_EQ(FakeRef<jmethodID>(0x300), method);
+            RecordArgs(args, 5);
+            return jboolean(JNI_TRUE);
+        };
+
+    jobject object = FakeRef<jobject>(0x500);
+    jstring other = FakeRef<jstring>(0x600);
+    EXPECT_TRUE(StringRegionMatches::Call(env_, object, true, 3, other, 4, 5));
+    EXPECT_EQ(JNI_TRUE, gLastArgs[0].z);
+    EXPECT_EQ(3, gLastArgs[1].i);
+    EXPECT_EQ(other, gLastArgs[2].l);
+    EXPECT_EQ(4, gLastArgs[3].i);
+    EXPECT_EQ(5, gLastArgs[4].i);
+
+    GetMockFunctions()->CallBooleanMethodA = [](JNIEnv*, jobject, jmethodID, const jvalue* args) {
+        RecordArgs(args, 1);
+        return jboolean(JNI_FALSE);
+    };
+    EXPECT_FALSE(ObjectEquals::Call(env_, object, other));
+    EXPECT_EQ(other, gLastArgs[0].l);
+}
+
+TEST_F(JniMembersTest, StaticMethods) {
+    GetMockFunctions()->CallStaticObjectMethodA =
+        [](JNIEnv*, jclass klass, jmethodID method, const jvalue* args) {
+            EXPECT_EQ(FakeRef<jclass>(0x100), klass);
+            EXPECT_EQ(FakeRef<jmethodID>(0x400), method);
+            RecordArgs(args, 1);
+            return FakeRef<jobject>(0x700);
+        };
+    GetMockFunctions()->CallStaticVoidMethodA = [](JNIEnv*, jclass, jmethodID, const jvalue*) {};
+
+    EXPECT_EQ(FakeRef<jobject>(0x700), IntegerValueOf::Call(env_, 7));
+    EXPECT_EQ(7, gLastArgs[0].i);
+    SystemGc::Call(env_);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::CallStaticVoidMethodA));
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::GetStaticMethodID));
+}
+
+TEST_F(JniMembersTest, NewObject) {
+    GetMockFunctions()->NewObjectA = [](JNIEnv*, jclass klass, jmethodID method, const jvalue*) {
+        EXPECT_EQ(FakeRef<jclass>(0x100), klass);
+        EXPECT_EQ(FakeRef<jmethodID>(0x300), method);
+        return FakeRef<jobject>(0x800);
+    };
+
+    EXPECT_EQ(FakeRef<jobject>(0x800), ObjectInit::NewObject(env_));
+    EXPECT_EQ("<init>", gLastName);
+}
+
+TEST_F(JniMembersTest, Fields) {
+    static jint x = 0;
+    static jint maxValue = 0;
+    GetMockFunctions()->GetIntField = [](JNIEnv*, jobject, jfieldID field) {
+        EXPECT_EQ(FakeRef<jfieldID>(0x200), field);
+        return x;
+    };
+    GetMockFunctions()->SetIntField = [](JNIEnv*, jobject, jfieldID, jint value) { x = value; };
+    GetMockFunctions()->GetStaticIntField = [](JNIEnv*, jclass, jfieldID field) {
+        EXPECT_EQ(FakeRef<jfieldID>(0x210), field);
+        return maxValue;
+    };
+    GetMockFunctions()->SetStaticIntField = [](JNIEnv*, jclass, jfieldID, jint value) {
+        maxValue = value;
+    };
+
+    jobject point = FakeRef<jobject>(0x500);
+    PointX::Set(env_, point, 3);
+    PointX::Set(env_, point, PointX::Get(env_, point) + 1);
+    EXPECT_EQ(4, x);
+    IntegerMaxValue::Set(env_, 0x7fffffff);
+    EXPECT_EQ(0x7fffffff, IntegerMaxValue::Get(env_));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetFieldID));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetStaticFieldID));
+}
+
+TEST_F(JniMembersTest, MissingMemberReturnsDefault) {
+    GetMockFunctions()->GetMethodID = [](JNIEnv*, jclass, const char*, const char*) {
+        return static_cast<jmethodID>(nullptr);
+    };
+
+    jobject object = FakeRef<jobject>(0x500);
+    EXPECT_EQ(0, MissingMethod::Call(env_, object));
+    EXPECT_EQ(0, MissingMethod::Call(env_, object));
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::GetMethodID));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::CallLongMethodA));
+}
+
+TEST_F(JniMembersTest, StructReadAndWrite) {
+    static jint width;
+    static jfloat scale;
+    static jboolean enabled;
+    static jlong flags;
+    static jobject label;
+    width = 640;
+    scale = 1.5f;
+    enabled = JNI_TRUE;
+    flags = 0x100000000;
+    label = FakeRef<jobject>(0x900);
+    JNINativeInterface* functions = GetMockFunctions();
+    functions->GetIntField = [](JNIEnv*, jobject, jfieldID) { return width; };
+    functions->GetFloatField = [](JNIEnv*, jobject, jfieldID) { return scale; };
+    functions->GetBooleanField = [](JNIEnv*, jobject, jfieldID) { return enabled; };
+    functions->GetLongField = [](JNIEnv*, jobject, jfieldID) { return flags; };
+    functions->GetObjectField = [](JNIEnv*, jobject, jfieldID) { return label; };
+    functions->SetIntField = [](JNIEnv*, jobject, jfieldID, jint value) { width = value; };
+    functions->SetFloatField = [](JNIEnv*, jobject, jfieldID, jfloat value) { scale = value; };
+    functions->SetBooleanField = [](JNIEnv*, jobject, jfieldID, jboolean value) {
+        enabled = value;
+    };
+    functions->SetLongField = [](JNIEnv*, jobject, jfieldID, jlong value) { flags = value; };
+    functions->SetObjectField = [](JNIEnv*, jobject, jfieldID, jobject value) { label = value; };
+
+    jobject object = FakeRef<jobject>(0x500);
+    Config config = {};
+    ASSERT_TRUE(ConfigMarshaller::Read(env_, object, &config));
+    EXPECT_EQ(640, config.width);
+    EXPECT_EQ(1.5f, config.scale);
+    EXPECT_EQ(JNI_TRUE, config.enabled);
+    EXPECT_EQ(0x100000000, config.flags);
+    EXPECT_EQ(FakeRef<jstring>(0x900), config.label);
+
+    config.width = 320;
+    config.enabled = JNI_FALSE;
+    config.label = nullptr;
+    ASSERT_TRUE(ConfigMarshaller::Write(env_, config, object));
+    EXPECT_EQ(320, width);
+    EXPECT_EQ(JNI_FALSE, enabled);
+    EXPECT_EQ(nullptr, label);
+
+    // Ids are looked up once, and only the fields themselves are accessed afterwards.
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(5u, GetCallStats().GetCallCount(&JNINativeInterface::GetFieldID));
+    GetCallStats().Reset();
+    ASSERT_TRUE(ConfigMarshaller::Read(env_, object, &config));
+    EXPECT_EQ(5u, GetCallStats().GetTotalCallCount());
+}
+
+TEST_F(JniMembersTest, StructNew) {
+    GetMockFunctions()->NewObjectV = [](JNIEnv*, jclass, jmethodID method, va_list) {
+        EXPECT_EQ(FakeRef<jmethodID>(0x300), method);
+        return FakeRef<jobject>(0x800);
+    };
+    GetMockFunctions()->SetIntField = [](JNIEnv*, jobject object, jfieldID, jint) {
+        EXPECT_EQ(FakeRef<jobject>(0x800), object);
+    };
+    GetMockFunctions()->SetFloatField = [](JNIEnv*, jobject, jfieldID, jfloat) {};
+    GetMockFunctions()->SetBooleanField = [](JNIEnv*, jobject, jfieldID, jboolean) {};
+    GetMockFunctions()->SetLongField = [](JNIEnv*, jobject, jfieldID, jlong) {};
+    GetMockFunctions()->SetObjectField = [](JNIEnv*, jobject, jfieldID, jobject) {};
+
+    Config config = {};
+    EXPECT_EQ(FakeRef<jobject>(0x800), ConfigMarshaller::New(env_, config));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::SetIntField));
+}
+
+TEST_F(JniMembersTest, RegistryReleasesHandles) {
+    GetMockFunctions()->CallVoidMethodA = [](JNIEnv*, jobject, jmethodID, const jvalue*) {};
+
+    jobject object = FakeRef<jobject>(0x500);
+    RegisteredRun::Call(env_, object);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+
+    // Releasing deletes the class reference, which is looked up again on the next call.
+    JniConstantTableRegistry::ReleaseHook(reinterpret_cast<C_JNIEnv*>(env_),
+                                                        nullptr);
+    EXPECT_EQ(1, std::count(gDeletedGlobalRefs.begin(), gDeletedGlobalRefs.end(),
+                            FakeRef<jobject>(0x110)));
+    RegisteredRun::Call(env_, object);
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::GetMethodID));
+
+    // Clearing without an env abandons the references.
+    gDeletedGlobalRefs.clear();
+    JniConstantTableRegistry::ClearAll(nullptr);
+    EXPECT_TRUE(gDeletedGlobalRefs.empty());
+    RegisteredRun::Call(env_, object);
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+}
+
+TEST_F(JniMembersTest, ClassClearedWhileResolvingIsDeleted) {
+    gClearDuringFindClass = true;
+    EXPECT_EQ(FakeRef<jclass>(0x120), ClearedConstants::GetClearedClass(env_));
+
+    // The reference resolved before the clear was withdrawn and deleted, and the class was
+    // looked up again for the new generation.
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+    ASSERT_EQ(1u, gDeletedGlobalRefs.size());
+    EXPECT_EQ(FakeRef<jobject>(0x120), gDeletedGlobalRefs[0]);
+
+    EXPECT_EQ(FakeRef<jclass>(0x120), ClearedConstants::GetClearedClass(env_));
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::FindClass));
+}
+
+}  // namespace android
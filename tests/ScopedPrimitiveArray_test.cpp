@@ -0,0 +1,653 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nativehelper/array_access_policy.h>
+#include <nativehelper/scoped_array_chunks.h>
+#include <nativehelper/scoped_primitive_array.h>
+#include <nativehelper/scoped_string_chars.h>
+#include <nativehelper/scoped_utf_chars.h>
+#include <nativehelper/thread_buffer_pool.h>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <nativehelper/jni_gtest.h>
+
+namespace android {
+
+namespace {
+
+// The contents of the Java array used by the tests, which is always FakeRef(0x600).
+std::vector<jfloat> gArray;
+
+// Whether GetFloatArrayElements hands out gCopy, a copy of gArray, rather than
+// gArray itself.
+bool gElementsCopy;
+std::vector<jfloat> gCopy;
+
+// Whether a critical region is open, and the mode it was last closed with.
+bool gInCritical;
+jint gReleaseMode;
+
+// Whether the stubbed ExceptionCheck reports a pending exception.
+bool gExceptionPending;
+
+// Stubs the array functions over gArray, handing out the array itself from
+// GetPrimitiveArrayCritical as a runtime that does not copy would.
+void StubArray(JNINativeInterface* functions) {
+    gElementsCopy = false;
+    gInCritical = false;
+    gReleaseMode = -1;
+    gExceptionPending = false;
+    functions->ExceptionCheck = [](JNIEnv*) -> jboolean {
+        return gExceptionPending ? JNI_TRUE : JNI_FALSE;
+    };
+    functions->GetArrayLength = [](JNIEnv*, jarray) {
+        EXPECT_FALSE(gInCritical);
+        return static_cast<jsize>(gArray.size());
+    };
+    functions->GetPrimitiveArrayCritical = [](JNIEnv*, jarray, jboolean* isCopy) -> void* {
+        EXPECT_FALSE(gInCritical);
+        gInCritical = true;
+        if (isCopy != nullptr) {
+            *isCopy = JNI_FALSE;
+        }
+        return gArray.data();
+    };
+    functions->ReleasePrimitiveArrayCritical = [](JNIEnv*, jarray, void* elements, jint mode) {
+        EXPECT_TRUE(gInCritical);
+        EXPECT_EQ(gArray.data(), elements);
+        gInCritical = false;
+        gReleaseMode = mode;
+    };
+    functions->GetFloatArrayRegion = [](JNIEnv*, jfloatArray, jsize start, jsize length,
+                                        jfloat* buffer) {
+        ASSERT_LE(static_cast<size_t>(start + length), gArray.size());
+        std::copy(gArray.begin() + start, gArray.begin() + start + length, buffer);
+    };
+    functions->SetFloatArrayRegion = [](JNIEnv*, jfloatArray, jsize start, jsize length,
+                                        const jfloat* buffer) {
+        ASSERT_LE(static_cast<size_t>(start + length), gArray.size());
+        std::copy(buffer, buffer + length, gArray.begin() + start);
+    };
+    functions->GetFloatArrayElements = [](JNIEnv*, jfloatArray, jboolean* isCopy) {
+        if (isCopy != nullptr) {
+            *isCopy = gElementsCopy ? JNI_TRUE : JNI_FALSE;
+        }
+        if (gElementsCopy) {
+            gCopy = gArray;
+            return gCopy.data();
+        }
+        return gArray.data();
+    };
+    functions->ReleaseFloatArrayElements = [](JNIEnv*, jfloatArray, jfloat* elements,
+                                              jint mode) {
+        EXPECT_EQ(gElementsCopy ? gCopy.data() : gArray.data(), elements);
+        if (gElementsCopy && mode != JNI_ABORT) {
+            gArray = gCopy;
+        }
+        gReleaseMode = mode;
+    };
+}
+
+}  // namespace
+
+class ScopedPrimitiveArrayTest : public InstrumentedJNITestBase {
+protected:
+    void SetUp() override {
+        InstrumentedJNITestBase::SetUp();
+        gArray = { 1.0f, 2.0f, 3.0f, 4.0f };
+        StubArray(GetMockFunctions());
+        nativehelper::ArrayAccessPolicy<jfloat>::Reset();
+    }
+
+    void TearDown() override {
+        nativehelper::ThreadBufferPool::SetEnabled(false);
+        InstrumentedJNITestBase::TearDown();
+    }
+
+    jfloatArray array_ = FakeRef<jfloatArray>(0x600);
+};
+
+// The default inline buffer is at most 4 KiB and aligned for vector loads.
+static_assert(sizeof(ScopedLongArrayRO) <= 4096 + 128, "ScopedLongArrayRO is too big");
+static_assert(sizeof(ScopedByteArrayRO) <= 1024 + 128, "ScopedByteArrayRO is too big");
+static_assert(alignof(ScopedFloatArrayRO) == 64, "ScopedFloatArrayRO is not aligned");
+
+TEST_F(ScopedPrimitiveArrayTest, ReadOnlyCopiesSmallArrays) {
+    ScopedArrayRO<jfloat, 4> elements(env_, array_);
+    ASSERT_EQ(4u, elements.size());
+    EXPECT_NE(gArray.data(), elements.get());
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(elements.get()) % 64);
+    EXPECT_EQ(3.0f, elements[2]);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayElements));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ReadOnlyUsesElementsForLargeArrays) {
+    {
+        ScopedArrayRO<jfloat, 3> elements(env_, array_);
+        ASSERT_EQ(4u, elements.size());
+        EXPECT_EQ(gArray.data(), elements.get());
+    }
+    EXPECT_EQ(JNI_ABORT, gReleaseMode);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+}
+
+static_assert(std::is_same<const jfloat*, ScopedFloatArrayCriticalRO::ElementType*>::value,
+              "read-only critical arrays give const access");
+static_assert(std::is_same<jfloat*, ScopedFloatArrayCriticalRW::ElementType*>::value,
+              "read-write critical arrays give mutable access");
+
+TEST_F(ScopedPrimitiveArrayTest, CriticalReadOnly) {
+    {
+        ScopedFloatArrayCriticalRO elements(env_, array_);
+        EXPECT_TRUE(gInCritical);
+        ASSERT_EQ(4u, elements.size());
+        jfloat sum = 0;
+        for (jfloat value : elements) {
+            sum += value;
+        }
+        EXPECT_EQ(10.0f, sum);
+        EXPECT_EQ(gArray.data(), elements.data());
+        // No JNI call is made inside the critical region.
+        EXPECT_EQ(2u, GetCallStats().GetTotalCallCount());
+    }
+    EXPECT_FALSE(gInCritical);
+    EXPECT_EQ(JNI_ABORT, gReleaseMode);
+}
+
+TEST_F(ScopedPrimitiveArrayTest, CriticalReadWrite) {
+    {
+        ScopedFloatArrayCriticalRW elements(env_, array_);
+        for (jfloat& value : elements) {
+            value *= 2;
+        }
+        elements[0] = -1.0f;
+    }
+    EXPECT_EQ(0, gReleaseMode);
+    EXPECT_EQ(-1.0f, gArray[0]);
+    EXPECT_EQ(8.0f, gArray[3]);
+}
+
+TEST_F(ScopedPrimitiveArrayTest, CriticalFailure) {
+    GetMockFunctions()->GetPrimitiveArrayCritical = [](JNIEnv*, jarray, jboolean*) -> void* {
+        return nullptr;
+    };
+    {
+        ScopedFloatArrayCriticalRO elements(env_, array_);
+        EXPECT_TRUE(elements.empty());
+        EXPECT_EQ(nullptr, elements.get());
+    }
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::ReleasePrimitiveArrayCritical));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, DirtyReadWriteWritesBackDirtyRanges) {
+    gArray.assign(100, 0.0f);
+    gElementsCopy = true;
+    {
+        ScopedFloatArrayDirtyRW elements(env_, array_);
+        ASSERT_EQ(100u, elements.size());
+        elements.set(10, 1.0f);
+        elements.get()[50] = 2.0f;
+        elements.get()[51] = 3.0f;
+        elements.markDirty(50, 2);
+        elements.get()[90] = 4.0f;  // Not marked, so not written back.
+        EXPECT_EQ(2u, elements.dirtyRangeCount());
+    }
+    EXPECT_EQ(JNI_ABORT, gReleaseMode);
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+    EXPECT_EQ(1.0f, gArray[10]);
+    EXPECT_EQ(2.0f, gArray[50]);
+    EXPECT_EQ(3.0f, gArray[51]);
+    EXPECT_EQ(0.0f, gArray[90]);
+}
+
+TEST_F(ScopedPrimitiveArrayTest, DirtyReadWriteDropsRangesWithExceptionPending) {
+    gArray.assign(100, 0.0f);
+    gElementsCopy = true;
+    {
+        ScopedFloatArrayDirtyRW elements(env_, array_);
+        elements.set(10, 1.0f);
+        gExceptionPending = true;
+        elements.commit();
+        EXPECT_EQ(0u, elements.dirtyRangeCount());
+        elements.set(20, 2.0f);
+    }
+    EXPECT_EQ(JNI_ABORT, gReleaseMode);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+    EXPECT_EQ(0.0f, gArray[10]);
+    EXPECT_EQ(0.0f, gArray[20]);
+}
+
+TEST_F(ScopedPrimitiveArrayTest, DirtyReadWriteMergesRanges) {
+    gArray.assign(100, 0.0f);
+    gElementsCopy = true;
+    ScopedArrayDirtyRW<jfloat, 2> elements(env_, array_);
+    elements.markDirty(10, 5);
+    elements.markDirty(15, 5);  // Adjacent: merged.
+    EXPECT_EQ(1u, elements.dirtyRangeCount());
+    elements.markDirty(40, 1);
+    // Over the limit: [10, 20) and [40, 41) are closer than [40, 41) and [80, 81).
+    elements.markDirty(80, 1);
+    EXPECT_EQ(2u, elements.dirtyRangeCount());
+    elements.markDirty(41, 39);  // Touches both [10, 41) and [80, 81).
+    EXPECT_EQ(1u, elements.dirtyRangeCount());
+    elements.commit();
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, DirtyReadWriteInPlace) {
+    {
+        ScopedFloatArrayDirtyRW elements(env_, array_);
+        elements.set(0, 5.0f);
+    }
+    // The runtime handed out the array itself, so there is nothing to copy back.
+    EXPECT_EQ(5.0f, gArray[0]);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ChunkReader) {
+    gArray.resize(10);
+    for (size_t i = 0; i < gArray.size(); ++i) {
+        gArray[i] = static_cast<jfloat>(i);
+    }
+    ScopedArrayChunkReader<jfloat, 4> reader(env_, array_);
+    std::vector<jfloat> read;
+    std::vector<size_t> sizes;
+    while (reader.next()) {
+        EXPECT_EQ(read.size(), reader.offset());
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(reader.get()) % 64);
+        read.insert(read.end(), reader.get(), reader.get() + reader.size());
+        sizes.push_back(reader.size());
+    }
+    EXPECT_EQ(gArray, read);
+    EXPECT_EQ((std::vector<size_t>{ 4, 4, 2 }), sizes);
+    EXPECT_FALSE(reader.next());
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayElements));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ChunkWriter) {
+    gArray.assign(10, 0.0f);
+    {
+        ScopedArrayChunkWriter<jfloat, 4> writer(env_, array_);
+        while (writer.next()) {
+            for (size_t i = 0; i < writer.size(); ++i) {
+                writer[i] = static_cast<jfloat>(writer.offset() + i);
+            }
+        }
+    }
+    for (size_t i = 0; i < gArray.size(); ++i) {
+        EXPECT_EQ(static_cast<jfloat>(i), gArray[i]);
+    }
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ChunkWriterFlushesOnDestruction) {
+    gArray.assign(10, 0.0f);
+    {
+        ScopedFloatArrayChunkWriter writer(env_, array_);
+        ASSERT_TRUE(writer.next());
+        ASSERT_EQ(10u, writer.size());
+        for (size_t i = 0; i < writer.size(); ++i) {
+            writer[i] = 1.0f;
+        }
+    }
+    EXPECT_EQ(1.0f, gArray[9]);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ChunkWriterStopsWritingWithExceptionPending) {
+    gArray.assign(10, 0.0f);
+    {
+        ScopedArrayChunkWriter<jfloat, 4> writer(env_, array_);
+        while (writer.next()) {
+            for (size_t i = 0; i < writer.size(); ++i) {
+                writer[i] = 1.0f;
+            }
+            // Filling the second window throws; it and the third are not written.
+            gExceptionPending = writer.offset() >= 4;
+        }
+    }
+    EXPECT_EQ((std::vector<jfloat>{ 1, 1, 1, 1, 0, 0, 0, 0, 0, 0 }), gArray);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+
+    gExceptionPending = false;
+    {
+        ScopedFloatArrayChunkWriter writer(env_, array_);
+        ASSERT_TRUE(writer.next());
+        writer[0] = 2.0f;
+        // Destroyed with an exception pending.
+        gExceptionPending = true;
+    }
+    EXPECT_EQ(1.0f, gArray[0]);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, LazyReadOnlyFetchesTouchedBlocks) {
+    gArray.resize(100000);
+    for (size_t i = 0; i < gArray.size(); ++i) {
+        gArray[i] = static_cast<jfloat>(i);
+    }
+    ScopedFloatArrayLazyRO elements(env_, array_);
+    ASSERT_EQ(100000u, elements.size());
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+
+    EXPECT_EQ(5000.0f, elements[5000]);
+    EXPECT_EQ(5001.0f, elements[5001]);
+    EXPECT_EQ(99999.0f, elements[99999]);
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+
+    // A binary search reads a handful of blocks, not the whole array.
+    GetCallStats().Reset();
+    size_t low = 0;
+    size_t high = elements.size();
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (elements[mid] < 12345.0f) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    EXPECT_EQ(12345u, low);
+    EXPECT_GE(17u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayElements));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, LazyReadOnlyReplacesCachedBlocks) {
+    gArray.resize(10);
+    for (size_t i = 0; i < gArray.size(); ++i) {
+        gArray[i] = static_cast<jfloat>(i);
+    }
+    ScopedArrayLazyRO<jfloat, 4, 1> elements(env_, array_);
+    EXPECT_EQ(1.0f, elements[1]);
+    EXPECT_EQ(9.0f, elements[9]);  // The last, partial block replaces the first.
+    EXPECT_EQ(0.0f, elements[0]);
+    EXPECT_EQ(3.0f, elements[3]);
+    EXPECT_EQ(3u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ThreadBufferPoolIsDisabledByDefault) {
+    EXPECT_EQ(nullptr, nativehelper::ThreadBufferPool::Current());
+    gArray.assign(5000, 1.0f);
+    ScopedFloatArrayRO elements(env_, array_);
+    EXPECT_EQ(gArray.data(), elements.get());
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ReadOnlyReusesPooledBuffers) {
+    nativehelper::ThreadBufferPool::SetEnabled(true);
+    nativehelper::ThreadBufferPool* pool = nativehelper::ThreadBufferPool::Current();
+    ASSERT_NE(nullptr, pool);
+    gArray.resize(5000);
+    for (size_t i = 0; i < gArray.size(); ++i) {
+        gArray[i] = static_cast<jfloat>(i);
+    }
+
+    const jfloat* first;
+    {
+        ScopedFloatArrayRO elements(env_, array_);
+        first = elements.get();
+        EXPECT_NE(gArray.data(), first);
+        EXPECT_EQ(4999.0f, elements[4999]);
+    }
+    EXPECT_EQ(32768u, pool->cachedBytes());
+    {
+        ScopedFloatArrayRO elements(env_, array_);
+        EXPECT_EQ(first, elements.get());
+        EXPECT_EQ(0u, pool->cachedBytes());
+    }
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayElements));
+
+    // Arrays too large for the pool are still accessed through the runtime.
+    gArray.assign(100000, 1.0f);
+    {
+        ScopedFloatArrayRO elements(env_, array_);
+        EXPECT_EQ(gArray.data(), elements.get());
+    }
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayElements));
+    EXPECT_EQ(JNI_ABORT, gReleaseMode);
+}
+
+TEST_F(ScopedPrimitiveArrayTest, StringsUsePooledBuffers) {
+    JNINativeInterface* functions = GetMockFunctions();
+    functions->GetStringLength = [](JNIEnv*, jstring) -> jsize { return 5; };
+    functions->GetStringUTFLength = [](JNIEnv*, jstring) -> jsize { return 5; };
+    functions->GetStringRegion = [](JNIEnv*, jstring, jsize start, jsize length, jchar* buffer) {
+        const jchar kChars[] = { 'h', 'e', 'l', 'l', 'o' };
+        std::copy(kChars + start, kChars + start + length, buffer);
+    };
+    functions->GetStringUTFRegion = [](JNIEnv*, jstring, jsize start, jsize length,
+                                       char* buffer) {
+        std::copy("hello" + start, "hello" + start + length, buffer);
+    };
+    nativehelper::ThreadBufferPool::SetEnabled(true);
+    jstring string = FakeRef<jstring>(0x700);
+
+    {
+        ScopedUtfChars chars(env_, string);
+        EXPECT_STREQ("hello", chars.c_str());
+        EXPECT_EQ(5u, chars.size());
+    }
+    {
+        ScopedStringChars chars(env_, string);
+        ASSERT_EQ(5u, chars.size());
+        EXPECT_EQ('h', chars[0]);
+        EXPECT_EQ('o', chars[4]);
+    }
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetStringUTFChars));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetStringChars));
+    EXPECT_EQ(256u, nativehelper::ThreadBufferPool::Current()->cachedBytes());
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ArrayAccessPolicyRecordsCopies) {
+    typedef nativehelper::ArrayAccessPolicy<jfloat> Policy;
+    gArray.assign(5000, 1.0f);
+    gElementsCopy = true;
+    {
+        ScopedFloatArrayRO elements(env_, array_);
+        ScopedFloatArrayRW writable(env_, array_);
+    }
+    {
+        ScopedFloatArrayCriticalRO elements(env_, array_);
+    }
+    nativehelper::ArrayAccessStats stats = Policy::GetStats();
+    EXPECT_EQ(2u, stats.elementsCalls);
+    EXPECT_EQ(2u, stats.elementsCopies);
+    EXPECT_EQ(1u, stats.criticalCalls);
+    EXPECT_EQ(0u, stats.criticalCopies);
+    EXPECT_EQ(0u, stats.pinNanos);
+
+    // Copying is always cheaper than GetFloatArrayElements on this runtime, and
+    // callers that can use a critical section should pin arrays too large to copy.
+    size_t maxPooledBytes = nativehelper::ThreadBufferPool::kMaxPooledBytes;
+    EXPECT_EQ(maxPooledBytes, stats.regionCutoffBytes);
+    EXPECT_EQ(nativehelper::ArrayAccess::kRegion, Policy::Choose(5000, true));
+    EXPECT_EQ(nativehelper::ArrayAccess::kCritical, Policy::Choose(1 << 20, true));
+    EXPECT_EQ(nativehelper::ArrayAccess::kElements, Policy::Choose(1 << 20, false));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ArrayAccessPolicyCalibratesCutoff) {
+    typedef nativehelper::ArrayAccessPolicy<jfloat> Policy;
+    EXPECT_EQ(65536u, Policy::regionCutoff());
+
+    // Pinning takes 2us, and copying 1ns per byte, so arrays of 2000 bytes
+    // cost as much to copy as to pin.
+    Policy::RecordTimedElements(JNI_FALSE, 2000);
+    Policy::RecordTimedRegion(4096, 16384);
+    nativehelper::ArrayAccessStats stats = Policy::GetStats();
+    EXPECT_EQ(2000u, stats.pinNanos);
+    EXPECT_EQ(1000u, stats.copyPicosPerByte);
+    EXPECT_EQ(2000u, stats.regionCutoffBytes);
+    EXPECT_EQ(500u, Policy::regionCutoff());
+
+    // Later samples move the averages by an eighth of the difference.
+    Policy::RecordTimedElements(JNI_FALSE, 2800);
+    Policy::RecordTimedRegion(4096, 24576);
+    Policy::RecordTimedRegion(64, 1000000);  // Too small to be timed.
+    stats = Policy::GetStats();
+    EXPECT_EQ(2100u, stats.pinNanos);          // 2000 - 2000 / 8 + 2800 / 8
+    EXPECT_EQ(1062u, stats.copyPicosPerByte);  // 1000 - 1000 / 8 + 1500 / 8
+    EXPECT_EQ(1977u, stats.regionCutoffBytes);
+    EXPECT_EQ(2u, stats.elementsCalls);
+    EXPECT_EQ(0u, stats.elementsCopies);
+
+    // Arrays that fit in the inline buffer are no longer all copied.
+    gArray.assign(900, 1.0f);
+    {
+        ScopedFloatArrayRO elements(env_, array_);
+        EXPECT_EQ(gArray.data(), elements.get());
+    }
+    gArray.assign(100, 1.0f);
+    {
+        ScopedFloatArrayRO elements(env_, array_);
+        EXPECT_NE(gArray.data(), elements.get());
+    }
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayElements));
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+
+    // Small timings never bring the cutoff below 1 KiB.
+    Policy::Reset();
+    Policy::RecordTimedElements(JNI_FALSE, 1);
+    Policy::RecordTimedRegion(4096, 1000000);
+    EXPECT_EQ(1024u, Policy::GetStats().regionCutoffBytes);
+
+    // Nor do large ones take it above the size of the pooled buffers.
+    Policy::Reset();
+    Policy::RecordTimedElements(JNI_FALSE, 1000000);
+    Policy::RecordTimedRegion(4096, 4096);
+    size_t maxPooledBytes = nativehelper::ThreadBufferPool::kMaxPooledBytes;
+    EXPECT_EQ(maxPooledBytes, Policy::GetStats().regionCutoffBytes);
+}
+
+TEST_F(ScopedPrimitiveArrayTest, ArrayAccessPolicyCountsCallsOfEveryThread) {
+    typedef nativehelper::ArrayAccessPolicy<jfloat> Policy;
+    // Each thread counts its calls on its own, and adds them all by the time it exits.
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([] {
+            for (int j = 0; j < 1000; ++j) {
+                Policy::RecordElements(j % 4 == 0 ? JNI_TRUE : JNI_FALSE, 0);
+                Policy::RecordCritical(JNI_FALSE);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    nativehelper::ArrayAccessStats stats = Policy::GetStats();
+    EXPECT_EQ(4000u, stats.elementsCalls);
+    EXPECT_EQ(1000u, stats.elementsCopies);
+    EXPECT_EQ(4000u, stats.criticalCalls);
+    EXPECT_EQ(0u, stats.criticalCopies);
+    EXPECT_EQ(0u, stats.pinNanos);
+}
+
+TEST_F(ScopedPrimitiveArrayTest, RegionReadOnlyCopiesOnlyTheRange) {
+    gArray.resize(100000);
+    for (size_t i = 0; i < gArray.size(); ++i) {
+        gArray[i] = static_cast<jfloat>(i);
+    }
+    {
+        ScopedFloatArrayRegionRO elements(env_, array_, 50000, 200);
+        ASSERT_EQ(200u, elements.size());
+        EXPECT_EQ(50000, elements.offset());
+        EXPECT_EQ(50000.0f, elements[0]);
+        EXPECT_EQ(50199.0f, elements[199]);
+    }
+    {
+        // Ranges larger than the inline buffer are copied into the heap.
+        ScopedFloatArrayRegionRO elements(env_, array_, 10, 5000);
+        EXPECT_EQ(5009.0f, elements[4999]);
+    }
+    EXPECT_EQ(2u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayElements));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, RegionReadWriteWritesBackOnlyTheRange) {
+    gArray.assign(100, 0.0f);
+    {
+        ScopedFloatArrayRegionRW elements(env_, array_, 10, 3);
+        ASSERT_EQ(3u, elements.size());
+        for (jfloat& element : elements) {
+            element = 7.0f;
+        }
+        gArray[50] = 1.0f;  // Outside the range, so not overwritten.
+    }
+    EXPECT_EQ(0.0f, gArray[9]);
+    EXPECT_EQ(7.0f, gArray[10]);
+    EXPECT_EQ(7.0f, gArray[12]);
+    EXPECT_EQ(0.0f, gArray[13]);
+    EXPECT_EQ(1.0f, gArray[50]);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, RegionReadWriteSkipsWriteBackWithExceptionPending) {
+    gArray.assign(100, 0.0f);
+    {
+        ScopedFloatArrayRegionRW elements(env_, array_, 10, 3);
+        ASSERT_EQ(3u, elements.size());
+        elements[0] = 7.0f;
+        // Destroyed with an exception pending.
+        gExceptionPending = true;
+    }
+    EXPECT_EQ(0.0f, gArray[10]);
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+TEST_F(ScopedPrimitiveArrayTest, RegionRejectsOutOfBoundsRanges) {
+    static std::vector<std::string> messages;
+    messages.clear();
+    GetMockFunctions()->FindClass = [](JNIEnv*, const char* name) {
+        EXPECT_STREQ("java/lang/ArrayIndexOutOfBoundsException", name);
+        return FakeRef<jclass>(0x100);
+    };
+    GetMockFunctions()->DeleteLocalRef = [](JNIEnv*, jobject) {};
+    GetMockFunctions()->ThrowNew = [](JNIEnv*, jclass, const char* message) {
+        messages.push_back(message);
+        return JNI_OK;
+    };
+    gArray.assign(10, 0.0f);
+    {
+        ScopedFloatArrayRegionRW elements(env_, array_, 8, 3);
+        EXPECT_EQ(nullptr, elements.get());
+        EXPECT_TRUE(elements.empty());
+    }
+    {
+        ScopedFloatArrayRegionRO elements(env_, array_, -1, 1);
+        EXPECT_EQ(nullptr, elements.get());
+    }
+    {
+        ScopedFloatArrayRegionRO elements(env_, array_, 10, 0);
+        EXPECT_NE(nullptr, elements.get());
+        EXPECT_TRUE(elements.empty());
+    }
+    ASSERT_EQ(2u, messages.size());
+    EXPECT_EQ("length=10; regionStart=8; regionLength=3", messages[0]);
+    EXPECT_EQ("length=10; regionStart=-1; regionLength=1", messages[1]);
+    EXPECT_EQ(1u, GetCallStats().GetCallCount(&JNINativeInterface::GetFloatArrayRegion));
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(&JNINativeInterface::SetFloatArrayRegion));
+}
+
+}  // namespace android
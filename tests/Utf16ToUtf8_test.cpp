@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nativehelper/scoped_utf8_chars.h>
+#include <nativehelper/utf16_to_utf8.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <nativehelper/jni_gtest.h>
+
+namespace android {
+
+namespace {
+
+// A character as UTF-16 and as the UTF-8 it converts to.
+struct TestChar {
+    std::vector<jchar> utf16;
+    std::string utf8;
+};
+
+const TestChar kTestChars[] = {
+    { { 'a' }, "a" },
+    { { 0x0 }, std::string(1, '\0') },
+    { { 0xe9 }, "\xc3\xa9" },                          // é
+    { { 0x20ac }, "\xe2\x82\xac" },                    // €
+    { { 0xd83d, 0xde00 }, "\xf0\x9f\x98\x80" },        // U+1F600, a surrogate pair.
+    { { 0xdbff, 0xdfff }, "\xf4\x8f\xbf\xbf" },        // U+10FFFF
+    { { 0xd800 }, "?" },                               // Unpaired high surrogate.
+    { { 0xdc00 }, "?" },                               // Unpaired low surrogate.
+};
+
+// Returns the UTF-8 of |utf16|, checking that Utf16ToUtf8Length agrees and
+// that the output stays within its bound.
+std::string Convert(const std::vector<jchar>& utf16) {
+    size_t capacity = utf16.size() * nativehelper::kMaxUtf8BytesPerUtf16Unit;
+    std::string utf8(capacity + 1, '\x7f');
+    size_t size = nativehelper::Utf16ToUtf8(utf16.data(), utf16.size(), &utf8[0]);
+    EXPECT_EQ(size, nativehelper::Utf16ToUtf8Length(utf16.data(), utf16.size()));
+    EXPECT_LE(size, capacity);
+    EXPECT_EQ('\x7f', utf8[capacity]);
+    utf8.resize(size);
+    return utf8;
+}
+
+std::vector<jchar> Ascii(const std::string& ascii) {
+    return std::vector<jchar>(ascii.begin(), ascii.end());
+}
+
+}  // namespace
+
+TEST(Utf16ToUtf8Test, Empty) {
+    EXPECT_EQ("", Convert({}));
+}
+
+TEST(Utf16ToUtf8Test, Ascii) {
+    // Every length around the block sizes of the fast paths.
+    std::string ascii;
+    for (size_t length = 0; length < 100; ++length) {
+        EXPECT_EQ(ascii, Convert(Ascii(ascii)));
+        ascii.push_back(static_cast<char>(' ' + length % 95));
+    }
+}
+
+TEST(Utf16ToUtf8Test, Characters) {
+    for (const TestChar& c : kTestChars) {
+        EXPECT_EQ(c.utf8, Convert(c.utf16));
+    }
+}
+
+TEST(Utf16ToUtf8Test, CharactersWithinAscii) {
+    // Put each character at every position of a run of ASCII, so that it falls
+    // in and at the edges of the blocks of the fast path.
+    for (const TestChar& c : kTestChars) {
+        for (size_t position = 0; position < 70; ++position) {
+            std::string before(position, 'x');
+            std::string after(70 - position, 'y');
+            std::vector<jchar> utf16 = Ascii(before);
+            utf16.insert(utf16.end(), c.utf16.begin(), c.utf16.end());
+            std::vector<jchar> tail = Ascii(after);
+            utf16.insert(utf16.end(), tail.begin(), tail.end());
+            EXPECT_EQ(before + c.utf8 + after, Convert(utf16)) << "at " << position;
+        }
+    }
+}
+
+TEST(Utf16ToUtf8Test, SurrogatesAtEnd) {
+    std::vector<jchar> utf16 = Ascii(std::string(31, 'x'));
+    utf16.push_back(0xd83d);
+    EXPECT_EQ(std::string(31, 'x') + "?", Convert(utf16));
+    utf16.push_back(0xde00);
+    EXPECT_EQ(std::string(31, 'x') + "\xf0\x9f\x98\x80", Convert(utf16));
+}
+
+TEST(Utf16ToUtf8Test, Latin1IsNotAscii) {
+    // 0x80 to 0xff fit in a byte, but are not ASCII.
+    std::vector<jchar> utf16(40, 0xff);
+    std::string expected;
+    for (size_t i = 0; i < utf16.size(); ++i) {
+        expected += "\xc3\xbf";
+    }
+    EXPECT_EQ(expected, Convert(utf16));
+}
+
+namespace {
+
+// The chars of the string handed out by the stubbed GetStringCritical.
+std::vector<jchar> gChars;
+bool gInCritical;
+
+}  // namespace
+
+class ScopedUtf8CharsTest : public InstrumentedJNITestBase {
+protected:
+    void SetUp() override {
+        InstrumentedJNITestBase::SetUp();
+        gInCritical = false;
+        JNINativeInterface* functions = GetMockFunctions();
+        functions->GetStringLength = [](JNIEnv*, jstring) {
+            return static_cast<jsize>(gChars.size());
+        };
+        functions->GetStringCritical = [](JNIEnv*, jstring, jboolean*) -> const jchar* {
+            EXPECT_FALSE(gInCritical);
+            gInCritical = true;
+            return gChars.data();
+        };
+        functions->ReleaseStringCritical = [](JNIEnv*, jstring, const jchar* chars) {
+            EXPECT_TRUE(gInCritical);
+            EXPECT_EQ(gChars.data(), chars);
+            gInCritical = false;
+        };
+    }
+
+    void TearDown() override {
+        nativehelper::ThreadBufferPool::SetEnabled(false);
+        InstrumentedJNITestBase::TearDown();
+    }
+
+    jstring string_ = FakeRef<jstring>(0x700);
+};
+
+TEST_F(ScopedUtf8CharsTest, ConvertsString) {
+    gChars = { 'c', 'a', 'f', 0xe9, ' ', 0xd83d, 0xde00 };
+    ScopedUtf8Chars chars(env_, string_);
+    EXPECT_FALSE(gInCritical);
+    EXPECT_STREQ("caf\xc3\xa9 \xf0\x9f\x98\x80", chars.c_str());
+    EXPECT_EQ(10u, chars.size());
+    EXPECT_EQ(0u, GetCallStats().GetCallCount(
+                      &JNINativeInterface::GetStringUTFChars));
+}
+
+TEST_F(ScopedUtf8CharsTest, ConvertsLongStrings) {
+    std::string ascii(1000, 'z');
+    gChars = Ascii(ascii);
+    {
+        ScopedUtf8Chars chars(env_, string_);
+        EXPECT_EQ(ascii, chars.c_str());
+    }
+    nativehelper::ThreadBufferPool::SetEnabled(true);
+    {
+        ScopedUtf8Chars chars(env_, string_);
+        EXPECT_EQ(ascii, chars.c_str());
+    }
+    EXPECT_EQ(4096u, nativehelper::ThreadBufferPool::Current()->cachedBytes());
+}
+
+}  // namespace android
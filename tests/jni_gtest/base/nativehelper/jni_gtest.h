@@ -17,7 +17,11 @@
 #ifndef LIBNATIVEHELPER_TESTS_JNI_GTEST_BASE_NATIVEHELPER_JNI_GTEST_H_
 #define LIBNATIVEHELPER_TESTS_JNI_GTEST_BASE_NATIVEHELPER_JNI_GTEST_H_
 
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <type_traits>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -55,6 +59,276 @@ namespace android {
 //    void TearDown();
 // }
 
+// Invokes V(name) for every function in JNINativeInterface, in table order.
+#define JNI_GTEST_FOR_EACH_JNI_FUNCTION(V) \
+    V(GetVersion) V(DefineClass) V(FindClass) V(FromReflectedMethod) V(FromReflectedField) \
+    V(ToReflectedMethod) V(GetSuperclass) V(IsAssignableFrom) V(ToReflectedField) V(Throw) \
+    V(ThrowNew) V(ExceptionOccurred) V(ExceptionDescribe) V(ExceptionClear) V(FatalError) \
+    V(PushLocalFrame) V(PopLocalFrame) V(NewGlobalRef) V(DeleteGlobalRef) V(DeleteLocalRef) \
+    V(IsSameObject) V(NewLocalRef) V(EnsureLocalCapacity) V(AllocObject) V(NewObject) \
+    V(NewObjectV) V(NewObjectA) V(GetObjectClass) V(IsInstanceOf) V(GetMethodID) \
+    V(CallObjectMethod) V(CallObjectMethodV) V(CallObjectMethodA) V(CallBooleanMethod) \
+    V(CallBooleanMethodV) V(CallBooleanMethodA) V(CallByteMethod) V(CallByteMethodV) \
+    V(CallByteMethodA) V(CallCharMethod) V(CallCharMethodV) V(CallCharMethodA) V(CallShortMethod) \
+    V(CallShortMethodV) V(CallShortMethodA) V(CallIntMethod) V(CallIntMethodV) V(CallIntMethodA) \
+    V(CallLongMethod) V(CallLongMethodV) V(CallLongMethodA) V(CallFloatMethod) V(CallFloatMethodV) \
+    V(CallFloatMethodA) V(CallDoubleMethod) V(CallDoubleMethodV) V(CallDoubleMethodA) \
+    V(CallVoidMethod) V(CallVoidMethodV) V(CallVoidMethodA) V(CallNonvirtualObjectMethod) \
+    V(CallNonvirtualObjectMethodV) V(CallNonvirtualObjectMethodA) V(CallNonvirtualBooleanMethod) \
+    V(CallNonvirtualBooleanMethodV) V(CallNonvirtualBooleanMethodA) V(CallNonvirtualByteMethod) \
+    V(CallNonvirtualByteMethodV) V(CallNonvirtualByteMethodA) V(CallNonvirtualCharMethod) \
+    V(CallNonvirtualCharMethodV) V(CallNonvirtualCharMethodA) V(CallNonvirtualShortMethod) \
+    V(CallNonvirtualShortMethodV) V(CallNonvirtualShortMethodA) V(CallNonvirtualIntMethod) \
+    V(CallNonvirtualIntMethodV) V(CallNonvirtualIntMethodA) V(CallNonvirtualLongMethod) \
+    V(CallNonvirtualLongMethodV) V(CallNonvirtualLongMethodA) V(CallNonvirtualFloatMethod) \
+    V(CallNonvirtualFloatMethodV) V(CallNonvirtualFloatMethodA) V(CallNonvirtualDoubleMethod) \
+    V(CallNonvirtualDoubleMethodV) V(CallNonvirtualDoubleMethodA) V(CallNonvirtualVoidMethod) \
+    V(CallNonvirtualVoidMethodV) V(CallNonvirtualVoidMethodA) V(GetFieldID) V(GetObjectField) \
+    V(GetBooleanField) V(GetByteField) V(GetCharField) V(GetShortField) V(GetIntField) \
+    V(GetLongField) V(GetFloatField) V(GetDoubleField) V(SetObjectField) V(SetBooleanField) \
+    V(SetByteField) V(SetCharField) V(SetShortField) V(SetIntField) V(SetLongField) \
+    V(SetFloatField) V(SetDoubleField) V(GetStaticMethodID) V(CallStaticObjectMethod) \
+    V(CallStaticObjectMethodV) V(CallStaticObjectMethodA) V(CallStaticBooleanMethod) \
+    V(CallStaticBooleanMethodV) V(CallStaticBooleanMethodA) V(CallStaticByteMethod) \
+    V(CallStaticByteMethodV) V(CallStaticByteMethodA) V(CallStaticCharMethod) \
+    V(CallStaticCharMethodV) V(CallStaticCharMethodA) V(CallStaticShortMethod) \
+    V(CallStaticShortMethodV) V(CallStaticShortMethodA) V(CallStaticIntMethod) \
+    V(CallStaticIntMethodV) V(CallStaticIntMethodA) V(CallStaticLongMethod) \
+    V(CallStaticLongMethodV) V(CallStaticLongMethodA) V(CallStaticFloatMethod) \
+    V(CallStaticFloatMethodV) V(CallStaticFloatMethodA) V(CallStaticDoubleMethod) \
+    V(CallStaticDoubleMethodV) V(CallStaticDoubleMethodA) V(CallStaticVoidMethod) \
+    V(CallStaticVoidMethodV) V(CallStaticVoidMethodA) V(GetStaticFieldID) V(GetStaticObjectField) \
+    V(GetStaticBooleanField) V(GetStaticByteField) V(GetStaticCharField) V(GetStaticShortField) \
+    V(GetStaticIntField) V(GetStaticLongField) V(GetStaticFloatField) V(GetStaticDoubleField) \
+    V(SetStaticObjectField) V(SetStaticBooleanField) V(SetStaticByteField) V(SetStaticCharField) \
+    V(SetStaticShortField) V(SetStaticIntField) V(SetStaticLongField) V(SetStaticFloatField) \
+    V(SetStaticDoubleField) V(NewString) V(GetStringLength) V(GetStringChars) \
+    V(ReleaseStringChars) V(NewStringUTF) V(GetStringUTFLength) V(GetStringUTFChars) \
+    V(ReleaseStringUTFChars) V(GetArrayLength) V(NewObjectArray) V(GetObjectArrayElement) \
+    V(SetObjectArrayElement) V(NewBooleanArray) V(NewByteArray) V(NewCharArray) V(NewShortArray) \
+    V(NewIntArray) V(NewLongArray) V(NewFloatArray) V(NewDoubleArray) V(GetBooleanArrayElements) \
+    V(GetByteArrayElements) V(GetCharArrayElements) V(GetShortArrayElements) \
+    V(GetIntArrayElements) V(GetLongArrayElements) V(GetFloatArrayElements) \
+    V(GetDoubleArrayElements) V(ReleaseBooleanArrayElements) V(ReleaseByteArrayElements) \
+    V(ReleaseCharArrayElements) V(ReleaseShortArrayElements) V(ReleaseIntArrayElements) \
+    V(ReleaseLongArrayElements) V(ReleaseFloatArrayElements) V(ReleaseDoubleArrayElements) \
+    V(GetBooleanArrayRegion) V(GetByteArrayRegion) V(GetCharArrayRegion) V(GetShortArrayRegion) \
+    V(GetIntArrayRegion) V(GetLongArrayRegion) V(GetFloatArrayRegion) V(GetDoubleArrayRegion) \
+    V(SetBooleanArrayRegion) V(SetByteArrayRegion) V(SetCharArrayRegion) V(SetShortArrayRegion) \
+    V(SetIntArrayRegion) V(SetLongArrayRegion) V(SetFloatArrayRegion) V(SetDoubleArrayRegion) \
+    V(RegisterNatives) V(UnregisterNatives) V(MonitorEnter) V(MonitorExit) V(GetJavaVM) \
+    V(GetStringRegion) V(GetStringUTFRegion) V(GetPrimitiveArrayCritical) \
+    V(ReleasePrimitiveArrayCritical) V(GetStringCritical) V(ReleaseStringCritical) \
+    V(NewWeakGlobalRef) V(DeleteWeakGlobalRef) V(ExceptionCheck) V(NewDirectByteBuffer) \
+    V(GetDirectBufferAddress) V(GetDirectBufferCapacity) V(GetObjectRefType)
+
+// Counts of the JNI calls made through an instrumented JNIEnv (see
+// InstrumentedMockJNIProvider), kept per function table slot, along with the
+// number of local references created and deleted.
+//
+// Local references are considered created whenever a function other than
+// NewGlobalRef/NewWeakGlobalRef returns a non-null reference, and deleted by
+// DeleteLocalRef or by the PopLocalFrame that ends the frame they were
+// created in.
+class JNICallStats {
+public:
+    static constexpr size_t kSlotCount = sizeof(JNINativeInterface) / sizeof(void*);
+
+    JNICallStats() {
+        Reset();
+    }
+
+    // Returns the index of |slot| in the function table, e.g.
+    // SlotIndex(&JNINativeInterface::GetIntField).
+    template <typename Fn>
+    static size_t SlotIndex(Fn JNINativeInterface::* slot) {
+        static const JNINativeInterface table = {};
+        const char* base = reinterpret_cast<const char*>(&table);
+        return (reinterpret_cast<const char*>(&(table.*slot)) - base) / sizeof(void*);
+    }
+
+    // Number of calls made through |slot|, e.g.
+    // GetCallCount(&JNINativeInterface::GetIntField).
+    template <typename Fn>
+    size_t GetCallCount(Fn JNINativeInterface::* slot) const {
+        return calls_[SlotIndex(slot)];
+    }
+
+    // Number of calls made through any slot.
+    size_t GetTotalCallCount() const {
+        size_t total = 0;
+        for (size_t count : calls_) {
+            total += count;
+        }
+        return total;
+    }
+
+    size_t GetLocalRefsCreated() const {
+        return local_refs_created_;
+    }
+
+    size_t GetLocalRefsDeleted() const {
+        return local_refs_deleted_;
+    }
+
+    // Local references created and not yet deleted.
+    ptrdiff_t GetLiveLocalRefs() const {
+        return static_cast<ptrdiff_t>(local_refs_created_) -
+               static_cast<ptrdiff_t>(local_refs_deleted_);
+    }
+
+    // Zeroes all counts, e.g. after warming up any lazily cached state.
+    void Reset() {
+        memset(calls_, 0, sizeof(calls_));
+        local_refs_created_ = 0;
+        local_refs_deleted_ = 0;
+        frames_.clear();
+    }
+
+    void OnCall(size_t slot) {
+        calls_[slot]++;
+    }
+
+    void OnLocalRefCreated() {
+        local_refs_created_++;
+    }
+
+    void OnLocalRefDeleted() {
+        local_refs_deleted_++;
+    }
+
+    void OnPushLocalFrame() {
+        frames_.push_back({local_refs_created_, local_refs_deleted_});
+    }
+
+    void OnPopLocalFrame() {
+        if (frames_.empty()) {
+            return;
+        }
+        Frame frame = frames_.back();
+        frames_.pop_back();
+        size_t created = local_refs_created_ - frame.created;
+        size_t deleted = local_refs_deleted_ - frame.deleted;
+        if (created > deleted) {
+            local_refs_deleted_ += created - deleted;
+        }
+    }
+
+private:
+    struct Frame {
+        size_t created;
+        size_t deleted;
+    };
+
+    size_t calls_[kSlotCount];
+    size_t local_refs_created_;
+    size_t local_refs_deleted_;
+    std::vector<Frame> frames_;
+};
+
+// A JNIEnv whose function table counts each call in a JNICallStats and then
+// forwards it to the function table of a delegate JNIEnv. Functions are always
+// passed the instrumented JNIEnv, so calls made back into the environment by
+// stubbed functions are counted too.
+//
+// C-style variadic functions (e.g. CallObjectMethod) cannot be forwarded and
+// are left null. The JNIEnv C++ wrappers only call the V variants, which are
+// counted like any other function.
+struct InstrumentedJNIEnv {
+    JNIEnv env;  // Must be first, the trampolines cast JNIEnv* to InstrumentedJNIEnv*.
+    JNINativeInterface functions;
+    JNIEnv* delegate;
+    JNICallStats stats;
+
+    explicit InstrumentedJNIEnv(JNIEnv* delegate_env);
+
+    static InstrumentedJNIEnv* FromJNIEnv(JNIEnv* env) {
+        return reinterpret_cast<InstrumentedJNIEnv*>(env);
+    }
+};
+
+template <typename Fn, Fn JNINativeInterface::* kSlot>
+struct InstrumentedJNISlot;
+
+template <typename R, typename... Args, R (*JNINativeInterface::* kSlot)(JNIEnv*, Args...)>
+struct InstrumentedJNISlot<R (*)(JNIEnv*, Args...), kSlot> {
+    static R Call(JNIEnv* env, Args... args) {
+        InstrumentedJNIEnv* self = InstrumentedJNIEnv::FromJNIEnv(env);
+        const size_t slot = JNICallStats::SlotIndex(kSlot);
+        self->stats.OnCall(slot);
+        if (slot == JNICallStats::SlotIndex(&JNINativeInterface::DeleteLocalRef)) {
+            OnDeleteLocalRef(self, args...);
+        } else if (slot == JNICallStats::SlotIndex(&JNINativeInterface::PopLocalFrame)) {
+            self->stats.OnPopLocalFrame();
+        }
+        auto fn = self->delegate->functions->*kSlot;
+        return Forward(self, slot, fn, env, args...);
+    }
+
+    static void Install(JNINativeInterface* functions) {
+        functions->*kSlot = &Call;
+    }
+
+private:
+    template <typename T = R>
+    static typename std::enable_if<std::is_void<T>::value>::type
+    Forward(InstrumentedJNIEnv*, size_t, R (*fn)(JNIEnv*, Args...), JNIEnv* env, Args... args) {
+        fn(env, args...);
+    }
+
+    template <typename T = R>
+    static typename std::enable_if<!std::is_void<T>::value, T>::type
+    Forward(InstrumentedJNIEnv* self, size_t slot, R (*fn)(JNIEnv*, Args...), JNIEnv* env,
+            Args... args) {
+        R result = fn(env, args...);
+        OnResult(self, slot, result);
+        return result;
+    }
+
+    template <typename T>
+    static void OnResult(InstrumentedJNIEnv* self, size_t slot, T result) {
+        if (std::is_convertible<T, jobject>::value) {
+            if (result != T() &&
+                slot != JNICallStats::SlotIndex(&JNINativeInterface::NewGlobalRef) &&
+                slot != JNICallStats::SlotIndex(&JNINativeInterface::NewWeakGlobalRef)) {
+                self->stats.OnLocalRefCreated();
+            }
+        } else if (slot == JNICallStats::SlotIndex(&JNINativeInterface::PushLocalFrame)) {
+            if (result == T()) {  // JNI_OK
+                self->stats.OnPushLocalFrame();
+            }
+        }
+    }
+
+    template <typename... Ts>
+    static void OnDeleteLocalRef(InstrumentedJNIEnv* self, jobject ref, Ts...) {
+        if (ref != nullptr) {
+            self->stats.OnLocalRefDeleted();
+        }
+    }
+
+    template <typename... Ts>
+    static void OnDeleteLocalRef(InstrumentedJNIEnv*, Ts...) {
+    }
+};
+
+template <typename R, typename... Args, R (*JNINativeInterface::* kSlot)(JNIEnv*, Args..., ...)>
+struct InstrumentedJNISlot<R (*)(JNIEnv*, Args..., ...), kSlot> {
+    static void Install(JNINativeInterface*) {
+        // Not forwarded, see InstrumentedJNIEnv.
+    }
+};
+
+inline InstrumentedJNIEnv::InstrumentedJNIEnv(JNIEnv* delegate_env)
+    : env{&functions}, delegate(delegate_env) {
+    memset(&functions, 0, sizeof(functions));
+#define JNI_GTEST_INSTALL_SLOT(name)                                                        \
+    InstrumentedJNISlot<decltype(JNINativeInterface::name), &JNINativeInterface::name>::    \
+            Install(&functions);
+    JNI_GTEST_FOR_EACH_JNI_FUNCTION(JNI_GTEST_INSTALL_SLOT)
+#undef JNI_GTEST_INSTALL_SLOT
+}
+
 template <typename Provider, typename Test = ::testing::Test>
 class JNITestBase : public Test {
 protected:
@@ -69,8 +343,8 @@ protected:
     }
 
     void TearDown() override {
-        provider_->DestroyJNIEnv(env_);
-        provider_->TearDown();
+        provider_.DestroyJNIEnv(env_);
+        provider_.TearDown();
         Test::TearDown();
     }
 
@@ -121,6 +395,62 @@ protected:
     }
 };
 
+// A MockJNIProvider whose JNIEnvs count the JNI calls and local references
+// made through them, so that tests can check JNI call budgets:
+//
+//   JNIEnv* env = provider.CreateJNIEnv();
+//   InstrumentedMockJNIProvider::GetMockFunctions(env)->GetIntField = ...;
+//   ...
+//   InstrumentedMockJNIProvider::GetCallStats(env).Reset();
+//   jniGetNioBufferFields(env, buffer, &position, &limit, &shift);
+//   EXPECT_EQ(3u, InstrumentedMockJNIProvider::GetCallStats(env)
+//                     .GetCallCount(&JNINativeInterface::GetIntField));
+//
+// As with MockJNIProvider, the test must stub out any needed functions in the
+// mock function table; calls to functions left null will crash.
+class InstrumentedMockJNIProvider : public MockJNIProvider {
+public:
+    JNIEnv* CreateJNIEnv() {
+        return &(new InstrumentedJNIEnv(CreateMockedJNIEnv().release()))->env;
+    }
+
+    void DestroyJNIEnv(JNIEnv* env) {
+        InstrumentedJNIEnv* instrumented = InstrumentedJNIEnv::FromJNIEnv(env);
+        MockJNIProvider::DestroyJNIEnv(instrumented->delegate);
+        delete instrumented;
+    }
+
+    // The mocked function table that calls are forwarded to.
+    static JNINativeInterface* GetMockFunctions(JNIEnv* env) {
+        JNIEnv* delegate = InstrumentedJNIEnv::FromJNIEnv(env)->delegate;
+        return const_cast<JNINativeInterface*>(delegate->functions);
+    }
+
+    static JNICallStats& GetCallStats(JNIEnv* env) {
+        return InstrumentedJNIEnv::FromJNIEnv(env)->stats;
+    }
+};
+
+// A JNITestBase for InstrumentedMockJNIProvider, with shorthands for the mock
+// function table and the call stats of |env_|.
+class InstrumentedJNITestBase : public JNITestBase<InstrumentedMockJNIProvider> {
+protected:
+    JNINativeInterface* GetMockFunctions() {
+        return InstrumentedMockJNIProvider::GetMockFunctions(env_);
+    }
+
+    JNICallStats& GetCallStats() {
+        return InstrumentedMockJNIProvider::GetCallStats(env_);
+    }
+};
+
+// Returns an opaque reference or id for a stubbed function to hand out. It is
+// never dereferenced.
+template <typename T>
+T FakeRef(uintptr_t value) {
+    return reinterpret_cast<T>(value);
+}
+
 }  // namespace android
 
 #endif  // LIBNATIVEHELPER_TESTS_JNI_GTEST_BASE_NATIVEHELPER_JNI_GTEST_H_
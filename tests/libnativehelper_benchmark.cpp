@@ -0,0 +1,687 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks for the C API exported in libnativehelper.map.txt.
+//
+// Every benchmark runs against a fake JNIEnv whose functions do no real work
+// beyond spinning for a configurable latency, so the numbers reported are the
+// cost of libnativehelper itself plus (JNI calls/op * latency). The benchmark
+// argument "jni_latency_ns" sets the simulated cost of each JNI call.
+//
+// Results are written as JSON unless another --benchmark_format is given, with
+// the following per-iteration counters alongside the usual ns/op timings:
+//
+//   jni_calls   - number of JNIEnv function table calls made per operation.
+//   allocs      - number of operator new and operator new[] calls made per
+//                 operation. Direct malloc() calls are not counted.
+//
+// JNI_CreateJavaVM, JNI_GetCreatedJavaVMs, JNI_GetDefaultJavaVMInitArgs and
+// JniInvocationInit need a real runtime library to be loaded and are not
+// covered here.
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <android/log.h>
+#include <nativehelper/JNIHelp.h>
+#include <nativehelper/JniInvocation.h>
+
+namespace {
+
+// Counters updated by the fake JNIEnv and the global allocator below. They are
+// per thread so that multithreaded benchmarks do not contend on them.
+thread_local size_t g_jni_calls = 0;
+thread_local size_t g_allocs = 0;
+
+// Simulated cost of each JNI call.
+thread_local std::chrono::nanoseconds g_jni_latency(0);
+
+// Distinct, non-null values handed out by the fake JNIEnv. None of them are
+// dereferenced by libnativehelper.
+char g_fake_class;
+char g_fake_object;
+char g_fake_string;
+char g_fake_array;
+char g_fake_field;
+
+template <typename T>
+T FakeHandle(char* storage) {
+    return reinterpret_cast<T>(storage);
+}
+
+void OnJniCall() {
+    ++g_jni_calls;
+    if (g_jni_latency.count() != 0) {
+        auto end = std::chrono::steady_clock::now() + g_jni_latency;
+        while (std::chrono::steady_clock::now() < end) {
+        }
+    }
+}
+
+// Fake JNI functions. Exceptions are never left pending so that each benchmark
+// measures the path taken when no earlier exception is outstanding.
+
+jclass FakeFindClass(JNIEnv*, const char*) {
+    OnJniCall();
+    return FakeHandle<jclass>(&g_fake_class);
+}
+
+jint FakeThrow(JNIEnv*, jthrowable) {
+    OnJniCall();
+    return JNI_OK;
+}
+
+jint FakeThrowNew(JNIEnv*, jclass, const char*) {
+    OnJniCall();
+    return JNI_OK;
+}
+
+jthrowable FakeExceptionOccurred(JNIEnv*) {
+    OnJniCall();
+    return nullptr;
+}
+
+void FakeExceptionClear(JNIEnv*) {
+    OnJniCall();
+}
+
+jboolean FakeExceptionCheck(JNIEnv*) {
+    OnJniCall();
+    return JNI_FALSE;
+}
+
+jobject FakeNewGlobalRef(JNIEnv*, jobject obj) {
+    OnJniCall();
+    return obj;
+}
+
+void FakeDeleteRef(JNIEnv*, jobject) {
+    OnJniCall();
+}
+
+jobject FakeAllocObject(JNIEnv*, jclass) {
+    OnJniCall();
+    return FakeHandle<jobject>(&g_fake_object);
+}
+
+jobject FakeNewObjectV(JNIEnv*, jclass, jmethodID, va_list) {
+    OnJniCall();
+    return FakeHandle<jobject>(&g_fake_object);
+}
+
+jclass FakeGetObjectClass(JNIEnv*, jobject) {
+    OnJniCall();
+    return FakeHandle<jclass>(&g_fake_class);
+}
+
+// Method ids are the method names, which outlive the ids as they are string
+// literals in libnativehelper. This lets the fake calls below tell methods apart.
+jmethodID FakeGetMethodID(JNIEnv*, jclass, const char* name, const char*) {
+    OnJniCall();
+    return reinterpret_cast<jmethodID>(const_cast<char*>(name));
+}
+
+bool IsFakeMethod(jmethodID method, const char* name) {
+    return strcmp(reinterpret_cast<const char*>(method), name) == 0;
+}
+
+jfieldID FakeGetFieldID(JNIEnv*, jclass, const char*, const char*) {
+    OnJniCall();
+    return FakeHandle<jfieldID>(&g_fake_field);
+}
+
+jobject FakeCallObjectMethodV(JNIEnv*, jobject, jmethodID method, va_list) {
+    OnJniCall();
+    if (IsFakeMethod(method, "getStackTrace")) {
+        return FakeHandle<jobject>(&g_fake_array);
+    }
+    if (IsFakeMethod(method, "getCause")) {
+        return nullptr;
+    }
+    return FakeHandle<jobject>(&g_fake_string);
+}
+
+jint FakeCallIntMethodV(JNIEnv*, jobject, jmethodID, va_list) {
+    OnJniCall();
+    return 42;
+}
+
+jboolean FakeCallBooleanMethodV(JNIEnv*, jobject, jmethodID, va_list) {
+    OnJniCall();
+    return JNI_TRUE;
+}
+
+void FakeCallVoidMethodV(JNIEnv*, jobject, jmethodID, va_list) {
+    OnJniCall();
+}
+
+void FakeCallNonvirtualVoidMethodV(JNIEnv*, jobject, jclass, jmethodID, va_list) {
+    OnJniCall();
+}
+
+jobject FakeCallStaticObjectMethodV(JNIEnv*, jclass, jmethodID, va_list) {
+    OnJniCall();
+    return FakeHandle<jobject>(&g_fake_array);
+}
+
+jint FakeCallStaticIntMethodV(JNIEnv*, jclass, jmethodID, va_list) {
+    OnJniCall();
+    return 0;
+}
+
+jint FakeGetIntField(JNIEnv*, jobject, jfieldID) {
+    OnJniCall();
+    return 1;
+}
+
+jlong FakeGetLongField(JNIEnv*, jobject, jfieldID) {
+    OnJniCall();
+    return 4096;
+}
+
+void FakeSetIntField(JNIEnv*, jobject, jfieldID, jint) {
+    OnJniCall();
+}
+
+jstring FakeNewString(JNIEnv*, const jchar*, jsize) {
+    OnJniCall();
+    return FakeHandle<jstring>(&g_fake_string);
+}
+
+jstring FakeNewStringUTF(JNIEnv*, const char*) {
+    OnJniCall();
+    return FakeHandle<jstring>(&g_fake_string);
+}
+
+// All fake strings have these contents.
+constexpr char kFakeStringChars[] = "android.fake.FakeClass";
+
+jsize FakeGetStringLength(JNIEnv*, jstring) {
+    OnJniCall();
+    return sizeof(kFakeStringChars) - 1;
+}
+
+jsize FakeGetStringUTFLength(JNIEnv*, jstring) {
+    OnJniCall();
+    return sizeof(kFakeStringChars) - 1;
+}
+
+void FakeGetStringUTFRegion(JNIEnv*, jstring, jsize start, jsize length, char* buf) {
+    OnJniCall();
+    memcpy(buf, kFakeStringChars + start, length);
+    buf[length] = '\0';
+}
+
+const char* FakeGetStringUTFChars(JNIEnv*, jstring, jboolean* isCopy) {
+    OnJniCall();
+    if (isCopy != nullptr) {
+        *isCopy = JNI_FALSE;
+    }
+    return "java.lang.RuntimeException: fake\n\tat Fake.method(Fake.java:1)";
+}
+
+void FakeReleaseStringUTFChars(JNIEnv*, jstring, const char*) {
+    OnJniCall();
+}
+
+jobjectArray FakeNewObjectArray(JNIEnv*, jsize, jclass, jobject) {
+    OnJniCall();
+    return FakeHandle<jobjectArray>(&g_fake_array);
+}
+
+// The number of frames in the stack trace of every fake exception.
+constexpr jsize kFakeStackTraceDepth = 100;
+
+jsize FakeGetArrayLength(JNIEnv*, jarray) {
+    OnJniCall();
+    return kFakeStackTraceDepth;
+}
+
+jobject FakeGetObjectArrayElement(JNIEnv*, jobjectArray, jsize) {
+    OnJniCall();
+    return FakeHandle<jobject>(&g_fake_object);
+}
+
+jobject FakeNewLocalRef(JNIEnv*, jobject obj) {
+    OnJniCall();
+    return obj;
+}
+
+jboolean FakeIsSameObject(JNIEnv*, jobject a, jobject b) {
+    OnJniCall();
+    return a == b ? JNI_TRUE : JNI_FALSE;
+}
+
+jint FakeRegisterNatives(JNIEnv*, jclass, const JNINativeMethod*, jint) {
+    OnJniCall();
+    return JNI_OK;
+}
+
+class FakeJNIEnv {
+  public:
+    FakeJNIEnv() {
+        memset(&functions_, 0, sizeof(functions_));
+        functions_.FindClass = FakeFindClass;
+        functions_.Throw = FakeThrow;
+        functions_.ThrowNew = FakeThrowNew;
+        functions_.ExceptionOccurred = FakeExceptionOccurred;
+        functions_.ExceptionClear = FakeExceptionClear;
+        functions_.ExceptionCheck = FakeExceptionCheck;
+        functions_.NewGlobalRef = FakeNewGlobalRef;
+        functions_.DeleteGlobalRef = FakeDeleteRef;
+        functions_.DeleteLocalRef = FakeDeleteRef;
+        functions_.NewLocalRef = FakeNewLocalRef;
+        functions_.IsSameObject = FakeIsSameObject;
+        functions_.AllocObject = FakeAllocObject;
+        functions_.NewObjectV = FakeNewObjectV;
+        functions_.GetObjectClass = FakeGetObjectClass;
+        functions_.GetMethodID = FakeGetMethodID;
+        functions_.GetStaticMethodID = FakeGetMethodID;
+        functions_.GetFieldID = FakeGetFieldID;
+        functions_.CallObjectMethodV = FakeCallObjectMethodV;
+        functions_.CallBooleanMethodV = FakeCallBooleanMethodV;
+        functions_.CallIntMethodV = FakeCallIntMethodV;
+        functions_.CallVoidMethodV = FakeCallVoidMethodV;
+        functions_.CallNonvirtualVoidMethodV = FakeCallNonvirtualVoidMethodV;
+        functions_.CallStaticObjectMethodV = FakeCallStaticObjectMethodV;
+        functions_.CallStaticIntMethodV = FakeCallStaticIntMethodV;
+        functions_.GetIntField = FakeGetIntField;
+        functions_.GetLongField = FakeGetLongField;
+        functions_.SetIntField = FakeSetIntField;
+        functions_.NewString = FakeNewString;
+        functions_.NewStringUTF = FakeNewStringUTF;
+        functions_.GetStringLength = FakeGetStringLength;
+        functions_.GetStringUTFLength = FakeGetStringUTFLength;
+        functions_.GetStringUTFRegion = FakeGetStringUTFRegion;
+        functions_.GetStringUTFChars = FakeGetStringUTFChars;
+        functions_.ReleaseStringUTFChars = FakeReleaseStringUTFChars;
+        functions_.NewObjectArray = FakeNewObjectArray;
+        functions_.GetArrayLength = FakeGetArrayLength;
+        functions_.GetObjectArrayElement = FakeGetObjectArrayElement;
+        functions_.RegisterNatives = FakeRegisterNatives;
+        env_.functions = &functions_;
+    }
+
+    JNIEnv* get() {
+        return &env_;
+    }
+
+  private:
+    JNINativeInterface functions_;
+    JNIEnv env_;
+};
+
+// Configures the simulated JNI latency from the benchmark argument, runs |op|
+// for each iteration and reports the per-operation counters.
+template <typename Op>
+void RunJniBenchmark(benchmark::State& state, Op&& op) {
+    static FakeJNIEnv fake_env;
+    JNIEnv* env = fake_env.get();
+    g_jni_latency = std::chrono::nanoseconds(state.range(0));
+
+    // Resolve any lazily cached constants before measuring.
+    op(env);
+
+    g_jni_calls = 0;
+    g_allocs = 0;
+    for (auto _ : state) {
+        op(env);
+    }
+    state.counters["jni_calls"] =
+            benchmark::Counter(static_cast<double>(g_jni_calls), benchmark::Counter::kAvgIterations);
+    state.counters["allocs"] =
+            benchmark::Counter(static_cast<double>(g_allocs), benchmark::Counter::kAvgIterations);
+    g_jni_latency = std::chrono::nanoseconds(0);
+}
+
+#define JNI_BENCHMARK(name)                                                   \
+    BENCHMARK(name)->ArgName("jni_latency_ns")->Arg(0)->Arg(50)->Arg(200)
+
+// Runs |name| on 1 to 64 threads at once. The time per operation should stay
+// flat as threads are added if the threads do not contend.
+#define JNI_THREADED_BENCHMARK(name)                                          \
+    BENCHMARK(name)->ArgName("jni_latency_ns")->Arg(0)->ThreadRange(1, 64)
+
+void BM_jniRegisterNativeMethods(benchmark::State& state) {
+    static const JNINativeMethod kMethods[] = {
+        { "fake", "()V", reinterpret_cast<void*>(&FakeExceptionClear) },
+    };
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniRegisterNativeMethods(env, "Fake", kMethods, NELEM(kMethods));
+    });
+}
+JNI_BENCHMARK(BM_jniRegisterNativeMethods);
+
+void BM_jniThrowException(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniThrowException(env, "java/lang/IllegalArgumentException", "bad argument");
+    });
+}
+JNI_BENCHMARK(BM_jniThrowException);
+
+void BM_jniThrowExceptionWithClass(benchmark::State& state) {
+    jclass exceptionClass = FakeHandle<jclass>(&g_fake_class);
+    RunJniBenchmark(state, [exceptionClass](JNIEnv* env) {
+        jniThrowException(env, exceptionClass, "bad argument");
+    });
+}
+JNI_BENCHMARK(BM_jniThrowExceptionWithClass);
+
+void BM_jniThrowExceptionFmt(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                             "bad offset %d for %s", 42, "/data/local/tmp/file");
+    });
+}
+JNI_BENCHMARK(BM_jniThrowExceptionFmt);
+
+void BM_jniThrowExceptionFmt_LongMessage(benchmark::State& state) {
+    std::string path(600, 'x');
+    RunJniBenchmark(state, [&path](JNIEnv* env) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "bad offset %d for %s", 42,
+                             path.c_str());
+    });
+}
+JNI_BENCHMARK(BM_jniThrowExceptionFmt_LongMessage);
+
+void BM_jniThrowExceptionWithClassFmt(benchmark::State& state) {
+    jclass exceptionClass = FakeHandle<jclass>(&g_fake_class);
+    RunJniBenchmark(state, [exceptionClass](JNIEnv* env) {
+        jniThrowExceptionFmt(env, exceptionClass, "bad offset %d for %s", 42,
+                             "/data/local/tmp/file");
+    });
+}
+JNI_BENCHMARK(BM_jniThrowExceptionWithClassFmt);
+
+void BM_jniThrowNullPointerException(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniThrowNullPointerException(env, "null buffer");
+    });
+}
+JNI_BENCHMARK(BM_jniThrowNullPointerException);
+
+void BM_jniThrowRuntimeException(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniThrowRuntimeException(env, "failed");
+    });
+}
+JNI_BENCHMARK(BM_jniThrowRuntimeException);
+
+void BM_jniThrowIOException(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniThrowIOException(env, EAGAIN);
+    });
+}
+JNI_BENCHMARK(BM_jniThrowIOException);
+
+void BM_jniThrowErrnoException(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniThrowErrnoException(env, "recvfrom", ECONNRESET);
+    });
+}
+JNI_BENCHMARK(BM_jniThrowErrnoException);
+
+void BM_jniThrowChainedException(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniThrowChainedException(env, "java/io/IOException", "read failed");
+    });
+}
+JNI_BENCHMARK(BM_jniThrowChainedException);
+
+void BM_jniThrowPreallocatedException(benchmark::State& state) {
+    jthrowable exception = FakeHandle<jthrowable>(&g_fake_object);
+    RunJniBenchmark(state, [exception](JNIEnv* env) {
+        jniThrowPreallocatedException(env, exception);
+    });
+}
+JNI_BENCHMARK(BM_jniThrowPreallocatedException);
+
+void BM_jniCreateFileDescriptor(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(jniCreateFileDescriptor(env, 0));
+    });
+}
+JNI_BENCHMARK(BM_jniCreateFileDescriptor);
+
+// Includes the cost of resolving the cached constants on first use.
+void BM_jniCreateFileDescriptor_Cold(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniUninitializeConstants();
+        benchmark::DoNotOptimize(jniCreateFileDescriptor(env, 0));
+    });
+}
+JNI_BENCHMARK(BM_jniCreateFileDescriptor_Cold);
+
+void BM_jniGetFDFromFileDescriptor(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(
+                jniGetFDFromFileDescriptor(env, FakeHandle<jobject>(&g_fake_object)));
+    });
+}
+JNI_BENCHMARK(BM_jniGetFDFromFileDescriptor);
+
+void BM_jniGetFDFromFileDescriptor_Threads(benchmark::State& state) {
+    BM_jniGetFDFromFileDescriptor(state);
+}
+JNI_THREADED_BENCHMARK(BM_jniGetFDFromFileDescriptor_Threads);
+
+void BM_jniSetFileDescriptorOfFD(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniSetFileDescriptorOfFD(env, FakeHandle<jobject>(&g_fake_object), 3);
+    });
+}
+JNI_BENCHMARK(BM_jniSetFileDescriptorOfFD);
+
+void BM_jniGetOwnerIdFromFileDescriptor(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(
+                jniGetOwnerIdFromFileDescriptor(env, FakeHandle<jobject>(&g_fake_object)));
+    });
+}
+JNI_BENCHMARK(BM_jniGetOwnerIdFromFileDescriptor);
+
+void BM_jniGetNioBufferBaseArray(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(
+                jniGetNioBufferBaseArray(env, FakeHandle<jobject>(&g_fake_object)));
+    });
+}
+JNI_BENCHMARK(BM_jniGetNioBufferBaseArray);
+
+void BM_jniGetNioBufferBaseArrayOffset(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(
+                jniGetNioBufferBaseArrayOffset(env, FakeHandle<jobject>(&g_fake_object)));
+    });
+}
+JNI_BENCHMARK(BM_jniGetNioBufferBaseArrayOffset);
+
+void BM_jniGetNioBufferPointer(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(
+                jniGetNioBufferPointer(env, FakeHandle<jobject>(&g_fake_object)));
+    });
+}
+JNI_BENCHMARK(BM_jniGetNioBufferPointer);
+
+void BM_jniGetNioBufferFields(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jint position, limit, elementSizeShift;
+        benchmark::DoNotOptimize(
+                jniGetNioBufferFields(env, FakeHandle<jobject>(&g_fake_object),
+                                      &position, &limit, &elementSizeShift));
+    });
+}
+JNI_BENCHMARK(BM_jniGetNioBufferFields);
+
+void BM_jniGetNioBufferFields_Threads(benchmark::State& state) {
+    BM_jniGetNioBufferFields(state);
+}
+JNI_THREADED_BENCHMARK(BM_jniGetNioBufferFields_Threads);
+
+void BM_jniGetReferent(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(jniGetReferent(env, FakeHandle<jobject>(&g_fake_object)));
+    });
+}
+JNI_BENCHMARK(BM_jniGetReferent);
+
+void BM_jniCreateString(benchmark::State& state) {
+    static const jchar kChars[] = { 'h', 'e', 'l', 'l', 'o' };
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(jniCreateString(env, kChars, NELEM(kChars)));
+    });
+}
+JNI_BENCHMARK(BM_jniCreateString);
+
+void BM_jniCreateStringArray(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        benchmark::DoNotOptimize(jniCreateStringArray(&env->functions, 16));
+    });
+}
+JNI_BENCHMARK(BM_jniCreateStringArray);
+
+void BM_jniLogException(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        // Below the default host and device log thresholds, so the cost measured is
+        // libnativehelper's rather than the log writer's.
+        jniLogException(env, ANDROID_LOG_VERBOSE, "libnativehelper_benchmark",
+                        FakeHandle<jthrowable>(&g_fake_object));
+    });
+}
+JNI_BENCHMARK(BM_jniLogException);
+
+void BM_jniLogExceptionWithDepth(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv* env) {
+        jniLogExceptionWithDepth(env, ANDROID_LOG_VERBOSE, "libnativehelper_benchmark",
+                                 FakeHandle<jthrowable>(&g_fake_object), 8);
+    });
+}
+JNI_BENCHMARK(BM_jniLogExceptionWithDepth);
+
+void BM_jniUninitializeConstants(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv*) {
+        jniUninitializeConstants();
+    });
+}
+JNI_BENCHMARK(BM_jniUninitializeConstants);
+
+void BM_JniInvocationCreateDestroy(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv*) {
+        JniInvocationDestroy(JniInvocationCreate());
+    });
+}
+JNI_BENCHMARK(BM_JniInvocationCreateDestroy);
+
+void BM_JniInvocationGetLibrary(benchmark::State& state) {
+    RunJniBenchmark(state, [](JNIEnv*) {
+        benchmark::DoNotOptimize(JniInvocationGetLibrary(nullptr, nullptr));
+    });
+}
+JNI_BENCHMARK(BM_JniInvocationGetLibrary);
+
+}  // namespace
+
+// Count every allocation made through the replaceable operator new and
+// operator new[], including those made inside libnativehelper. Every form is
+// replaced, and every form of operator delete frees with free(), so that
+// allocations and deallocations always match. Memory that libnativehelper or
+// the C library get from malloc() directly, such as strdup() or asprintf()
+// buffers, is not counted.
+namespace {
+
+void* CountedAllocate(size_t size) {
+    ++g_allocs;
+    return malloc(size == 0 ? 1 : size);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+    void* p = CountedAllocate(size);
+    if (p == nullptr) {
+        abort();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    void* p = CountedAllocate(size);
+    if (p == nullptr) {
+        abort();
+    }
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+int main(int argc, char** argv) {
+    // Default to machine-readable output so that runs can be compared.
+    std::vector<char*> args(argv, argv + argc);
+    bool has_format = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--benchmark_format", strlen("--benchmark_format")) == 0) {
+            has_format = true;
+        }
+    }
+    char json_format[] = "--benchmark_format=json";
+    if (!has_format) {
+        args.push_back(json_format);
+    }
+    int new_argc = static_cast<int>(args.size());
+    benchmark::Initialize(&new_argc, args.data());
+    if (benchmark::ReportUnrecognizedArguments(new_argc, args.data())) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}